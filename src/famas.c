@@ -24,12 +24,23 @@
 
 
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include <zlib.h>
 
@@ -37,7 +48,12 @@
 #include "kseq/kseq.h"
 
 
-KSEQ_INIT(gzFile, gzread)
+/* input is read in blocks of this size, which also bounds the
+ * copies of sequence and quality lines */
+#ifndef KSEQ_BUFSIZE
+#define KSEQ_BUFSIZE 65536
+#endif
+KSEQ_INIT2(gzFile, gzread, KSEQ_BUFSIZE)
 
 /* http://stackoverflow.com/questions/3437404/min-and-max-in-c */
 #define max(a,b) \
@@ -61,20 +77,133 @@ KSEQ_INIT(gzFile, gzread)
 #ifndef DEFAULT_MINBQ50P
 #define DEFAULT_MINBQ50P 0
 #endif
+#ifndef DEFAULT_MAX_N
+#define DEFAULT_MAX_N -1
+#endif
+#ifndef DEFAULT_MAX_N_FRAC
+#define DEFAULT_MAX_N_FRAC 1.0
+#endif
 #ifndef DEFAULT_PHREDOFFSET
 #define DEFAULT_PHREDOFFSET 33
 #endif
+#ifndef DEFAULT_WINDOW_SIZE
+#define DEFAULT_WINDOW_SIZE 4
+#endif
+#ifndef DEFAULT_ADAPTER_MISMATCH_RATE
+#define DEFAULT_ADAPTER_MISMATCH_RATE 0.1
+#endif
+#ifndef DEFAULT_ADAPTER_MIN_OVERLAP
+#define DEFAULT_ADAPTER_MIN_OVERLAP 3
+#endif
+#ifndef DEFAULT_POLY_MIN_LEN
+#define DEFAULT_POLY_MIN_LEN 10
+#endif
+/* poly-X tails tolerate one mismatch per that many bases, but no
+ * more than POLY_MAX_MISMATCHES in total */
+#define POLY_MISMATCH_EVERY 8
+#define POLY_MAX_MISMATCHES 5
+/* Illumina 8-level quality binning, as used by --qual-bin: lower
+ * bound:value pairs */
+#define QUAL_BIN_ILLUMINA8 "2:6,10:15,20:22,25:27,30:33,35:37,40:40"
+#define QUAL_BINS_MAX 94
+#define RENAME_NONE 0
+#define RENAME_NUMBER 1
+#define RENAME_STRIP_PREFIX 2
+#define OUT_FORMAT_FASTQ 0
+#define OUT_FORMAT_FASTA 1
+#define OUT_FORMAT_BAM 2
+#define OUT_FORMAT_FBIN 3
+#define IN_FORMAT_FASTQ 0
+#define IN_FORMAT_BAM 1
+#define IN_FORMAT_FBIN 2
+
+#define DEFAULT_RG_ID "A"
+/* uncompressed input per BGZF block (as in htslib) and max block size */
+#define BGZF_BLOCK_INPUT 0xff00
+#define BGZF_BLOCK_MAX 0x10000
+#define BGZF_HDR_LEN 18
+/* gzout containers */
+#define GZOUT_GZIP 0
+#define GZOUT_BGZF 1
+#define GZOUT_FBIN 2
+/* block-columnar binary format. see fbin_write_block() */
+#define FBIN_MAGIC "FBIN\1\0\0\0"
+#define FBIN_ROW_HDR_LEN 13
+#define FBIN_COL_MATE 0
+#define FBIN_COL_LEN 1
+#define FBIN_COL_NAME 2
+#define FBIN_COL_BASES 3
+#define FBIN_COL_EXC 4
+#define FBIN_COL_QUAL 5
+#define FBIN_NCOLS 6
+#define FBIN_EXC_LEN 9
+#define BAM_FPAIRED 1
+#define BAM_FREAD1 64
+#define BAM_FREAD2 128
+#define BAM_FSECONDARY 256
+#define BAM_FSUPPLEMENTARY 2048
+/* flags for unaligned records: paired, unmapped, mate unmapped, first/second */
+#define BAM_FLAG_UNPAIRED 4
+#define BAM_FLAG_READ1 77
+#define BAM_FLAG_READ2 141
+#ifndef DEFAULT_OVERLAP_MIN_LEN
+#define DEFAULT_OVERLAP_MIN_LEN 30
+#endif
+#ifndef OVERLAP_MAX_MISMATCH_RATE
+#define OVERLAP_MAX_MISMATCH_RATE 0.1
+#endif
 #ifndef PAIRED_ORDER_SAMPLERATE
 #define PAIRED_ORDER_SAMPLERATE 10000
 #endif
-#ifndef QUAL_CHECK_SAMPLERATE
-#define QUAL_CHECK_SAMPLERATE 10000
+#ifndef SHARD_BATCHSIZE
+#define SHARD_BATCHSIZE 1000
+#endif
+#ifndef OUTBUF_SIZE
+#define OUTBUF_SIZE 1048576
+#endif
+#ifndef DEFAULT_MAX_OPEN
+#define DEFAULT_MAX_OPEN 32
+#endif
+/* initial number of slots in duplicate set (16 bytes each) */
+#ifndef DEDUP_INIT_SLOTS
+#define DEDUP_INIT_SLOTS 65536
+#endif
+/* false duplicate rate the Bloom filter is designed for (determines
+ * number of bits set per fingerprint), and estimated rate at which it's
+ * considered full and duplicate removal stops */
+#define DEDUP_BLOOM_FPR 0.001
+#define DEDUP_BLOOM_MAX_FPR 0.01
+#ifndef DEFAULT_BARCODE_MISMATCHES
+#define DEFAULT_BARCODE_MISMATCHES 1
+#endif
+/* smaller, since there might be hundreds of samples */
+#ifndef DEMUX_OUTBUF_SIZE
+#define DEMUX_OUTBUF_SIZE 131072
 #endif
 #define EARLY_EXIT_MESSAGE "Don't trust already produced results. Exiting..."
 
 #define TEMPLATE_MARK "XXXXXX"
 #define TEMPLATE_FMT "%06d"
 
+/* fields of Illumina read names to split by */
+#define SPLIT_BY_NONE 0
+#define SPLIT_BY_FLOWCELL 1
+#define SPLIT_BY_LANE 2
+#define SPLIT_BY_TILE 3
+#define SPLIT_KEY_MAXLEN 256
+
+/* 3' trimming algorithms */
+#define TRIM_ALGO_THRESHOLD 0
+#define TRIM_ALGO_WINDOW 1
+#define TRIM_ALGO_MOTT 2
+
+/* k-mer size for adapter seed index. 4^k table entries */
+#define ADAPTER_SEED_K 8
+#define ADAPTER_MAXLEN 1024
+
+#define DEMUX_UNDETERMINED "Undetermined"
+#define DEMUX_MAX_BARCODE_MISMATCHES 3
+
 /* print macro argument as string */
 #define XSTR(a) STR(a)
 #define STR(a) #a
@@ -88,15 +217,56 @@ typedef struct {
      char *infq2;
      char *outfq1;
      char *outfq2;
+     int in_format; /* one of IN_FORMAT_* */
+     int interleaved_in;
+     int interleaved_out;
+     char *merge;
+     char *qual_bin;
+     int mask_below;
+     int drop_comment;
+     int rename; /* one of RENAME_* */
+     int revcomp_r1;
+     int revcomp_r2;
+     int out_format; /* one of OUT_FORMAT_* */
+     char *rg_id;
+     char *rg_sample;
 
      int min5pqual;
      int min3pqual;
      int minbq50p;
+     int max_n;
+     double max_n_frac;
+     double max_dust;
+     int dedup;
+     int dedup_mem; /* in MB. 0 for no limit */
+     int trim_n;
      int phredoffset;
      int minreadlen;
+     int trim_algo;
+     int window_size;
+
+     char *adapters;
+     double adapter_mismatch_rate;
+     int adapter_min_overlap;
+     int trim_overlap;
+     int overlap_min_len;
+     double max_ee;
+     double max_ee_rate;
+     double trunc_ee;
+     double min_mean_qual;
+     int headcrop;
+     int tailcrop;
+     char trim_poly; /* 0, 'G' or 'X' for any base */
+     int poly_min_len;
 
      int sampling;
      int split_every;
+     int shards;
+     int split_by;
+     int max_open;
+
+     char *samplesheet;
+     int barcode_mismatches;
 
      int overwrite_output;
      int append_to_output;
@@ -110,13 +280,101 @@ typedef struct {
 } trim_pos_t;
 
 
+/* 2-bit packed bases of a read, built by pack_seq() for kernels that
+ * don't want ASCII, and only if one of them is enabled. codes as in
+ * nt4_table (A=0, C=1, G=2, T=3; case is lost), 32 per word, first
+ * base in the lowest bits. anything but ACGT is stored as 0 and
+ * flagged in nmask (one bit per base, 64 per word).
+ */
+typedef struct {
+     uint64_t *bases;
+     uint64_t *nmask;
+     int len;
+     int m; /* bases allocated */
+} packed_seq_t;
+
+#define packed_base(p, i) (((p)->bases[(i)>>5] >> (2*((i)&31))) & 3)
+#define packed_is_n(p, i) (((p)->nmask[(i)>>6] >> ((i)&63)) & 1)
+
+
+/* Set of 128-bit read fingerprints for duplicate removal: open
+ * addressing with linear probing in one flat array, kept at most half
+ * full. The array may take at most half of max_bytes, so that old
+ * and new array fit while growing, and a Bloom filter fits next to
+ * it. Once it would outgrow that, all fingerprints are moved into a
+ * Bloom filter of the memory left, which might then report false
+ * duplicates. Its fill level is tracked and once the estimated false
+ * duplicate rate exceeds DEDUP_BLOOM_MAX_FPR, nothing is reported as
+ * duplicate anymore.
+ */
+typedef struct {
+     uint64_t *fp; /* pairs of words. 0/0 marks empty slots */
+     size_t n_slots; /* power of 2. 0 until first use */
+     size_t n; /* fingerprints stored */
+     uint64_t *bloom; /* non-NULL once switched to Bloom filter */
+     uint64_t bloom_mask; /* number of bits minus one */
+     int bloom_k; /* bits set per fingerprint */
+     uint64_t bloom_set; /* bits set so far */
+     uint64_t bloom_max_set; /* bits set at DEDUP_BLOOM_MAX_FPR */
+     int full; /* Bloom filter reached DEDUP_BLOOM_MAX_FPR */
+     size_t max_bytes; /* 0 for no limit */
+} dedup_t;
+
+
+/* per-read statistics, computed in a single pass by read_stats()
+ */
+typedef struct {
+     int len;
+     int num_lowq; /* number of bases with BQ <= threshold (minbq50p) */
+     int num_n;
+     int num_gc;
+     int minq; /* min and max BQ (offset subtracted) */
+     int maxq;
+     const packed_seq_t *packed; /* packed bases of read. might be NULL */
+} read_stats_t;
+
+
 typedef struct {
      int min5pqual;
      int min3pqual;
      int minreadlen;
+     int algo; /* 3' trimming algorithm. one of TRIM_ALGO_* */
+     int window_size; /* only used for TRIM_ALGO_WINDOW */
+     char poly; /* poly-X tail trimming: 0 (off), 'G' or 'X' (any of ACGT) */
+     int trim_n; /* trim N's at both ends */
+     int headcrop; /* unconditionally remove that many bases at 5' */
+     int tailcrop; /* and 3' */
+     int poly_min_len;
+     kstring_t *scratch; /* owned by caller. used by window trimming. may be NULL */
 } trim_args_t;
 
 
+/* output formatting options for fastq_fmt(). all applied to the
+ * output buffer, never to the input record
+ */
+typedef struct {
+     /* quality binning: bins (in ascending order) map all quality
+      * chars >= bin_lo[i] (and below the next bound) to
+      * bin_val[i]. qual_table holds the same as 256-entry
+      * translation table */
+     int num_bins;
+     unsigned char bin_lo[QUAL_BINS_MAX];
+     unsigned char bin_val[QUAL_BINS_MAX];
+     unsigned char qual_table[256];
+     /* bases with quality chars below this are masked as N. 0 if off */
+     int mask_below;
+     int drop_comment;
+     int rename; /* one of RENAME_* */
+     int out_format; /* one of OUT_FORMAT_*. fasta skips qualities */
+     unsigned long read_no; /* used as name for RENAME_NUMBER. set by caller */
+     int revcomp; /* reverse complement seq (and reverse qual). set by caller */
+     /* bam only */
+     int phredoffset;
+     const char *rg_id;
+     int bam_flag; /* one of BAM_FLAG_*. set by caller. also used for fbin */
+} fmt_args_t;
+
+
 /* Logging macros. You have to use at least one fmt+string. Newline
  * characters will not be appended automatically
  */
@@ -148,6 +406,14 @@ int trace = 0;
 /* protoypes
  */
 int read_below_minbq50p(const kseq_t *seq, const int minbq50p, const int phredoffset);
+void read_stats(read_stats_t *stats, const kseq_t *seq, const packed_seq_t *packed,
+                const int lowq, const int phredoffset);
+double dust_score(const packed_seq_t *packed);
+void dedup_hash(uint64_t h[2], const char *s, const int len);
+int dedup_seen(dedup_t *d, const uint64_t h[2]);
+void dedup_free(dedup_t *d);
+int read_filtered(const read_stats_t *stats, const kseq_t *seq, const args_t *args);
+int qual_range_is_valid(const read_stats_t *stats, const kseq_t *seq);
 
 
 /* Taken from the Linux kernel source and slightly modified.
@@ -185,15 +451,54 @@ void dump_args(const args_t *args)
      LOG_DEBUG("  infq2              = %s\n", args->infq2);
      LOG_DEBUG("  outfq1             = %s\n", args->outfq1);
      LOG_DEBUG("  outfq2             = %s\n", args->outfq2);
+     LOG_DEBUG("  in_format          = %d\n", args->in_format);
+     LOG_DEBUG("  interleaved_in     = %d\n", args->interleaved_in);
+     LOG_DEBUG("  interleaved_out    = %d\n", args->interleaved_out);
+     LOG_DEBUG("  merge              = %s\n", args->merge);
+     LOG_DEBUG("  qual_bin           = %s\n", args->qual_bin);
+     LOG_DEBUG("  mask_below         = %d\n", args->mask_below);
+     LOG_DEBUG("  drop_comment       = %d\n", args->drop_comment);
+     LOG_DEBUG("  rename             = %d\n", args->rename);
+     LOG_DEBUG("  revcomp_r1         = %d\n", args->revcomp_r1);
+     LOG_DEBUG("  revcomp_r2         = %d\n", args->revcomp_r2);
+     LOG_DEBUG("  out_format         = %d\n", args->out_format);
+     LOG_DEBUG("  rg_id              = %s\n", args->rg_id);
+     LOG_DEBUG("  rg_sample          = %s\n", args->rg_sample);
 
      LOG_DEBUG("  min5pqual          = %d\n", args->min5pqual);
      LOG_DEBUG("  min3pqual          = %d\n", args->min3pqual);
      LOG_DEBUG("  phredoffset        = %d\n", args->phredoffset);
      LOG_DEBUG("  minreadlen         = %d\n", args->minreadlen);
      LOG_DEBUG("  minbq50p           = %d\n", args->minbq50p);
+     LOG_DEBUG("  max_n              = %d\n", args->max_n);
+     LOG_DEBUG("  max_n_frac         = %f\n", args->max_n_frac);
+     LOG_DEBUG("  max_dust           = %f\n", args->max_dust);
+     LOG_DEBUG("  dedup              = %d\n", args->dedup);
+     LOG_DEBUG("  dedup_mem          = %d\n", args->dedup_mem);
+     LOG_DEBUG("  trim_n             = %d\n", args->trim_n);
+     LOG_DEBUG("  trim_algo          = %d\n", args->trim_algo);
+     LOG_DEBUG("  window_size        = %d\n", args->window_size);
+     LOG_DEBUG("  adapters           = %s\n", args->adapters);
+     LOG_DEBUG("  adapter_mm_rate    = %f\n", args->adapter_mismatch_rate);
+     LOG_DEBUG("  adapter_min_overl. = %d\n", args->adapter_min_overlap);
+     LOG_DEBUG("  trim_overlap       = %d\n", args->trim_overlap);
+     LOG_DEBUG("  overlap_min_len    = %d\n", args->overlap_min_len);
+     LOG_DEBUG("  max_ee             = %f\n", args->max_ee);
+     LOG_DEBUG("  max_ee_rate        = %f\n", args->max_ee_rate);
+     LOG_DEBUG("  trunc_ee           = %f\n", args->trunc_ee);
+     LOG_DEBUG("  min_mean_qual      = %f\n", args->min_mean_qual);
+     LOG_DEBUG("  headcrop           = %d\n", args->headcrop);
+     LOG_DEBUG("  tailcrop           = %d\n", args->tailcrop);
+     LOG_DEBUG("  trim_poly          = %c\n", args->trim_poly ? args->trim_poly : '-');
+     LOG_DEBUG("  poly_min_len       = %d\n", args->poly_min_len);
 
      LOG_DEBUG("  sampling           = %d\n", args->sampling);
      LOG_DEBUG("  split_every        = %d\n", args->split_every);
+     LOG_DEBUG("  shards             = %d\n", args->shards);
+     LOG_DEBUG("  split_by           = %d\n", args->split_by);
+     LOG_DEBUG("  max_open           = %d\n", args->max_open);
+     LOG_DEBUG("  samplesheet        = %s\n", args->samplesheet);
+     LOG_DEBUG("  barcode_mismatches = %d\n", args->barcode_mismatches);
 
      LOG_DEBUG("  overwrite_output     = %d\n", args->overwrite_output);
      LOG_DEBUG("  append_to_output     = %d\n", args->append_to_output);
@@ -210,6 +515,18 @@ void free_args(args_t *args)
      args->outfq1 = NULL;
      free(args->outfq2);
      args->outfq2 = NULL;
+     free(args->samplesheet);
+     args->samplesheet = NULL;
+     free(args->adapters);
+     args->adapters = NULL;
+     free(args->merge);
+     args->merge = NULL;
+     free(args->qual_bin);
+     args->qual_bin = NULL;
+     free(args->rg_id);
+     args->rg_id = NULL;
+     free(args->rg_sample);
+     args->rg_sample = NULL;
 }
 
 
@@ -235,6 +552,7 @@ int template_mark_counts(const char *str)
 int parse_args(args_t *args, int argc, char *argv[])
 {
      int nerrors;
+     int single_out;
 
      /* argtable command line parsing:
       * http://argtable.sourceforge.net/doc/argtable2-intro.html
@@ -255,12 +573,25 @@ int parse_args(args_t *args, int argc, char *argv[])
      struct arg_file *opt_infq2 = arg_file0(
           "j", "in2", "<file>",
           "Other input FastQ file if paired-end (gzip supported)");
+     struct arg_str *opt_in_format = arg_str0(
+          NULL, "in-format", "<fastq|bam|fbin>",
+          "Input format. Unaligned BAM and fbin (see --out-format) may hold both mates of pairs. Default: fastq");
+     struct arg_lit *opt_interleaved_in = arg_lit0(
+          NULL, "interleaved-in",
+          "Input FastQ file holds both mates of pairs in alternating order");
      struct arg_file *opt_outfq1 = arg_file1(
           "o", "out1", "<file>",
           "Output FastQ file (will be gzipped; '-' for stdout)");
      struct arg_file *opt_outfq2 = arg_file0(
           "p", "out2", "<file>",
           "Other output FastQ file if paired-end input (will be gzipped)");
+     struct arg_lit *opt_interleaved_out = arg_lit0(
+          NULL, "interleaved-out",
+          "Write both mates of pairs in alternating order to out1");
+     struct arg_file *opt_merge = arg_file0(
+          NULL, "merge", "<file>",
+          "Merge overlapping pairs into single reads written to this file (will be gzipped)."
+          " Unmerged pairs go to out1/out2");
 
      struct arg_rem  *rem_filtering  = arg_rem(NULL, "\nTrimming & Filtering:");
      struct arg_int *opt_min5pqual = arg_int0(
@@ -271,6 +602,57 @@ int parse_args(args_t *args, int argc, char *argv[])
           "3", "min3pqual", "<int>",
           "Trim from end/3'-end if base-call quality is below this value (Illumina guidelines recommend 3)."
           " Default: " XSTR(DEFAULT_MIN3PQUAL));
+     struct arg_str *opt_trim_algo = arg_str0(
+          NULL, "trim-algo", "<threshold|window|mott>",
+          "3'-trimming algorithm using min3pqual: 'threshold' trims bases below it,"
+          " 'window' cuts once the average quality in a sliding window drops below it,"
+          " 'mott' cuts the suffix maximizing the sum of min3pqual-BQ (as bwa aln -q). Default: threshold");
+     struct arg_int *opt_window_size = arg_int0(
+          NULL, "window-size", "<int>",
+          "Size of sliding window for window trimming. Default: " XSTR(DEFAULT_WINDOW_SIZE));
+     struct arg_str *opt_adapters = arg_str0(
+          NULL, "adapters", "<truseq|nextera|smallrna|all|file>",
+          "Trim 3' adapters, either from built-in set or given FastA file");
+     struct arg_dbl *opt_adapter_mismatch_rate = arg_dbl0(
+          NULL, "adapter-mismatch-rate", "<float>",
+          "Maximum rate of mismatches in adapter match. Default: " XSTR(DEFAULT_ADAPTER_MISMATCH_RATE));
+     struct arg_int *opt_adapter_min_overlap = arg_int0(
+          NULL, "adapter-min-overlap", "<int>",
+          "Minimum length of partial adapter at 3'-end. Default: " XSTR(DEFAULT_ADAPTER_MIN_OVERLAP));
+     struct arg_lit *opt_trim_polyg = arg_lit0(
+          NULL, "trim-polyg",
+          "Trim poly-G tails at 3'-end (as seen with two-colour chemistry)");
+     struct arg_lit *opt_trim_polyx = arg_lit0(
+          NULL, "trim-polyx",
+          "Trim tails of any single repeated base at 3'-end (includes poly-G)");
+     struct arg_int *opt_poly_min_len = arg_int0(
+          NULL, "poly-min-len", "<int>",
+          "Minimum length of poly-G/X tail. Default: " XSTR(DEFAULT_POLY_MIN_LEN));
+     struct arg_dbl *opt_trunc_ee = arg_dbl0(
+          NULL, "trunc-ee", "<float>",
+          "Truncate read where its expected errors (sum of error probabilities) exceed this value. Default: off");
+     struct arg_dbl *opt_max_ee = arg_dbl0(
+          NULL, "max-ee", "<float>",
+          "Discard read (pair) if (either) read has more expected errors after trimming. Default: off");
+     struct arg_dbl *opt_max_ee_rate = arg_dbl0(
+          NULL, "max-ee-rate", "<float>",
+          "Discard read (pair) if (either) read has more expected errors per base after trimming. Default: off");
+     struct arg_dbl *opt_min_mean_qual = arg_dbl0(
+          NULL, "min-mean-qual", "<float>",
+          "Discard read (pair) if (either) read's mean quality after trimming is below this value"
+          " (averaged as error probabilities). Default: off");
+     struct arg_int *opt_headcrop = arg_int0(
+          NULL, "headcrop", "<int>",
+          "Remove this many bases from start/5'-end. Default: 0");
+     struct arg_int *opt_tailcrop = arg_int0(
+          NULL, "tailcrop", "<int>",
+          "Remove this many bases from end/3'-end. Default: 0");
+     struct arg_lit *opt_trim_overlap = arg_lit0(
+          NULL, "trim-overlap",
+          "Trim mates to insert length if mate overlap shows insert is shorter than reads (paired-end only)");
+     struct arg_int *opt_overlap_min_len = arg_int0(
+          NULL, "overlap-min-len", "<int>",
+          "Minimum overlap of mates (for trimming and merging). Default: " XSTR(DEFAULT_OVERLAP_MIN_LEN));
               
      struct arg_int *opt_phredoffset = arg_int0(
           "e", "phred", "<33|64>",
@@ -285,6 +667,27 @@ int parse_args(args_t *args, int argc, char *argv[])
           "m", "minbq50p", "<int>",
           "Discard reads if >50% of bases have a BQ less or equal than this number."
           " Applied before other BQ filters. Default: " XSTR(DEFAULT_MINBQ50P));
+     struct arg_int *opt_max_n = arg_int0(
+          NULL, "max-n", "<int>",
+          "Discard reads with more than this many N's (counted before trimming). Default: off");
+     struct arg_dbl *opt_max_n_frac = arg_dbl0(
+          NULL, "max-n-frac", "<float>",
+          "Discard reads with a higher fraction of N's (counted before trimming). Default: off");
+     struct arg_dbl *opt_max_dust = arg_dbl0(
+          NULL, "max-dust", "<float>",
+          "Discard low-complexity reads with a higher DUST score (counted before trimming)."
+          " Random sequence scores below 1, a homopolymer half its length. Default: off");
+     struct arg_lit *opt_dedup = arg_lit0(
+          NULL, "dedup",
+          "Remove exact duplicate reads (pairs: identical in both mates; compared before trimming)");
+     struct arg_int *opt_dedup_mem = arg_int0(
+          NULL, "dedup-mem", "<int>",
+          "Memory limit in MB for --dedup. Beyond it a Bloom filter is used, which removes"
+          " up to 1% of unique reads as false duplicates. Once it gets fuller than that,"
+          " duplicates aren't removed anymore (with a warning). Default: no limit");
+     struct arg_lit *opt_trim_n = arg_lit0(
+          NULL, "trim-n",
+          "Trim N's at both ends");
 
      struct arg_rem *rem_sampling = arg_rem(NULL, "\nSampling:");
      struct arg_int *opt_sampling = arg_int0(
@@ -293,6 +696,59 @@ int parse_args(args_t *args, int argc, char *argv[])
      struct arg_int *opt_split_every = arg_int0(
           "x", "split-every", "<int>",
           "Split every x reads. Requires " TEMPLATE_MARK " in output names, which will be replaced with split number");
+     struct arg_int *opt_shards = arg_int0(
+          NULL, "shards", "<int>",
+          "Scatter batches of " XSTR(SHARD_BATCHSIZE) " reads round-robin across this many output files,"
+          " each compressed by its own thread. Requires " TEMPLATE_MARK " in output names, which will be replaced with shard number");
+     struct arg_str *opt_split_by = arg_str0(
+          NULL, "split-by", "<flowcell|lane|tile>",
+          "Split by flowcell, lane or tile parsed from Illumina read names. Requires " TEMPLATE_MARK
+          " in output names, which will be replaced with e.g. flowcell-lane");
+     struct arg_int *opt_max_open = arg_int0(
+          NULL, "max-open", "<int>",
+          "Keep at most this many outputs (pairs) open when splitting by read name."
+          " Default: " XSTR(DEFAULT_MAX_OPEN));
+
+     struct arg_rem *rem_demux = arg_rem(NULL, "\nDemultiplexing:");
+     struct arg_file *opt_samplesheet = arg_file0(
+          NULL, "samplesheet", "<file>",
+          "Demultiplex by index read in Casava comment (e.g. 1:N:0:ATCACG). File lists one sample name and barcode per line."
+          " Requires " TEMPLATE_MARK " in output names, which will be replaced with sample name (or " DEMUX_UNDETERMINED ")");
+     struct arg_int *opt_barcode_mismatches = arg_int0(
+          NULL, "barcode-mismatches", "<int>",
+          "Allowed mismatches between barcodes in reads and sample sheet."
+          " Default: " XSTR(DEFAULT_BARCODE_MISMATCHES));
+
+     struct arg_rem *rem_output = arg_rem(NULL, "\nOutput:");
+     struct arg_str *opt_qual_bin = arg_str0(
+          NULL, "qual-bin", "<illumina8|bins>",
+          "Bin output qualities: Illumina 8-level binning or comma-separated Q:value pairs,"
+          " mapping qualities from Q (up to the next Q) to value, e.g. '" QUAL_BIN_ILLUMINA8 "'."
+          " Qualities below the first Q are kept. Default: off");
+     struct arg_int *opt_mask_below = arg_int0(
+          NULL, "mask-below", "<int>",
+          "Replace bases with quality below this value with N (done before binning). Default: off");
+     struct arg_str *opt_out_format = arg_str0(
+          NULL, "out-format", "<fastq|fasta|bam|fbin>",
+          "Output format. FastA drops qualities (after masking). Unaligned BAM and fbin (binary block-columnar format, compressed by column) hold both mates in the -o file. Default: fastq");
+     struct arg_str *opt_rg_id = arg_str0(
+          NULL, "rg-id", "<str>",
+          "Read group ID for BAM output. Default: " DEFAULT_RG_ID);
+     struct arg_str *opt_rg_sample = arg_str0(
+          NULL, "rg-sample", "<str>",
+          "Read group sample name for BAM output. Default: read group ID");
+     struct arg_lit *opt_drop_comment = arg_lit0(
+          NULL, "drop-comment",
+          "Drop comments (anything after first whitespace) from read names");
+     struct arg_str *opt_rename = arg_str0(
+          NULL, "rename", "<number|strip-prefix>",
+          "Replace read names with their number in the input (same for both mates and merged pairs) or strip the instrument(:run) prefix from Illumina read names");
+     struct arg_lit *opt_revcomp_r1 = arg_lit0(
+          NULL, "revcomp-r1",
+          "Write reverse complement of first reads (and reversed qualities)");
+     struct arg_lit *opt_revcomp_r2 = arg_lit0(
+          NULL, "revcomp-r2",
+          "Write reverse complement of second reads (and reversed qualities)");
 
      struct arg_rem  *rem_misc  = arg_rem(NULL, "\nMisc:");
      struct arg_lit *opt_overwrite_output  = arg_lit0(
@@ -317,16 +773,41 @@ int parse_args(args_t *args, int argc, char *argv[])
       */
      opt_minreadlen->ival[0] = DEFAULT_MINREADLEN;
      opt_minbq50p->ival[0] = DEFAULT_MINBQ50P;
+     opt_max_n->ival[0] = DEFAULT_MAX_N;
+     opt_max_n_frac->dval[0] = DEFAULT_MAX_N_FRAC;
+     opt_max_dust->dval[0] = -1.0;
+     opt_dedup_mem->ival[0] = 0;
      opt_min5pqual->ival[0] = DEFAULT_MIN5PQUAL;
      opt_min3pqual->ival[0] = DEFAULT_MIN3PQUAL;
      opt_phredoffset->ival[0] = DEFAULT_PHREDOFFSET;
+     opt_window_size->ival[0] = DEFAULT_WINDOW_SIZE;
+     opt_adapter_mismatch_rate->dval[0] = DEFAULT_ADAPTER_MISMATCH_RATE;
+     opt_adapter_min_overlap->ival[0] = DEFAULT_ADAPTER_MIN_OVERLAP;
+     opt_overlap_min_len->ival[0] = DEFAULT_OVERLAP_MIN_LEN;
+     opt_poly_min_len->ival[0] = DEFAULT_POLY_MIN_LEN;
+     opt_trunc_ee->dval[0] = opt_max_ee->dval[0] = opt_max_ee_rate->dval[0] = -1.0;
+     opt_min_mean_qual->dval[0] = -1.0;
+     opt_headcrop->ival[0] = opt_tailcrop->ival[0] = 0;
      opt_split_every->ival[0] = 0;
+     opt_shards->ival[0] = 0;
+     opt_max_open->ival[0] = DEFAULT_MAX_OPEN;
+     opt_barcode_mismatches->ival[0] = DEFAULT_BARCODE_MISMATCHES;
      opt_sampling->ival[0] = 0;
 
-     void *argtable[] = {rem_files, opt_infq1, opt_infq2, opt_outfq1, opt_outfq2,
-                         rem_filtering, opt_minbq50p, opt_min5pqual, opt_min3pqual,
+     void *argtable[] = {rem_files, opt_infq1, opt_infq2, opt_in_format, opt_interleaved_in, opt_outfq1, opt_outfq2, opt_interleaved_out, opt_merge,
+                         rem_filtering, opt_minbq50p, opt_max_n, opt_max_n_frac, opt_max_dust, opt_dedup, opt_dedup_mem, opt_trim_n,
+                         opt_min5pqual, opt_min3pqual,
+                         opt_trim_algo, opt_window_size,
+                         opt_adapters, opt_adapter_mismatch_rate, opt_adapter_min_overlap,
+                         opt_trim_polyg, opt_trim_polyx, opt_poly_min_len,
+                         opt_trunc_ee, opt_max_ee, opt_max_ee_rate, opt_min_mean_qual,
+                         opt_headcrop, opt_tailcrop,
+                         opt_trim_overlap, opt_overlap_min_len,
                          opt_minreadlen, opt_phredoffset, 
-                         rem_sampling, opt_sampling, opt_split_every,
+                         rem_sampling, opt_sampling, opt_split_every, opt_shards,
+                         opt_split_by, opt_max_open,
+                         rem_demux, opt_samplesheet, opt_barcode_mismatches,
+                         rem_output, opt_qual_bin, opt_mask_below, opt_out_format, opt_rg_id, opt_rg_sample, opt_drop_comment, opt_rename, opt_revcomp_r1, opt_revcomp_r2,
                          rem_misc, opt_overwrite_output, opt_append_to_output,
                          opt_help, opt_quiet, opt_debug,
                          opt_end};    
@@ -381,8 +862,53 @@ int parse_args(args_t *args, int argc, char *argv[])
           return 1;
      }
 
+     args->in_format = IN_FORMAT_FASTQ;
+     if (opt_in_format->count) {
+          if (0 == strcmp(opt_in_format->sval[0], "bam")) {
+               args->in_format = IN_FORMAT_BAM;
+          } else if (0 == strcmp(opt_in_format->sval[0], "fbin")) {
+               args->in_format = IN_FORMAT_FBIN;
+          } else if (0 != strcmp(opt_in_format->sval[0], "fastq")) {
+               LOG_ERROR("Invalid input format '%s'\n", opt_in_format->sval[0]);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+
+     args->interleaved_in = opt_interleaved_in->count;
+     args->interleaved_out = opt_interleaved_out->count;
+     /* both mates go into out1 */
+     single_out = args->interleaved_out
+          || (opt_out_format->count && (0 == strcmp(opt_out_format->sval[0], "bam")
+                                        || 0 == strcmp(opt_out_format->sval[0], "fbin")));
+     if (args->interleaved_in && IN_FORMAT_FASTQ != args->in_format) {
+          LOG_ERROR("%s\n", "Interleaved input only applies to FastQ");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     if (single_out && opt_outfq2->count) {
+          LOG_ERROR("%s\n", "Both mates go into one file with BAM, fbin or interleaved output. Don't use a second output file");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
      args->outfq1 = strdup(opt_outfq1->filename[0]);
-     if (opt_infq2->count) {
+     if (opt_infq2->count && (IN_FORMAT_FASTQ != args->in_format || args->interleaved_in)) {
+          LOG_ERROR("%s\n", "BAM, fbin or interleaved input holds both mates. Don't use a second input file");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+
+     } else if (args->interleaved_in) {
+          if (! single_out && ! opt_outfq2->count) {
+               LOG_ERROR("%s\n", "Need two output files (or interleaved output) for paired-end input");
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+          if (opt_outfq2->count) {
+               args->outfq2 = strdup(opt_outfq2->filename[0]);
+          }
+
+     } else if (opt_infq2->count) {
           args->infq2 = strdup(opt_infq2->filename[0]);
           if (0 == strcmp(args->infq2, args->infq1)) {
                LOG_ERROR("%s\n", "The two input FastQ files are the same file");
@@ -396,13 +922,21 @@ int parse_args(args_t *args, int argc, char *argv[])
                return 1;
           }
           
-          if (! opt_outfq2->count) {
-               LOG_ERROR("%s\n", "Need two output files for paired-end input");
+          if (! single_out && ! opt_outfq2->count) {
+               LOG_ERROR("%s\n", "Need two output files (or interleaved output) for paired-end input");
                arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
                return 1;                        
           }
 
-          args->outfq2 = strdup(opt_outfq2->filename[0]);
+          if (opt_outfq2->count) {
+               args->outfq2 = strdup(opt_outfq2->filename[0]);
+          }
+
+     } else if (IN_FORMAT_FASTQ != args->in_format) {
+          /* whether input is paired is only known once it's opened */
+          if (opt_outfq2->count) {
+               args->outfq2 = strdup(opt_outfq2->filename[0]);
+          }
 
      } else {
           if (opt_outfq2->count) {
@@ -410,6 +944,11 @@ int parse_args(args_t *args, int argc, char *argv[])
                arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
                return 1;              
           }
+          if (args->interleaved_out) {
+               LOG_ERROR("%s\n", "Interleaved output only works for paired-end input");
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
      }
 
      args->min5pqual = opt_min5pqual->ival[0];
@@ -426,6 +965,157 @@ int parse_args(args_t *args, int argc, char *argv[])
           return 1;            
      }
 
+     args->trim_algo = TRIM_ALGO_THRESHOLD;
+     if (opt_trim_algo->count) {
+          if (0 == strcmp(opt_trim_algo->sval[0], "threshold")) {
+               args->trim_algo = TRIM_ALGO_THRESHOLD;
+          } else if (0 == strcmp(opt_trim_algo->sval[0], "window")) {
+               args->trim_algo = TRIM_ALGO_WINDOW;
+          } else if (0 == strcmp(opt_trim_algo->sval[0], "mott")) {
+               args->trim_algo = TRIM_ALGO_MOTT;
+          } else {
+               LOG_ERROR("Invalid trimming algorithm '%s'\n", opt_trim_algo->sval[0]);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+     args->window_size = opt_window_size->ival[0];
+     if (args->window_size<1) {
+          LOG_ERROR("Invalid window size '%d'\n", args->window_size);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     if (opt_adapters->count) {
+          args->adapters = strdup(opt_adapters->sval[0]);
+     }
+     args->adapter_mismatch_rate = opt_adapter_mismatch_rate->dval[0];
+     if (args->adapter_mismatch_rate<0.0 || args->adapter_mismatch_rate>=1.0) {
+          LOG_ERROR("Invalid adapter mismatch rate '%f'\n", args->adapter_mismatch_rate);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->adapter_min_overlap = opt_adapter_min_overlap->ival[0];
+     if (args->adapter_min_overlap<1) {
+          LOG_ERROR("Invalid adapter overlap '%d'\n", args->adapter_min_overlap);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     args->trim_poly = 0;
+     if (opt_trim_polyx->count) {
+          args->trim_poly = 'X';
+     } else if (opt_trim_polyg->count) {
+          args->trim_poly = 'G';
+     }
+     args->poly_min_len = opt_poly_min_len->ival[0];
+     if (args->poly_min_len<1) {
+          LOG_ERROR("Invalid minimum poly-G/X length '%d'\n", args->poly_min_len);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     args->trunc_ee = opt_trunc_ee->dval[0];
+     args->max_ee = opt_max_ee->dval[0];
+     args->max_ee_rate = opt_max_ee_rate->dval[0];
+     if ((opt_trunc_ee->count && args->trunc_ee<0.0)
+         || (opt_max_ee->count && args->max_ee<0.0)
+         || (opt_max_ee_rate->count && args->max_ee_rate<0.0)) {
+          LOG_ERROR("%s\n", "Expected errors limits can't be negative");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     args->min_mean_qual = opt_min_mean_qual->dval[0];
+     if (opt_min_mean_qual->count && (args->min_mean_qual<0.0 || args->min_mean_qual>93.0)) {
+          LOG_ERROR("Invalid mean quality '%f'\n", args->min_mean_qual);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->headcrop = opt_headcrop->ival[0];
+     args->tailcrop = opt_tailcrop->ival[0];
+     if (args->headcrop<0 || args->tailcrop<0) {
+          LOG_ERROR("%s\n", "Number of bases to crop can't be negative");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     if (opt_qual_bin->count) {
+          args->qual_bin = strdup(opt_qual_bin->sval[0]);
+     }
+     args->out_format = OUT_FORMAT_FASTQ;
+     if (opt_out_format->count) {
+          if (0 == strcmp(opt_out_format->sval[0], "fasta")) {
+               args->out_format = OUT_FORMAT_FASTA;
+          } else if (0 == strcmp(opt_out_format->sval[0], "bam")) {
+               args->out_format = OUT_FORMAT_BAM;
+          } else if (0 == strcmp(opt_out_format->sval[0], "fbin")) {
+               args->out_format = OUT_FORMAT_FBIN;
+          } else if (0 != strcmp(opt_out_format->sval[0], "fastq")) {
+               LOG_ERROR("Invalid output format '%s'\n", opt_out_format->sval[0]);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+     if (OUT_FORMAT_FASTA == args->out_format && args->qual_bin) {
+          LOG_ERROR("%s\n", "Quality binning doesn't work with FastA output (no qualities)");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->rg_id = strdup(opt_rg_id->count ? opt_rg_id->sval[0] : DEFAULT_RG_ID);
+     args->rg_sample = strdup(opt_rg_sample->count ? opt_rg_sample->sval[0] : args->rg_id);
+     if (! args->rg_id[0] || ! args->rg_sample[0]
+         || strpbrk(args->rg_id, "\t\n") || strpbrk(args->rg_sample, "\t\n")) {
+          LOG_ERROR("%s\n", "Invalid read group ID or sample name");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->drop_comment = opt_drop_comment->count;
+     args->revcomp_r1 = opt_revcomp_r1->count;
+     args->revcomp_r2 = opt_revcomp_r2->count;
+     args->rename = RENAME_NONE;
+     if (opt_rename->count) {
+          if (0 == strcmp(opt_rename->sval[0], "number")) {
+               args->rename = RENAME_NUMBER;
+          } else if (0 == strcmp(opt_rename->sval[0], "strip-prefix")) {
+               args->rename = RENAME_STRIP_PREFIX;
+          } else {
+               LOG_ERROR("Invalid renaming '%s'\n", opt_rename->sval[0]);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+     args->mask_below = 0;
+     if (opt_mask_below->count) {
+          args->mask_below = opt_mask_below->ival[0];
+          if (args->mask_below<1 || args->mask_below>93) {
+               LOG_ERROR("Invalid masking quality '%d'\n", args->mask_below);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+
+     args->trim_overlap = opt_trim_overlap->count;
+     if (args->trim_overlap && ! args->infq2 && ! args->interleaved_in && IN_FORMAT_FASTQ == args->in_format) {
+          LOG_ERROR("%s\n", "Overlap trimming only works for paired-end input");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     if (opt_merge->count) {
+          if (! args->infq2 && ! args->interleaved_in && IN_FORMAT_FASTQ == args->in_format) {
+               LOG_ERROR("%s\n", "Merging only works for paired-end input");
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+          args->merge = strdup(opt_merge->filename[0]);
+     }
+     args->overlap_min_len = opt_overlap_min_len->ival[0];
+     if (args->overlap_min_len<1) {
+          LOG_ERROR("Invalid minimum overlap '%d'\n", args->overlap_min_len);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
      args->phredoffset = opt_phredoffset->ival[0];
      if (33 != args->phredoffset && 64 != args->phredoffset) {
           LOG_ERROR("Invalid Phred-quality ASCII offset '%d'\n", args->phredoffset);
@@ -449,6 +1139,28 @@ int parse_args(args_t *args, int argc, char *argv[])
      }
 #endif
 
+     args->max_n = opt_max_n->ival[0];
+     args->max_n_frac = opt_max_n_frac->dval[0];
+     if (args->max_n_frac<0.0 || args->max_n_frac>1.0) {
+          LOG_ERROR("Invalid N fraction '%f'\n", args->max_n_frac);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->max_dust = opt_max_dust->dval[0];
+     if (opt_max_dust->count && args->max_dust<0.0) {
+          LOG_ERROR("Invalid DUST score '%f'\n", args->max_dust);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->dedup = opt_dedup->count;
+     args->dedup_mem = opt_dedup_mem->ival[0];
+     if (args->dedup_mem < 0 || (opt_dedup_mem->count && ! args->dedup)) {
+          LOG_ERROR("%s\n", "Invalid --dedup-mem (needs --dedup and must not be negative)");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->trim_n = opt_trim_n->count;
+
      args->sampling = opt_sampling->ival[0];
 #if 0 /* negative values okay. just means no sampling */
      if (args->sampling<0) {
@@ -459,15 +1171,70 @@ int parse_args(args_t *args, int argc, char *argv[])
 #endif
 
      args->split_every = opt_split_every->ival[0];
-     if (args->split_every>0) {
+     args->shards = opt_shards->ival[0];
+     if (args->shards<0) {
+          LOG_ERROR("Invalid number of shards '%d'\n", args->shards);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->split_by = SPLIT_BY_NONE;
+     if (opt_split_by->count) {
+          if (0 == strcmp(opt_split_by->sval[0], "flowcell")) {
+               args->split_by = SPLIT_BY_FLOWCELL;
+          } else if (0 == strcmp(opt_split_by->sval[0], "lane")) {
+               args->split_by = SPLIT_BY_LANE;
+          } else if (0 == strcmp(opt_split_by->sval[0], "tile")) {
+               args->split_by = SPLIT_BY_TILE;
+          } else {
+               LOG_ERROR("Invalid split-by field '%s'\n", opt_split_by->sval[0]);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+     if (OUT_FORMAT_FBIN == args->out_format
+         && (args->append_to_output || SPLIT_BY_NONE != args->split_by)) {
+          LOG_ERROR("%s\n", "fbin output can't be appended to (used by --append and --split-by)");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     args->max_open = opt_max_open->ival[0];
+     if (args->max_open<1) {
+          LOG_ERROR("Invalid number of open outputs '%d'\n", args->max_open);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     if (opt_samplesheet->count) {
+          args->samplesheet = strdup(opt_samplesheet->filename[0]);
+          if (! file_exists(args->samplesheet)) {
+               LOG_ERROR("File %s does not exist\n", args->samplesheet);
+               arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+               return 1;
+          }
+     }
+     args->barcode_mismatches = opt_barcode_mismatches->ival[0];
+     if (args->barcode_mismatches<0 || args->barcode_mismatches>DEMUX_MAX_BARCODE_MISMATCHES) {
+          LOG_ERROR("Invalid number of barcode mismatches '%d' (max. %d)\n",
+                    args->barcode_mismatches, DEMUX_MAX_BARCODE_MISMATCHES);
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+
+     if ((args->split_every>0) + (args->shards>0) + (args->split_by != SPLIT_BY_NONE)
+         + (NULL != args->samplesheet) > 1) {
+          LOG_ERROR("%s\n", "Only one of split-every, shards, split-by and samplesheet can be used at a time");
+          arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+          return 1;
+     }
+     if (args->split_every>0 || args->shards>0 || args->split_by != SPLIT_BY_NONE
+         || args->samplesheet) {
           if (1 != template_mark_counts(args->outfq1)) {
-               LOG_ERROR("Need %s exactly once as number template in output filename for requested splitting\n", TEMPLATE_MARK);
+               LOG_ERROR("Need %s exactly once as template in output filename for requested splitting\n", TEMPLATE_MARK);
                arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));               
                return 1;
           }
           if (args->outfq2) {
                if (1 != template_mark_counts(args->outfq2)) {
-                    LOG_ERROR("Need %s as number template in output filename for requested splitting\n", TEMPLATE_MARK);
+                    LOG_ERROR("Need %s as template in output filename for requested splitting\n", TEMPLATE_MARK);
                     arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));               
                     return 1;
                }
@@ -488,13 +1255,228 @@ void dump_trim_pos(const trim_pos_t *tp)
 }
 
 
+/* Sliding-window trimming: returns start of the first window of
+ * size w (whole read if shorter) whose average quality is below
+ * minq, or len if there is none. Window sums are computed
+ * incrementally, so this is O(len).
+ */
+int window_trim_start_scalar(const char *qual, const int len, const int phredoffset,
+                             int w, const int minq)
+{
+     int i;
+     int sum = 0;
+     int minsum;
+
+     if (w > len) {
+          w = len;
+     }
+     minsum = minq * w;
+     for (i=0; i<w; i++) {
+          sum += qual[i] - phredoffset;
+     }
+     for (i=0; i+w<=len; i++) {
+          if (sum < minsum) {
+               return i;
+          }
+          if (i+w<len) {
+               sum += qual[i+w] - qual[i];
+          }
+     }
+     return len;
+}
+
+
+#ifdef __SSE2__
+/* SSE2 version of window_trim_start_scalar(): computes prefix sums
+ * of qualities four at a time and then compares four window sums
+ * (differences of prefix sums) at a time. prefix sums are kept in
+ * scratch, which grows as needed.
+ */
+int window_trim_start_sse2(const char *qual, const int len, const int phredoffset,
+                           int w, const int minq, kstring_t *scratch)
+{
+     int *psum;
+     __m128i carry = _mm_setzero_si128();
+     __m128i offset = _mm_set1_epi32(phredoffset);
+     __m128i zero = _mm_setzero_si128();
+     __m128i minsum;
+     int i;
+
+     if (w > len) {
+          w = len;
+     }
+     if ((len+4) * sizeof(int) > scratch->m) {
+          size_t m = (len+4 < 1024 ? 1024 : len+4+len/2) * sizeof(int);
+          char *tmp = realloc(scratch->s, m);
+          if (NULL == tmp) {
+               return window_trim_start_scalar(qual, len, phredoffset, w, minq);
+          }
+          scratch->s = tmp;
+          scratch->m = m;
+     }
+     psum = (int *)scratch->s;
+
+     /* psum[i] = sum of qualities before i */
+     psum[0] = 0;
+     for (i=0; i+4<=len; i+=4) {
+          int q4;
+          __m128i x;
+          memcpy(&q4, &qual[i], 4);
+          x = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(q4), zero), zero);
+          x = _mm_sub_epi32(x, offset);
+          x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+          x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+          x = _mm_add_epi32(x, carry);
+          _mm_storeu_si128((__m128i *)&psum[i+1], x);
+          carry = _mm_shuffle_epi32(x, 0xFF);
+     }
+     for (; i<len; i++) {
+          psum[i+1] = psum[i] + qual[i] - phredoffset;
+     }
+
+     minsum = _mm_set1_epi32(minq * w);
+     for (i=0; i+3+w<=len; i+=4) {
+          __m128i wsum = _mm_sub_epi32(_mm_loadu_si128((__m128i *)&psum[i+w]),
+                                       _mm_loadu_si128((__m128i *)&psum[i]));
+          int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(wsum, minsum)));
+          if (mask) {
+               return i + __builtin_ctz(mask);
+          }
+     }
+     for (; i+w<=len; i++) {
+          if (psum[i+w] - psum[i] < minq * w) {
+               return i;
+          }
+     }
+     return len;
+}
+#endif
+
+
+/* scratch (may be NULL, which means no vectorization) as in
+ * window_trim_start_sse2() */
+int window_trim_start(const char *qual, const int len, const int phredoffset,
+                      const int w, const int minq, kstring_t *scratch)
+{
+#ifdef __SSE2__
+     if (scratch) {
+          return window_trim_start_sse2(qual, len, phredoffset, w, minq, scratch);
+     }
+#endif
+     return window_trim_start_scalar(qual, len, phredoffset, w, minq);
+}
+
+
+#define is_n(c) ('N' == (c) || 'n' == (c))
+
+
+/* returns bitmask of positions in p[0..n) (n<=16) equal to base */
+unsigned int base_match_mask(const char *p, const int n, const char base)
+{
+     unsigned int mask = 0;
+     int i;
+#ifdef __SSE2__
+     if (16 == n) {
+          return (unsigned int)_mm_movemask_epi8(
+               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), _mm_set1_epi8(base)));
+     }
+#endif
+     for (i=0; i<n; i++) {
+          mask |= (unsigned int)(p[i] == base) << i;
+     }
+     return mask;
+}
+
+
+/* returns length of the poly-base tail at the end of seq[0..len),
+ * tolerating one mismatch per POLY_MISMATCH_EVERY bases. the tail
+ * always starts with a match. the scan goes backwards in blocks of
+ * 16 bases, compared at once.
+ */
+int poly_tail_len_base(const char *seq, const int len, const char base)
+{
+     int tail = 0;
+     int n = 0;
+     int mm = 0;
+     int i = len;
+
+     while (i > 0) {
+          int blk = i >= 16 ? 16 : i;
+          unsigned int mask = base_match_mask(&seq[i-blk], blk, base);
+          int k;
+          for (k=blk-1; k>=0; k--) {
+               n++;
+               if ((mask >> k) & 1) {
+                    tail = n;
+               } else {
+                    mm++;
+                    if (mm > POLY_MAX_MISMATCHES || mm * POLY_MISMATCH_EVERY > n) {
+                         return tail;
+                    }
+               }
+          }
+          i -= blk;
+     }
+     return tail;
+}
+
+
+/* returns length of poly-G ('G') or poly-X tail ('X': longest of any
+ * of ACGT) at end of seq[0..len) or 0 if shorter than min_len.
+ */
+int poly_tail_len(const char *seq, const int len, const char poly, const int min_len)
+{
+     int tail = 0;
+     if ('X' == poly) {
+          const char *b;
+          for (b="ACGT"; *b; b++) {
+               int t = poly_tail_len_base(seq, len, *b);
+               if (t > tail) {
+                    tail = t;
+               }
+          }
+     } else {
+          tail = poly_tail_len_base(seq, len, poly);
+     }
+     return tail >= min_len ? tail : 0;
+}
+
+
+/* BWA-style (modified Mott) trimming as in bwa aln -q: returns the
+ * number of bases to keep, i.e. the start of the suffix maximizing
+ * the sum of minq-q. Scanning from the 3' end stops once that sum
+ * drops below zero. Implemented without data-dependent branches:
+ * the stop is tracked as a flag and updates are conditional moves.
+ */
+int mott_trim_len(const char *qual, const int len, const int phredoffset, const int minq)
+{
+     int i;
+     int sum = 0;
+     int max = 0;
+     int keep = len;
+     int alive = 1;
+
+     for (i=len-1; i>=0; i--) {
+          int update;
+          sum += minq - (qual[i] - phredoffset);
+          alive &= (sum >= 0);
+          update = alive & (sum > max);
+          max = update ? sum : max;
+          keep = update ? i : keep;
+     }
+     return keep;
+}
+
+
 /* returns 1 if read is to be discarded, in which case trim_pos
  * values might be set to arbitrary values. otherwise trim_pos will
- * hold valid (zero-offset) trimming positions.
+ * hold valid (zero-offset) trimming positions. stats (from
+ * read_stats(); may be NULL) let reads without low quality bases
+ * skip quality trimming.
  */
 int calc_trim_pos(trim_pos_t *trim_pos, 
-                  const kseq_t *seq, const int phredoffset,
-                  const trim_args_t *trim_args)
+                  const kseq_t *seq, const read_stats_t *stats,
+                  const int phredoffset, const trim_args_t *trim_args)
 {
      int i;
      int minreadlen;
@@ -517,7 +1499,33 @@ int calc_trim_pos(trim_pos_t *trim_pos,
 
      /* 3p end. test first, since more likely to be used by user
       */
-     if (trim_args->min3pqual>0) {
+     if (stats && stats->minq >= trim_args->min3pqual) {
+          /* nothing to trim, whatever the algorithm */
+          trim_pos->pos3p = seq->qual.l-1;
+
+     } else if (trim_args->min3pqual>0 && TRIM_ALGO_WINDOW == trim_args->algo) {
+          i = window_trim_start(seq->qual.s, seq->qual.l, phredoffset,
+                                trim_args->window_size, trim_args->min3pqual,
+                                trim_args->scratch);
+          /* keep good bases at the start of the failing window */
+          while (i < seq->qual.l && seq->qual.s[i]-phredoffset >= trim_args->min3pqual) {
+               i++;
+          }
+          if (trace) {LOG_DEBUG("Window trimming leaves %d/%d bases\n", i, seq->qual.l);}
+          if (i < minreadlen) {
+               return 1;
+          }
+          trim_pos->pos3p = i-1;
+
+     } else if (trim_args->min3pqual>0 && TRIM_ALGO_MOTT == trim_args->algo) {
+          i = mott_trim_len(seq->qual.s, seq->qual.l, phredoffset, trim_args->min3pqual);
+          if (trace) {LOG_DEBUG("Mott trimming leaves %d/%d bases\n", i, seq->qual.l);}
+          if (i < minreadlen) {
+               return 1;
+          }
+          trim_pos->pos3p = i-1;
+
+     } else if (trim_args->min3pqual>0) {
           for (i=seq->qual.l-1; i >= minreadlen-1; i--) {
                int q = seq->qual.s[i]-phredoffset;
                assert(i>=0);
@@ -536,9 +1544,21 @@ int calc_trim_pos(trim_pos_t *trim_pos,
           trim_pos->pos3p = seq->qual.l-1; /* zero offset */
      }
 
+     /* poly-G/X tails usually come with high quality and survive the
+      * above */
+     if (trim_args->poly) {
+          i = poly_tail_len(seq->seq.s, trim_pos->pos3p+1, trim_args->poly,
+                            trim_args->poly_min_len);
+          if (trace) {LOG_DEBUG("Poly-%c tail of length %d\n", trim_args->poly, i);}
+          if (trim_pos->pos3p+1 - i < minreadlen) {
+               return 1;
+          }
+          trim_pos->pos3p -= i;
+     }
+
      /* 5p end 
       */
-     if (trim_args->min5pqual>0) {
+     if (trim_args->min5pqual>0 && ! (stats && stats->minq >= trim_args->min5pqual)) {
           for (i=0; i<seq->qual.l - minreadlen + 1 && i<=trim_pos->pos3p; i++) {
                int q = seq->qual.s[i] - phredoffset;
                assert(i<seq->qual.l);
@@ -557,6 +1577,22 @@ int calc_trim_pos(trim_pos_t *trim_pos,
      } else {
           trim_pos->pos5p = 0;
      }
+
+     if (trim_pos->pos5p < trim_args->headcrop) {
+          trim_pos->pos5p = trim_args->headcrop;
+     }
+     if (trim_pos->pos3p > (int)seq->qual.l-1 - trim_args->tailcrop) {
+          trim_pos->pos3p = seq->qual.l-1 - trim_args->tailcrop;
+     }
+
+     if (trim_args->trim_n) {
+          while (trim_pos->pos3p >= trim_pos->pos5p && is_n(seq->seq.s[trim_pos->pos3p])) {
+               trim_pos->pos3p--;
+          }
+          while (trim_pos->pos5p <= trim_pos->pos3p && is_n(seq->seq.s[trim_pos->pos5p])) {
+               trim_pos->pos5p++;
+          }
+     }
       
      /* test should be unnecessary if loops above are done
       * correctly */
@@ -579,585 +1615,4352 @@ int trimmed_len(const kseq_t *seq, const trim_pos_t *trim_pos) {
 }
 
 
-/* prints fastq entry including trailing newline. returns negative
- * number on error. caller has to free buf, which will be allocated
- * here. if trim_pos is not NULL or (both values are not -1) seq will
- * be trimmed accordingly.
+/* Adapter trimming. Candidate adapter positions in a read come from
+ * a k-mer seed index over all adapters (CSR layout: hits of k-mer x
+ * are seed_hits[seed_start[x]] to seed_hits[seed_start[x+1]-1],
+ * encoded as adapter<<16 | position in adapter). Candidates are
+ * verified by counting mismatches. Adapters only partially present
+ * at the 3'-end (too short for seeds) are checked directly.
  */
-int sprintf_fastq(char **buf, const kseq_t *seq, const trim_pos_t *trim_pos) {
-     int ret = 0;
-     /* remember values temporarily overwritten during trimming */
-     char zeroed_base = -1;
-     char zeroed_qual = -1;
-     int bufsize = 1/*@*/ + seq->name.l + 1/*space*/ + seq->comment.l
-          + 1 /* newline */
-          + seq->seq.l 
-          + 3 /* newline, '+' and newline */ 
-          + seq->qual.l 
-          + 1 /* newline */
-          + 1;  /* trailing 0 */
-     int start = 0;
+typedef struct {
+     char **names;
+     char **seqs;
+     int *lens;
+     int n;
+     int *seed_start;
+     int *seed_hits;
+     double max_mismatch_rate;
+     int min_overlap;
+} adapters_t;
+
+
+/* 2-bit encoding: A=0, C=1, G=2, T=3, anything else 4 */
+unsigned char nt4_table[256];
+/* complement. anything but ACGT (either case) maps to N */
+char comp_table[256];
+/* error probability for Phred quality 0..93 */
+double phred_err[94];
+/* BAM 4-bit base codes ("=ACMGRSVTWYHKDBN"). anything but ACGT is N */
+unsigned char nt16_table[256];
+
+/* initializes lookup tables. call once before use */
+void init_tables()
+{
+     int i;
 
-     /* fastq is supposed to have a quality string */
-     if (! seq->qual.l){
-          LOG_ERROR("%s\n", "FastQ is missing a quality string");
-          return -1;
-     }
+     memset(nt4_table, 4, sizeof(nt4_table));
+     nt4_table['A'] = nt4_table['a'] = 0;
+     nt4_table['C'] = nt4_table['c'] = 1;
+     nt4_table['G'] = nt4_table['g'] = 2;
+     nt4_table['T'] = nt4_table['t'] = 3;
 
-     if (NULL != trim_pos && (trim_pos->pos5p >= 0 && trim_pos->pos3p >= 0)) {
-          if (trim_pos->pos5p < 0 || trim_pos->pos3p < 0) {
-               LOG_ERROR("%s\n", "Internal error: Invalid trim pos (5p or 3p < 0)");
-               return -1;
-          }
-          if (trim_pos->pos3p - trim_pos->pos5p + 1 < 0) {
-               LOG_ERROR("%s\n", "Internal error: Invalid trim pos (negative distance between 5p and 3p)");
-               return -1;               
-          }
-          if (trim_pos->pos3p >= seq->qual.l) {
-               LOG_ERROR("Internal error: Invalid 3p trim pos (%d > string length which is %d)\n",
-                         trim_pos->pos3p, seq->qual.l);
-               return -1;               
-          }
+     memset(comp_table, 'N', sizeof(comp_table));
+     comp_table['A'] = 'T'; comp_table['a'] = 't';
+     comp_table['C'] = 'G'; comp_table['c'] = 'g';
+     comp_table['G'] = 'C'; comp_table['g'] = 'c';
+     comp_table['T'] = 'A'; comp_table['t'] = 'a';
 
-          start = trim_pos->pos5p;
-          /* temporarily overwrite the end */
-          zeroed_base = seq->seq.s[trim_pos->pos3p+1];
-          zeroed_qual = seq->qual.s[trim_pos->pos3p+1];
-          seq->seq.s[trim_pos->pos3p+1] = '\0';
-          seq->qual.s[trim_pos->pos3p+1] = '\0';
-     }
-     
-     (*buf) = calloc(bufsize, sizeof(char));
-     NULLCHECK(buf);
-     
-     /* or simply use asprintf, which is GNU extension available also on BSD */
-     if (seq->comment.l) {
-          ret = sprintf((*buf), "@%s %s\n%s\n+\n%s\n", 
-                        seq->name.s, seq->comment.s, & seq->seq.s[start], & seq->qual.s[start]);
-     } else {
-          ret = sprintf((*buf), "@%s\n%s\n+\n%s\n", 
-                        seq->name.s, & seq->seq.s[start], & seq->qual.s[start]);
+     for (i=0; i<94; i++) {
+          phred_err[i] = pow(10.0, -i/10.0);
      }
 
-     if (NULL != trim_pos && (trim_pos->pos5p >= 0 && trim_pos->pos3p >= 0)) {
-          /* revert temporary trimming changes */
-          seq->seq.s[trim_pos->pos3p+1] = zeroed_base;
-          seq->qual.s[trim_pos->pos3p+1] = zeroed_qual;
-     }
-     return ret;
+     memset(nt16_table, 15, sizeof(nt16_table));
+     nt16_table['A'] = nt16_table['a'] = 1;
+     nt16_table['C'] = nt16_table['c'] = 2;
+     nt16_table['G'] = nt16_table['g'] = 4;
+     nt16_table['T'] = nt16_table['t'] = 8;
 }
 
 
-/* same as sprintf_fastq but gzipped.
- */
-int gzprintf_fastq(gzFile fp, const kseq_t *seq, const trim_pos_t *trim_pos) {
-     char *buf;
-     int ret;
+#ifdef __SSE2__
+/* reverses the 16 bytes in v */
+static inline __m128i reverse16(__m128i v)
+{
+     v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+     v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+     v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+     return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
 
-     ret = sprintf_fastq(&buf, seq, trim_pos);
-     if (ret<0) {
-          LOG_ERROR("%s\n", "Couldn't format seq...");
-          return ret;
-     }
-     ret = gzprintf(fp, "%s", buf);
-     free(buf);
 
-     return ret;
- }
+/* complements the 16 bases in v as comp_table does */
+static inline __m128i comp16(__m128i v)
+{
+     const __m128i vcase = _mm_set1_epi8(0x20);
+     __m128i l = _mm_or_si128(v, vcase);
+     __m128i a = _mm_cmpeq_epi8(l, _mm_set1_epi8('a'));
+     __m128i c = _mm_cmpeq_epi8(l, _mm_set1_epi8('c'));
+     __m128i g = _mm_cmpeq_epi8(l, _mm_set1_epi8('g'));
+     __m128i t = _mm_cmpeq_epi8(l, _mm_set1_epi8('t'));
+     __m128i acgt = _mm_or_si128(_mm_or_si128(a, c), _mm_or_si128(g, t));
+     __m128i r = _mm_or_si128(
+          _mm_or_si128(_mm_and_si128(a, _mm_set1_epi8('T')), _mm_and_si128(c, _mm_set1_epi8('G'))),
+          _mm_or_si128(_mm_and_si128(g, _mm_set1_epi8('C')), _mm_and_si128(t, _mm_set1_epi8('A'))));
+     /* keep case of ACGT, everything else is N */
+     r = _mm_or_si128(r, _mm_and_si128(_mm_and_si128(v, vcase), acgt));
+     return _mm_or_si128(r, _mm_andnot_si128(acgt, _mm_set1_epi8('N')));
+}
+#endif
 
 
-/* returns 0 if not paired, 1 if reads are paired
- */
-int reads_are_paired(const kseq_t *seq1, const kseq_t *seq2) {
-     /* Either read names end in '/[12]$' (older illumina/casava) or
-      * they contain ' [12]:[NY]:' at the right end. In the latter
-      * case seq puts the last bit into seq.comment. Simulated reads
-      * might end in '\.[12]'. Either way, compare only the first bit
-      *
-      * Examples: 
-      *
-      * @HWUSI-EAS100R:6:73:941:1973#0/1
-      * @HWUSI-EAS100R:6:73:941:1973#0/2
-      *
-      * @B2GA005:3:1:3597:949#ACAGTG/1
-      * @B2GA005:3:1:3597:949#ACAGTG/2
-      *
-      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 1:N:0:ATCACG
-      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 2:N:0:ATCACG
-      *
-      */
-     if (seq1->name.l != seq2->name.l) {
-          return 0;
+/* writes reverse complement of len bases in src to dst (no trailing
+ * 0). src and dst must not overlap */
+void revcomp(char *dst, const char *src, const int len)
+{
+     int i = 0;
+#ifdef __SSE2__
+     for (; i+16<=len; i+=16) {
+          __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+          _mm_storeu_si128((__m128i *)&dst[len-16-i], reverse16(comp16(v)));
      }
-     /* if we have a comment we assume seq put the last bit into
-      * comment. otherwise we assume old illumina/casava with name
-      * which endswith '/[12]$' */
-     if (seq1->comment.l && seq2->comment.l) {
-          return ! strcmp(seq1->name.s, seq2->name.s);
-
-     } else {
-          if (seq1->name.l < 3) {
-               return 0;
-          }
-          /* ignore the '/[12]$' bit for comparison */
-          return ! strncmp(seq1->name.s, seq2->name.s, seq1->name.l-2);
+#endif
+     for (; i<len; i++) {
+          dst[len-1-i] = comp_table[(unsigned char)src[i]];
      }
+}
 
-#if 0     
-     /* if name contained everything */
-     int cmp_len = 0;
-     int i;
-     for (i=seq1->name.l-2; i>=0; i--) {
-          char seq1_c = seq1->name.s[i];
-          char seq2_c = seq2->name.s[i];
-          if (seq1_c==' ' || seq1_c=='/' || seq1_c=='.') {
-               if (seq1_c != seq2_c) {
-                    return -1;
-               }
-               cmp_len = i+1;
-               break;
+
+/* reverses len chars of seq in place, complementing them if comp is
+ * set. works from both ends inwards */
+static void reverse_inplace(char *seq, const int len, const int comp)
+{
+     int i = 0, j = len; /* next left and one past right part */
+#ifdef __SSE2__
+     for (; j-i >= 32; i+=16, j-=16) {
+          __m128i l = _mm_loadu_si128((const __m128i *)&seq[i]);
+          __m128i r = _mm_loadu_si128((const __m128i *)&seq[j-16]);
+          if (comp) {
+               l = comp16(l);
+               r = comp16(r);
           }
+          _mm_storeu_si128((__m128i *)&seq[i], reverse16(r));
+          _mm_storeu_si128((__m128i *)&seq[j-16], reverse16(l));
      }
-     if (0 == cmp_len) {
-          return -1;
+#endif
+     for (j--; i<j; i++, j--) {
+          char c = seq[i];
+          seq[i] = comp ? comp_table[(unsigned char)seq[j]] : seq[j];
+          seq[j] = comp ? comp_table[(unsigned char)c] : c;
      }
-     if (0 == strncmp(seq1->name.s, seq2->name.s, cmp_len)) {
-          return 1;
-     } else {
-          return 0;
+     if (comp && i == j) {
+          seq[i] = comp_table[(unsigned char)seq[i]];
      }
-#endif
 }
 
 
-int test()
+/* reverse complements len bases of seq and reverses qual (may be
+ * NULL) in place, e.g. in output buffers */
+void revcomp_inplace(char *seq, char *qual, const int len)
 {
-     int phredoffset = 33;
-     char *buf;
-     const int ks_bufsize = 1024;
-     trim_pos_t trim_pos;
-     kseq_t *ks;
-     int orig_read_len;
-     trim_args_t trim_args;
-
-     ks = (kseq_t*)calloc(1, sizeof(kseq_t));
-     NULLCHECK(ks);
+     reverse_inplace(seq, len, 1);
+     if (qual) {
+          reverse_inplace(qual, len, 0);
+     }
+}
 
-     LOG_TEST("%s\n", "Starting interal tests");
 
-     /* setup dummy kseq with enough space for some experiments.
-      * WARNING: not sure if I used kseq_t correctly here
-      */
-     ks->name.l = ks->comment.l = ks->seq.l = ks->qual.l = 0;
-     ks->name.m =  ks->comment.m = ks->seq.m = ks->qual.m = ks_bufsize;
-     ks->name.s = (char*)realloc(ks->name.s, ks->name.m);
-     ks->comment.s = (char*)realloc(ks->comment.s, ks->comment.m);
-     ks->seq.s = (char*)realloc(ks->seq.s, ks->seq.m);
-     ks->qual.s = (char*)realloc(ks->qual.s, ks->qual.m);
-     /* now l has to be set after filling s */
+/* spreads the lower 16 bits of x to the even bits of the result */
+static inline uint32_t spread_bits16(uint32_t x)
+{
+#ifdef __BMI2__
+     return _pdep_u32(x, 0x55555555);
+#else
+     x = (x | (x << 8)) & 0x00ff00ff;
+     x = (x | (x << 4)) & 0x0f0f0f0f;
+     x = (x | (x << 2)) & 0x33333333;
+     x = (x | (x << 1)) & 0x55555555;
+     return x;
+#endif
+}
 
-     strcpy(ks->name.s, "@HWI-ST740:1:C0JMGACXX:1:1101:2161:2062 2:N:0:ATCACG");
-     ks->name.l = strlen(ks->name.s);
-     strcpy(ks->seq.s,  "AAACCCGGGTTTACGTAAACCCGGGTTTACGTAAACCCGGGTTTACGTAAAC");
-     ks->seq.l = strlen(ks->seq.s);
-     strcpy(ks->qual.s, "?@AAABBBCCCDDDEEEFFFGGGH????HGGGFFFEEEDDDCCCBBBAAA@?");
-     ks->qual.l = strlen(ks->qual.s);
-     orig_read_len = strlen(ks->seq.s);
 
-     /* LOG_FIXME("ks->name.l=%d ks->seq.l=%d ks->qual.l=%d\n", ks->name.l, ks->seq.l, ks->qual.l); */
-     trim_args.min5pqual = 39;
-     trim_args.min3pqual = 39;
-     trim_args.minreadlen = 6;
+/* packs len bases of seq into p (see packed_seq_t). returns non-zero
+ * on error */
+int pack_seq(packed_seq_t *p, const char *seq, const int len)
+{
+     int i = 0;
 
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
-          return 1;
+     if (len > p->m) {
+          int m = (len + 63) & ~63;
+          uint64_t *bases = realloc(p->bases, m/32 * sizeof(uint64_t));
+          uint64_t *nmask;
+          if (NULL == bases) {
+               return 1;
+          }
+          p->bases = bases;
+          nmask = realloc(p->nmask, m/64 * sizeof(uint64_t));
+          if (NULL == nmask) {
+               return 1;
+          }
+          p->nmask = nmask;
+          p->m = m;
      }
-
-     sprintf_fastq(&buf, ks, NULL);
-     free(buf);
-     if (ks->seq.l != orig_read_len || strlen(ks->seq.s) != orig_read_len) {
-          LOG_ERROR("%s\n", "Read trimming changed read seq");
-          kseq_destroy(ks);
-          return 1;
+     p->len = len;
+     memset(p->bases, 0, (len+31)/32 * sizeof(uint64_t));
+     memset(p->nmask, 0, (len+63)/64 * sizeof(uint64_t));
+#ifdef __SSE2__
+     {
+          /* codes from two bit masks: low bit set for C and T, high bit
+           * for G and T. 16 bases at a time, so never crossing words */
+          const __m128i vcase = _mm_set1_epi8(0x20);
+          const __m128i va = _mm_set1_epi8('a'), vc = _mm_set1_epi8('c');
+          const __m128i vg = _mm_set1_epi8('g'), vt = _mm_set1_epi8('t');
+          for (; i+16 <= len; i+=16) {
+               __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)&seq[i]), vcase);
+               unsigned int a = _mm_movemask_epi8(_mm_cmpeq_epi8(b, va));
+               unsigned int c = _mm_movemask_epi8(_mm_cmpeq_epi8(b, vc));
+               unsigned int g = _mm_movemask_epi8(_mm_cmpeq_epi8(b, vg));
+               unsigned int t = _mm_movemask_epi8(_mm_cmpeq_epi8(b, vt));
+               uint64_t codes = spread_bits16(c | t) | (spread_bits16(g | t) << 1);
+               p->bases[i>>5] |= codes << (2*(i&31));
+               p->nmask[i>>6] |= (uint64_t)(~(a | c | g | t) & 0xffff) << (i&63);
+          }
      }
-
-     if (ks->qual.l != ks->seq.l || strlen(ks->qual.s) != orig_read_len) {
-          LOG_ERROR("%s\n", "Read trimming changed read qual");
-          kseq_destroy(ks);
-          return 1;
+#endif
+     for (; i<len; i++) {
+          unsigned char c = nt4_table[(unsigned char)seq[i]];
+          if (c > 3) {
+               p->nmask[i>>6] |= (uint64_t)1 << (i&63);
+          } else {
+               p->bases[i>>5] |= (uint64_t)c << (2*(i&31));
+          }
      }
+     return 0;
+}
 
-     trim_args.minreadlen = 7;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
-     }
-     
-     trim_args.min5pqual = 40;
-     trim_args.min3pqual = 0;
-     trim_args.minreadlen = 1;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
-     }
 
-     trim_args.min5pqual = 0;
-     trim_args.min3pqual = 40;
-     trim_args.minreadlen = 1;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
-     }
+void packed_seq_free(packed_seq_t *p)
+{
+     free(p->bases);
+     free(p->nmask);
+     memset(p, 0, sizeof(packed_seq_t));
+}
 
-     trim_args.min5pqual = 0;
-     trim_args.min3pqual = 0;
-     trim_args.minreadlen = 100;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
-     }
 
-     trim_args.min5pqual = 0;
-     trim_args.min3pqual = 0;
-     trim_args.minreadlen = 1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
-          return 1;
+/* returns number of mismatches between a and b over len bytes */
+int count_mismatches(const char *a, const char *b, int len)
+{
+     int mm = 0;
+     int i = 0;
+#ifdef __SSE2__
+     for (; i+16<=len; i+=16) {
+          __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+          __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+          int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+          mm += 16 - __builtin_popcount(eq);
+     }
+#endif
+     for (; i<len; i++) {
+          mm += (a[i] != b[i]);
      }
+     return mm;
+}
 
-     strcpy(ks->qual.s, "???????????????????????????????????????????????????A");
-     trim_args.min5pqual = 31;
-     trim_args.min3pqual = 2;
-     trim_args.minreadlen = 2;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
+
+int adapters_add(adapters_t *ad, const char *name, const char *seq)
+{
+     int len = strlen(seq);
+     int i;
+     char **tmp;
+     int *itmp;
+
+     if (len < 1 || len > ADAPTER_MAXLEN) {
+          LOG_ERROR("Invalid length of adapter %s\n", name);
           return 1;
      }
-     trim_args.minreadlen = 1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
-          return 1;
+     tmp = realloc(ad->names, (ad->n+1) * sizeof(char *));
+     NULLCHECK(tmp);
+     ad->names = tmp;
+     tmp = realloc(ad->seqs, (ad->n+1) * sizeof(char *));
+     NULLCHECK(tmp);
+     ad->seqs = tmp;
+     itmp = realloc(ad->lens, (ad->n+1) * sizeof(int));
+     NULLCHECK(itmp);
+     ad->lens = itmp;
+     ad->names[ad->n] = strdup(name);
+     ad->seqs[ad->n] = strdup(seq);
+     NULLCHECK(ad->names[ad->n]);
+     NULLCHECK(ad->seqs[ad->n]);
+     for (i=0; i<len; i++) {
+          ad->seqs[ad->n][i] = toupper(ad->seqs[ad->n][i]);
      }
+     ad->lens[ad->n] = len;
+     ad->n++;
+     return 0;
+}
 
-     strcpy(ks->qual.s, "A????????????????????????????????????????????????????");
-     trim_args.min5pqual = 2;
-     trim_args.min3pqual = 31;
-     trim_args.minreadlen = 2;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
+
+/* runs body for each valid k-mer in seq, with code set to its 2-bit
+ * encoding and pos to its last position */
+#define FOR_EACH_KMER(seq, len, k, code, pos, body) {                  \
+     unsigned int __mask = (1u<<(2*(k)))-1;                              \
+     int __valid = 0;                                                   \
+     code = 0;                                                          \
+     for (pos=0; pos<(len); pos++) {                                    \
+          unsigned char __c = nt4_table[(unsigned char)(seq)[pos]];     \
+          if (__c > 3) {                                                \
+               __valid = 0; code = 0; continue;                         \
+          }                                                             \
+          code = ((code<<2) | __c) & __mask;                            \
+          if (++__valid >= (k)) {                                       \
+               body;                                                    \
+          }                                                             \
+     }}
+
+
+int adapters_build_index(adapters_t *ad)
+{
+     const int nkmers = 1<<(2*ADAPTER_SEED_K);
+     unsigned int code;
+     int a, pos, nhits;
+     int *fill;
+
+     ad->seed_start = calloc(nkmers+1, sizeof(int));
+     NULLCHECK(ad->seed_start);
+     /* count, prefix sum, fill */
+     for (a=0; a<ad->n; a++) {
+          FOR_EACH_KMER(ad->seqs[a], ad->lens[a], ADAPTER_SEED_K, code, pos,
+                        ad->seed_start[code+1]++);
      }
-     trim_args.minreadlen = 1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
-          return 1;
+     for (code=0; code<nkmers; code++) {
+          ad->seed_start[code+1] += ad->seed_start[code];
+     }
+     nhits = ad->seed_start[nkmers];
+     ad->seed_hits = malloc((nhits+1) * sizeof(int));
+     fill = malloc(nkmers * sizeof(int));
+     NULLCHECK(ad->seed_hits);
+     NULLCHECK(fill);
+     memcpy(fill, ad->seed_start, nkmers * sizeof(int));
+     for (a=0; a<ad->n; a++) {
+          FOR_EACH_KMER(ad->seqs[a], ad->lens[a], ADAPTER_SEED_K, code, pos,
+                        ad->seed_hits[fill[code]++] = (a<<16) | (pos-ADAPTER_SEED_K+1));
      }
+     free(fill);
+     LOG_DEBUG("Indexed %d adapters with %d seeds\n", ad->n, nhits);
+     return 0;
+}
 
-     strcpy(ks->seq.s,  "AAAAA");
-     ks->seq.l = strlen(ks->seq.s);
-     strcpy(ks->qual.s, "+++++");
 
+/* which is either a built-in set name or a FastA file. returns
+ * non-zero on error */
+int adapters_init(adapters_t *ad, const char *which, double max_mismatch_rate, int min_overlap)
+{
+     static const char *builtin[][3] = {
+          /* set, name, sequence */
+          {"truseq", "TruSeq_Read1", "AGATCGGAAGAGCACACGTCTGAACTCCAGTCA"},
+          {"truseq", "TruSeq_Read2", "AGATCGGAAGAGCGTCGTGTAGGGAAAGAGTGT"},
+          {"nextera", "Nextera", "CTGTCTCTTATACACATCT"},
+          {"smallrna", "SmallRNA", "TGGAATTCTCGGGTGCCAAGG"},
+          {NULL, NULL, NULL}
+     };
+     int i;
 
-     strcpy(ks->qual.s, "+++++"); ks->qual.l = strlen(ks->qual.s);
-     if (read_below_minbq50p(ks, 9,  phredoffset)) {
-          LOG_ERROR("%s\n", "Q10 Read should not have been below minbq50p 9");
-          kseq_destroy(ks);
-          return 1;
+     memset(ad, 0, sizeof(adapters_t));
+     ad->max_mismatch_rate = max_mismatch_rate;
+     ad->min_overlap = min_overlap;
+
+     for (i=0; builtin[i][0]; i++) {
+          if (0 == strcmp(which, "all") || 0 == strcmp(which, builtin[i][0])) {
+               if (adapters_add(ad, builtin[i][1], builtin[i][2])) {
+                    return 1;
+               }
+          }
      }
-     
-     strcpy(ks->qual.s, "##+++"); ks->qual.l = strlen(ks->qual.s);
+     if (0 == ad->n) {
+          gzFile fp;
+          kseq_t *ks;
+          if (! file_exists(which) || NULL == (fp = gzopen(which, "r"))) {
+               LOG_ERROR("%s is neither a known adapter set nor a readable file\n", which);
+               return 1;
+          }
+          ks = kseq_init(fp);
+          while (kseq_read(ks) >= 0) {
+               if (adapters_add(ad, ks->name.s, ks->seq.s)) {
+                    kseq_destroy(ks);
+                    gzclose(fp);
+                    return 1;
+               }
+          }
+          kseq_destroy(ks);
+          gzclose(fp);
+          if (0 == ad->n) {
+               LOG_ERROR("No adapters found in %s\n", which);
+               return 1;
+          }
+     }
+     return adapters_build_index(ad);
+}
+
+
+void adapters_free(adapters_t *ad)
+{
+     int i;
+     for (i=0; i<ad->n; i++) {
+          free(ad->names[i]);
+          free(ad->seqs[i]);
+     }
+     free(ad->names);
+     free(ad->seqs);
+     free(ad->lens);
+     free(ad->seed_start);
+     free(ad->seed_hits);
+     memset(ad, 0, sizeof(adapters_t));
+}
+
+
+/* returns 1 if adapter a matches seq starting at start (possibly
+ * running over the 3'-end) */
+int adapter_matches_at(const adapters_t *ad, int a, const kseq_t *seq, int start)
+{
+     int overlap = seq->seq.l - start;
+     if (overlap > ad->lens[a]) {
+          overlap = ad->lens[a];
+     }
+     return count_mismatches(&seq->seq.s[start], ad->seqs[a], overlap)
+          <= (int)(overlap * ad->max_mismatch_rate);
+}
+
+
+/* returns leftmost start of an adapter in seq or seq->seq.l if none */
+int adapter_start(const adapters_t *ad, const kseq_t *seq)
+{
+     int best = seq->seq.l;
+     unsigned int code;
+     int pos, a, start, i;
+
+     /* seeds: adapter fully or at least ADAPTER_SEED_K long at 3'-end */
+     FOR_EACH_KMER(seq->seq.s, seq->seq.l, ADAPTER_SEED_K, code, pos, {
+               for (i=ad->seed_start[code]; i<ad->seed_start[code+1]; i++) {
+                    a = ad->seed_hits[i] >> 16;
+                    start = pos-ADAPTER_SEED_K+1 - (ad->seed_hits[i] & 0xFFFF);
+                    if (start >= 0 && start < best && adapter_matches_at(ad, a, seq, start)) {
+                         best = start;
+                    }
+               }
+          });
+
+     /* partial adapters at 3'-end, which seeds might have missed */
+     for (start=seq->seq.l - 2*ADAPTER_SEED_K + 1; start<=seq->seq.l - ad->min_overlap; start++) {
+          if (start < 0 || start >= best) {
+               continue;
+          }
+          for (a=0; a<ad->n; a++) {
+               if (adapter_matches_at(ad, a, seq, start)) {
+                    best = start;
+                    break;
+               }
+          }
+     }
+     return best;
+}
+
+
+/* trims adapters off seq by moving trim_pos->pos3p. returns 1 if read
+ * is to be discarded because it's then shorter than minreadlen
+ */
+int adapter_trim(trim_pos_t *trim_pos, const kseq_t *seq, const adapters_t *ad,
+                 const int minreadlen)
+{
+     int start = adapter_start(ad, seq);
+     if (start <= trim_pos->pos3p) {
+          trim_pos->pos3p = start-1;
+     }
+     return trim_pos->pos3p - trim_pos->pos5p + 1 < (minreadlen >= 1 ? minreadlen : 1);
+}
+
+
+/* returns expected errors of qual[0..len), i.e. the sum of error
+ * probabilities. qualities have to be in the valid range. stops
+ * early once limit is exceeded (pass a negative limit to sum
+ * everything). four independent accumulators keep the table lookups
+ * from serializing on one sum.
+ */
+double expected_errors(const char *qual, const int len, const int phredoffset, const double limit)
+{
+     double e0 = 0.0, e1 = 0.0, e2 = 0.0, e3 = 0.0;
+     int i = 0;
+
+     for (; i+16 <= len; ) {
+          int end = i+16;
+          for (; i<end; i+=4) {
+               e0 += phred_err[qual[i]-phredoffset];
+               e1 += phred_err[qual[i+1]-phredoffset];
+               e2 += phred_err[qual[i+2]-phredoffset];
+               e3 += phred_err[qual[i+3]-phredoffset];
+          }
+          if (limit >= 0.0 && e0+e1+e2+e3 > limit) {
+               return e0+e1+e2+e3;
+          }
+     }
+     for (; i<len; i++) {
+          e0 += phred_err[qual[i]-phredoffset];
+     }
+     return e0+e1+e2+e3;
+}
+
+
+/* returns number of bases in qual[0..len) that can be kept before
+ * expected errors exceed max_ee
+ */
+int trunc_ee_len(const char *qual, const int len, const int phredoffset, const double max_ee)
+{
+     double ee = 0.0;
+     int i;
+     for (i=0; i<len; i++) {
+          ee += phred_err[qual[i]-phredoffset];
+          if (ee > max_ee) {
+               return i;
+          }
+     }
+     return len;
+}
+
+
+/* applies expected errors truncation and filters (see args; mean
+ * quality is one as well) to the trimmed seq. the sum stops as soon
+ * as the limit is exceeded, which matters for long reads. returns 1
+ * if seq is to be discarded.
+ */
+int ee_filter(trim_pos_t *trim_pos, const kseq_t *seq, const int phredoffset,
+              const args_t *args)
+{
+     const char *qual = &seq->qual.s[trim_pos->pos5p];
+     int len = trim_pos->pos3p - trim_pos->pos5p + 1;
+     double limit;
+     double ee;
+
+     if (args->trunc_ee >= 0.0) {
+          len = trunc_ee_len(qual, len, phredoffset, args->trunc_ee);
+          if (len < (args->minreadlen >= 1 ? args->minreadlen : 1)) {
+               return 1;
+          }
+          trim_pos->pos3p = trim_pos->pos5p + len - 1;
+     }
+
+     limit = args->max_ee;
+     if (args->max_ee_rate >= 0.0 && (limit < 0.0 || args->max_ee_rate * len < limit)) {
+          limit = args->max_ee_rate * len;
+     }
+     /* a mean quality is a mean error probability, i.e. a rate */
+     if (args->min_mean_qual >= 0.0) {
+          double rate = pow(10.0, -args->min_mean_qual/10.0);
+          if (limit < 0.0 || rate * len < limit) {
+               limit = rate * len;
+          }
+     }
+     if (limit < 0.0) {
+          return 0;
+     }
+     ee = expected_errors(qual, len, phredoffset, limit);
+     return ee > limit;
+}
+
+
+/* Finds the best overlap of r1 and rc2, the reverse complement of
+ * the other mate, with shifts between min_shift and max_shift. For a
+ * shift s >= 0 rc2 starts at r1[s] (insert at least as long as r1),
+ * for s < 0 r1 starts at rc2[-s] (insert shorter than rc2, i.e. both
+ * mates read into adapters). Overlaps have to be at least min_len
+ * long with no more than OVERLAP_MAX_MISMATCH_RATE mismatches. The
+ * one with fewest mismatches wins, ties go to the longer
+ * overlap. Returns 1 and sets shift if found, 0 otherwise.
+ */
+int find_overlap(int *shift, const char *r1, const int l1, const char *rc2, const int l2,
+                 const int min_shift, const int max_shift, const int min_len)
+{
+     int best_mm = -1;
+     int best_len = 0;
+     int s;
+
+     for (s=min_shift; s<=max_shift; s++) {
+          int len, mm;
+          const char *a = r1, *b = rc2;
+          if (s >= 0) {
+               a = &r1[s];
+               len = l1-s < l2 ? l1-s : l2;
+          } else {
+               b = &rc2[-s];
+               len = l2+s < l1 ? l2+s : l1;
+          }
+          if (len < min_len) {
+               continue;
+          }
+          mm = count_mismatches(a, b, len);
+          if (mm > (int)(len * OVERLAP_MAX_MISMATCH_RATE)) {
+               continue;
+          }
+          if (-1 == best_mm || mm < best_mm || (mm == best_mm && len > best_len)) {
+               best_mm = mm;
+               best_len = len;
+               (*shift) = s;
+          }
+     }
+     return -1 != best_mm;
+}
+
+
+/* Overlap based adapter trimming for pairs whose insert is shorter
+ * than the reads: the insert length follows from how seq1 overlaps
+ * the reverse complement of seq2 and both mates are trimmed to it.
+ * rc_buf is used as scratch space. Returns 1 if the pair is to be
+ * discarded because a mate is then shorter than minreadlen.
+ */
+int overlap_trim(trim_pos_t *trim_pos1, trim_pos_t *trim_pos2,
+                 const kseq_t *seq1, const kseq_t *seq2, kstring_t *rc_buf,
+                 const int min_len, const int minreadlen)
+{
+     int shift;
+     int insert;
+
+     if (rc_buf->m < seq2->seq.l) {
+          char *tmp = realloc(rc_buf->s, seq2->seq.l);
+          NULLCHECK(tmp);
+          rc_buf->s = tmp;
+          rc_buf->m = seq2->seq.l;
+     }
+     revcomp(rc_buf->s, seq2->seq.s, seq2->seq.l);
+     if (! find_overlap(&shift, seq1->seq.s, (int)seq1->seq.l, rc_buf->s, (int)seq2->seq.l,
+                        min_len - (int)seq2->seq.l, 0, min_len)) {
+          return 0;
+     }
+     insert = (int)seq2->seq.l + shift;
+     if (trim_pos1->pos3p >= insert) {
+          trim_pos1->pos3p = insert-1;
+     }
+     if (trim_pos2->pos3p >= insert) {
+          trim_pos2->pos3p = insert-1;
+     }
+     return (trim_pos1->pos3p - trim_pos1->pos5p + 1 < (minreadlen >= 1 ? minreadlen : 1))
+          || (trim_pos2->pos3p - trim_pos2->pos5p + 1 < (minreadlen >= 1 ? minreadlen : 1));
+}
+
+
+/* Merges the trimmed mates seq1 and seq2 into merged if they
+ * overlap (see find_overlap()). The merged read spans from the start
+ * of seq1 to the end of the reverse complemented seq2, i.e. the
+ * insert. In the overlap the base with higher quality is taken
+ * (seq1 wins ties). merged owns its seq and qual, but name and
+ * comment only point to those of seq1. rc_buf is used as scratch
+ * space. Returns 1 if merged, 0 otherwise.
+ */
+int merge_pair(kseq_t *merged, const kseq_t *seq1, const trim_pos_t *trim_pos1,
+               const kseq_t *seq2, const trim_pos_t *trim_pos2,
+               kstring_t *rc_buf, const int min_len)
+{
+     const char *r1 = &seq1->seq.s[trim_pos1->pos5p];
+     const char *q1 = &seq1->qual.s[trim_pos1->pos5p];
+     const char *q2 = &seq2->qual.s[trim_pos2->pos5p];
+     int l1 = trim_pos1->pos3p - trim_pos1->pos5p + 1;
+     int l2 = trim_pos2->pos3p - trim_pos2->pos5p + 1;
+     int shift;
+     int len;
+     int i;
+
+     if (rc_buf->m < (size_t)l2) {
+          char *tmp = realloc(rc_buf->s, l2);
+          NULLCHECK(tmp);
+          rc_buf->s = tmp;
+          rc_buf->m = l2;
+     }
+     revcomp(rc_buf->s, &seq2->seq.s[trim_pos2->pos5p], l2);
+     if (! find_overlap(&shift, r1, l1, rc_buf->s, l2, min_len - l2, l1 - min_len, min_len)) {
+          return 0;
+     }
+
+     len = shift + l2;
+     if (merged->seq.m < (size_t)len+1) {
+          char *tmp1 = realloc(merged->seq.s, len+1);
+          char *tmp2 = realloc(merged->qual.s, len+1);
+          NULLCHECK(tmp1);
+          NULLCHECK(tmp2);
+          merged->seq.s = tmp1;
+          merged->qual.s = tmp2;
+          merged->seq.m = merged->qual.m = len+1;
+     }
+     for (i=0; i<len; i++) {
+          int j = i - shift; /* position in rc2 */
+          char b1 = 0, b2 = 0, c1 = 0, c2 = 0;
+          if (i < l1) {
+               b1 = r1[i];
+               c1 = q1[i];
+          }
+          if (j >= 0) {
+               b2 = rc_buf->s[j];
+               c2 = q2[l2-1-j];
+          }
+          if (! b2 || (b1 && c1 >= c2)) {
+               merged->seq.s[i] = b1;
+               merged->qual.s[i] = c1;
+          } else {
+               merged->seq.s[i] = b2;
+               merged->qual.s[i] = c2;
+          }
+          if (b1 == b2) {
+               merged->qual.s[i] = c1 > c2 ? c1 : c2;
+          }
+     }
+     merged->seq.s[len] = merged->qual.s[len] = '\0';
+     merged->seq.l = merged->qual.l = len;
+     merged->name = seq1->name;
+     merged->comment = seq1->comment;
+     return 1;
+}
+
+
+/* sets up quality binning in fmt from spec, which is either
+ * "illumina8" or comma-separated Q:value pairs with ascending Q.
+ * returns non-zero on error.
+ */
+int fmt_args_init_qual_bins(fmt_args_t *fmt, const char *spec, const int phredoffset)
+{
+     const char *p;
+     int i;
+
+     if (0 == strcmp(spec, "illumina8")) {
+          spec = QUAL_BIN_ILLUMINA8;
+     }
+     fmt->num_bins = 0;
+     for (p=spec; *p; ) {
+          int lo, val, n;
+          if (2 != sscanf(p, "%d:%d%n", &lo, &val, &n)
+              || lo<0 || lo>93 || val<0 || val>93
+              || (fmt->num_bins && lo+phredoffset <= fmt->bin_lo[fmt->num_bins-1])) {
+               LOG_ERROR("Invalid quality bins '%s'\n", spec);
+               return 1;
+          }
+          fmt->bin_lo[fmt->num_bins] = lo + phredoffset;
+          fmt->bin_val[fmt->num_bins] = val + phredoffset;
+          fmt->num_bins++;
+          p += n;
+          if (',' == *p) {
+               p++;
+          } else if (*p) {
+               LOG_ERROR("Invalid quality bins '%s'\n", spec);
+               return 1;
+          }
+     }
+
+     for (i=0; i<256; i++) {
+          int b;
+          fmt->qual_table[i] = i;
+          for (b=0; b<fmt->num_bins; b++) {
+               if (i >= fmt->bin_lo[b]) {
+                    fmt->qual_table[i] = fmt->bin_val[b];
+               }
+          }
+     }
+     return 0;
+}
+
+
+/* bins len quality chars in place. the bins are monotone steps, so
+ * each one is a compare and blend over 16 chars at a time (SSE2
+ * lacks pshufb). the rest goes through the translation table.
+ */
+void qual_bin(char *qual, const int len, const fmt_args_t *fmt)
+{
+     int i = 0;
+#ifdef __SSE2__
+     /* with phred64, chars and bounds can be above 127. SSE2 only
+      * compares signed, so both sides get their top bit flipped */
+     const __m128i bias = _mm_set1_epi8((char)0x80);
+     for (; i+16 <= len; i+=16) {
+          __m128i q = _mm_loadu_si128((const __m128i *)&qual[i]);
+          __m128i qb = _mm_xor_si128(q, bias);
+          __m128i r = q;
+          int b;
+          for (b=0; b<fmt->num_bins; b++) {
+               __m128i m = _mm_cmpgt_epi8(qb, _mm_set1_epi8((char)((fmt->bin_lo[b]-1) ^ 0x80)));
+               r = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi8(fmt->bin_val[b])),
+                                _mm_andnot_si128(m, r));
+          }
+          _mm_storeu_si128((__m128i *)&qual[i], r);
+     }
+#endif
+     for (; i<len; i++) {
+          qual[i] = fmt->qual_table[(unsigned char)qual[i]];
+     }
+}
+
+
+/* replaces bases in seq[0..len) whose quality char is below
+ * mask_below with N. branch-free compare and blend, 16 at a time.
+ * with phred64, chars and threshold can be above 127, so both are
+ * compared unsigned.
+ */
+void mask_low_qual(char *seq, const char *qual, const int len, const int mask_below)
+{
+     int i = 0;
+#ifdef __SSE2__
+     /* SSE2 only compares signed: flipping the top bit makes that unsigned */
+     const __m128i bias = _mm_set1_epi8((char)0x80);
+     const __m128i thr = _mm_set1_epi8((char)(mask_below ^ 0x80));
+     const __m128i n = _mm_set1_epi8('N');
+     for (; i+16 <= len; i+=16) {
+          __m128i q = _mm_loadu_si128((const __m128i *)&qual[i]);
+          __m128i b = _mm_loadu_si128((const __m128i *)&seq[i]);
+          __m128i m = _mm_cmpgt_epi8(thr, _mm_xor_si128(q, bias));
+          _mm_storeu_si128((__m128i *)&seq[i],
+                           _mm_or_si128(_mm_and_si128(m, n), _mm_andnot_si128(m, b)));
+     }
+#endif
+     for (; i<len; i++) {
+          seq[i] = (unsigned char)qual[i] < mask_below ? 'N' : seq[i];
+     }
+}
+
+
+/* returns the offset of name after stripping the instrument prefix
+ * (instrument and run for Casava 1.8+) from Illumina read names, or 0
+ * for other names
+ */
+int name_prefix_len(const char *name, const int len)
+{
+     int colons[3];
+     int n = 0;
+     int i;
+     for (i=0; i<len; i++) {
+          if (':' == name[i]) {
+               if (n < 3) {
+                    colons[n] = i;
+               }
+               n++;
+          }
+     }
+     if (n >= 6) {
+          /* instrument:run:flowcell:lane:tile:x:y */
+          return colons[1]+1;
+     } else if (n >= 4) {
+          /* instrument:lane:tile:x:y */
+          return colons[0]+1;
+     }
+     return 0;
+}
+
+
+/* determines start and length of the part of seq to write, according
+ * to trim_pos (which may be NULL or hold -1 for untrimmed). returns
+ * non-zero on error
+ */
+int trimmed_region(int *start, int *len, const kseq_t *seq, const trim_pos_t *trim_pos)
+{
+     *start = 0;
+     *len = seq->seq.l;
+     if (NULL != trim_pos && (trim_pos->pos5p >= 0 && trim_pos->pos3p >= 0)) {
+          if (trim_pos->pos3p - trim_pos->pos5p + 1 < 0) {
+               LOG_ERROR("%s\n", "Internal error: Invalid trim pos (negative distance between 5p and 3p)");
+               return 1;
+          }
+          if (trim_pos->pos3p >= seq->qual.l) {
+               LOG_ERROR("Internal error: Invalid 3p trim pos (%d > string length which is %d)\n",
+                         trim_pos->pos3p, seq->qual.l);
+               return 1;
+          }
+          *start = trim_pos->pos5p;
+          *len = trim_pos->pos3p - trim_pos->pos5p + 1;
+     }
+     return 0;
+}
+
+
+/* writes (possibly renamed) read name to dst without comment or
+ * trailing 0. returns its length. dst needs to hold seq->name.l + 21
+ * bytes
+ */
+int name_fmt(char *dst, const kseq_t *seq, const fmt_args_t *fmt)
+{
+     if (fmt && RENAME_NUMBER == fmt->rename) {
+          return sprintf(dst, "%lu", fmt->read_no);
+     } else if (fmt && RENAME_STRIP_PREFIX == fmt->rename) {
+          int off = name_prefix_len(seq->name.s, seq->name.l);
+          memcpy(dst, &seq->name.s[off], seq->name.l - off);
+          return seq->name.l - off;
+     }
+     memcpy(dst, seq->name.s, seq->name.l);
+     return seq->name.l;
+}
+
+
+/* returns the maximum number of bytes fastq_fmt() might write for
+ * seq (excluding a trailing 0)
+ */
+int fastq_fmt_maxlen(const kseq_t *seq) {
+     return 1/*@*/ + seq->name.l + 21/*number instead of name*/
+          + 1/*space*/ + seq->comment.l
+          + 1 /* newline */
+          + seq->seq.l 
+          + 3 /* newline, '+' and newline */ 
+          + seq->qual.l 
+          + 1; /* newline */
+}
+
+
+/* formats fastq entry including trailing newline into dst, which has
+ * to hold at least fastq_fmt_maxlen() bytes. no trailing 0 is
+ * written. returns number of bytes written or negative number on
+ * error. if trim_pos is not NULL or (both values are not -1) seq will
+ * be trimmed accordingly. fmt (may be NULL) holds further output
+ * options, which are applied in dst. seq itself is never modified.
+ */
+int fastq_fmt(char *dst, const kseq_t *seq, const trim_pos_t *trim_pos, const fmt_args_t *fmt) {
+     char *p = dst;
+     char *s; /* start of sequence in dst */
+     int start;
+     int len;
+
+     /* fastq is supposed to have a quality string */
+     if (! seq->qual.l){
+          LOG_ERROR("%s\n", "FastQ is missing a quality string");
+          return -1;
+     }
+
+     if (trimmed_region(&start, &len, seq, trim_pos)) {
+          return -1;
+     }
+
+     *p++ = (fmt && OUT_FORMAT_FASTA == fmt->out_format) ? '>' : '@';
+     p += name_fmt(p, seq, fmt);
+     if (seq->comment.l && ! (fmt && fmt->drop_comment)) {
+          *p++ = ' ';
+          memcpy(p, seq->comment.s, seq->comment.l); p += seq->comment.l;
+     }
+     *p++ = '\n';
+     s = p;
+     memcpy(p, & seq->seq.s[start], len); p += len;
+     if (fmt && OUT_FORMAT_FASTA == fmt->out_format) {
+          if (fmt->mask_below) {
+               mask_low_qual(s, & seq->qual.s[start], len, fmt->mask_below);
+          }
+          if (fmt->revcomp) {
+               revcomp_inplace(s, NULL, len);
+          }
+          *p++ = '\n';
+          return p-dst;
+     }
+     *p++ = '\n'; *p++ = '+'; *p++ = '\n';
+     memcpy(p, & seq->qual.s[start], len);
+     if (fmt && fmt->mask_below) {
+          mask_low_qual(s, p, len, fmt->mask_below);
+     }
+     if (fmt && fmt->num_bins) {
+          qual_bin(p, len, fmt);
+     }
+     if (fmt && fmt->revcomp) {
+          revcomp_inplace(s, p, len);
+     }
+     p += len;
+     *p++ = '\n';
+
+     return p-dst;
+}
+
+
+/* prints fastq entry including trailing newline. returns negative
+ * number on error. caller has to free buf, which will be allocated
+ * here. if trim_pos is not NULL or (both values are not -1) seq will
+ * be trimmed accordingly.
+ */
+int sprintf_fastq(char **buf, const kseq_t *seq, const trim_pos_t *trim_pos) {
+     int ret;
+
+     (*buf) = calloc(fastq_fmt_maxlen(seq) + 1/* trailing 0 */, sizeof(char));
+     NULLCHECK((*buf));
+     ret = fastq_fmt((*buf), seq, trim_pos, NULL);
+     if (ret >= 0) {
+          (*buf)[ret] = '\0';
+     }
+     return ret;
+}
+
+
+static void put_le16(char *p, unsigned int v)
+{
+     p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+}
+
+
+static void put_le32(char *p, unsigned int v)
+{
+     p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+     p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+
+static void put_le64(char *p, uint64_t v)
+{
+     put_le32(p, v & 0xffffffff);
+     put_le32(p+4, v >> 32);
+}
+
+
+static unsigned int get_le32(const unsigned char *p)
+{
+     return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+/* makes sure str can hold size bytes. returns non-zero on error */
+static int ks_reserve(kstring_t *str, size_t size)
+{
+     if (size > str->m) {
+          char *tmp = realloc(str->s, size);
+          if (NULL == tmp) {
+               return 1;
+          }
+          str->s = tmp;
+          str->m = size;
+     }
+     return 0;
+}
+
+
+/* appends len bytes of src to str. returns non-zero on error */
+static int ks_append(kstring_t *str, const void *src, size_t len)
+{
+     if (ks_reserve(str, str->l + len)) {
+          return 1;
+     }
+     memcpy(str->s + str->l, src, len);
+     str->l += len;
+     return 0;
+}
+
+
+/* returns the maximum number of bytes bam_fmt() might write for seq */
+int bam_fmt_maxlen(const kseq_t *seq, const fmt_args_t *fmt) {
+     return 36 /* fixed part incl. block_size */
+          + seq->name.l + 21 /*number instead of name*/ + 1 /* trailing 0 */
+          + (seq->seq.l+1)/2
+          + seq->qual.l
+          + seq->seq.l /* scratch space for masking */
+          + 4 + strlen(fmt->rg_id); /* RG:Z:<id> */
+}
+
+
+/* formats seq as unaligned BAM record (including block_size) with
+ * fmt->bam_flag and an RG tag into dst, which has to hold at least
+ * bam_fmt_maxlen() bytes. trimming and fmt as in fastq_fmt(), except
+ * that comments and /1 or /2 suffixes are dropped from names. returns
+ * number of bytes written or negative number on error.
+ */
+int bam_fmt(char *dst, const kseq_t *seq, const trim_pos_t *trim_pos, const fmt_args_t *fmt) {
+     char *p = dst + 36; /* fixed-length part is filled in last */
+     char *q; /* qualities in dst */
+     char *s; /* ascii copy of sequence after qualities */
+     int start, len, namelen;
+     int i;
+
+     if (! seq->qual.l){
+          LOG_ERROR("%s\n", "FastQ is missing a quality string");
+          return -1;
+     }
+     if (trimmed_region(&start, &len, seq, trim_pos)) {
+          return -1;
+     }
+
+     namelen = name_fmt(p, seq, fmt);
+     if (namelen > 2 && p[namelen-2] == '/' && (p[namelen-1] == '1' || p[namelen-1] == '2')) {
+          namelen -= 2;
+     }
+     if (namelen > 254) {
+          LOG_ERROR("Read name too long for BAM: %s\n", seq->name.s);
+          return -1;
+     }
+     p[namelen] = '\0';
+     p += namelen+1;
+
+     q = p + (len+1)/2;
+     s = q + len;
+     memcpy(q, & seq->qual.s[start], len);
+     memcpy(s, & seq->seq.s[start], len);
+     if (fmt->mask_below) {
+          mask_low_qual(s, q, len, fmt->mask_below);
+     }
+     if (fmt->revcomp) {
+          revcomp_inplace(s, q, len);
+     }
+     for (i=0; i+1<len; i+=2) {
+          p[i/2] = (nt16_table[(unsigned char)s[i]] << 4) | nt16_table[(unsigned char)s[i+1]];
+     }
+     if (len & 1) {
+          p[len/2] = nt16_table[(unsigned char)s[len-1]] << 4;
+     }
+     if (fmt->num_bins) {
+          qual_bin(q, len, fmt);
+     }
+     for (i=0; i<len; i++) {
+          q[i] -= fmt->phredoffset;
+     }
+
+     p = s;
+     memcpy(p, "RGZ", 3); p += 3;
+     i = strlen(fmt->rg_id) + 1;
+     memcpy(p, fmt->rg_id, i); p += i;
+
+     put_le32(dst, p - dst - 4); /* block_size */
+     put_le32(dst+4, 0xffffffff); /* refID */
+     put_le32(dst+8, 0xffffffff); /* pos */
+     dst[12] = namelen + 1;
+     dst[13] = 0; /* mapq */
+     put_le16(dst+14, 4680); /* bin, i.e. reg2bin(-1, 0) */
+     put_le16(dst+16, 0); /* n_cigar_op */
+     put_le16(dst+18, fmt->bam_flag);
+     put_le32(dst+20, len);
+     put_le32(dst+24, 0xffffffff); /* next_refID */
+     put_le32(dst+28, 0xffffffff); /* next_pos */
+     put_le32(dst+32, 0); /* tlen */
+
+     return p-dst;
+}
+
+
+/* returns the maximum number of bytes fbin_fmt() might write for seq */
+int fbin_fmt_maxlen(const kseq_t *seq) {
+     return FBIN_ROW_HDR_LEN
+          + seq->name.l + 21 /*number instead of name*/
+          + seq->comment.l
+          + seq->seq.l
+          + seq->qual.l;
+}
+
+
+/* formats seq as row for fbin output into dst, which has to hold at
+ * least fbin_fmt_maxlen() bytes. rows are turned into columns by
+ * fbin_write_block() once the output buffer is flushed. a row is:
+ * mate (0 if unpaired, 1 or 2; from fmt->bam_flag), seq length,
+ * name length and comment length (little endian uint8 and 3x uint32),
+ * followed by name, comment, seq and qual. trimming and fmt as in
+ * fastq_fmt(). returns number of bytes written or negative number on
+ * error.
+ */
+int fbin_fmt(char *dst, const kseq_t *seq, const trim_pos_t *trim_pos, const fmt_args_t *fmt) {
+     char *p = dst + FBIN_ROW_HDR_LEN;
+     char *s; /* start of sequence in dst */
+     int start, len, namelen, commentlen;
+
+     if (! seq->qual.l){
+          LOG_ERROR("%s\n", "FastQ is missing a quality string");
+          return -1;
+     }
+     if (trimmed_region(&start, &len, seq, trim_pos)) {
+          return -1;
+     }
+
+     namelen = name_fmt(p, seq, fmt);
+     p += namelen;
+     commentlen = fmt->drop_comment ? 0 : seq->comment.l;
+     memcpy(p, seq->comment.s, commentlen); p += commentlen;
+     s = p;
+     memcpy(p, & seq->seq.s[start], len); p += len;
+     memcpy(p, & seq->qual.s[start], len);
+     if (fmt->mask_below) {
+          mask_low_qual(s, p, len, fmt->mask_below);
+     }
+     if (fmt->num_bins) {
+          qual_bin(p, len, fmt);
+     }
+     if (fmt->revcomp) {
+          revcomp_inplace(s, p, len);
+     }
+     p += len;
+
+     dst[0] = (fmt->bam_flag & (BAM_FREAD1 | BAM_FREAD2)) >> 6;
+     put_le32(dst+1, len);
+     put_le32(dst+5, namelen);
+     put_le32(dst+9, commentlen);
+     return p-dst;
+}
+
+
+/* builds the (uncompressed) BAM header for unaligned reads with one
+ * read group. returns non-zero on error
+ */
+int bam_header_init(kstring_t *hdr, const char *rg_id, const char *rg_sample)
+{
+     char *text;
+     int l_text;
+
+     l_text = strlen("@HD\tVN:1.6\tSO:unsorted\tGO:query\n@RG\tID:\tSM:\n@PG\tID:\tPN:\tVN:\n")
+          + strlen(rg_id) + strlen(rg_sample) + 2*strlen(PACKAGE_NAME) + strlen(PACKAGE_VERSION);
+     hdr->m = 4 + 4 + l_text + 1 + 4;
+     hdr->s = malloc(hdr->m);
+     NULLCHECK(hdr->s);
+     text = hdr->s + 8;
+     sprintf(text, "@HD\tVN:1.6\tSO:unsorted\tGO:query\n@RG\tID:%s\tSM:%s\n@PG\tID:%s\tPN:%s\tVN:%s\n",
+             rg_id, rg_sample, PACKAGE_NAME, PACKAGE_NAME, PACKAGE_VERSION);
+     memcpy(hdr->s, "BAM\1", 4);
+     put_le32(hdr->s+4, l_text);
+     put_le32(text + l_text, 0); /* n_ref */
+     hdr->l = 8 + l_text + 4;
+     return 0;
+}
+
+
+/* Buffered gzip output. Records are formatted straight into buf and
+ * handed to gzwrite once it's full. If threaded, compression happens
+ * in a separate thread: buf and wbuf are swapped on flush, so that
+ * the caller can continue filling one while the other is being
+ * compressed. Instead of gzip, the container can also be BGZF or
+ * fbin blocks, both compressed here and written through fp as is.
+ */
+typedef struct {
+     gzFile fp;
+     char *fname;
+     char *buf;
+     size_t len;
+     size_t size;
+
+     int container; /* one of GZOUT_* */
+     /* used by whoever compresses */
+     z_stream zs; /* bgzf */
+     unsigned char *zbuf; /* bgzf */
+     kstring_t col[FBIN_NCOLS]; /* fbin */
+     kstring_t blk; /* fbin */
+     uint64_t offset; /* fbin: bytes written so far */
+     uint64_t n_rows; /* fbin: rows written so far */
+     kstring_t index; /* fbin: offset and first row of each block */
+
+     int threaded;
+     char *wbuf;
+     size_t wlen;
+     size_t wsize;
+     int pending; /* wbuf waiting to be compressed */
+     int finish; /* no more data to come */
+     int err;
+     pthread_t thread;
+     pthread_mutex_t lock;
+     pthread_cond_t cond;
+} gzout_t;
+
+
+/* compresses len bytes from buf as BGZF blocks and writes them to
+ * out->fp. returns non-zero on error.
+ */
+int bgzf_write(gzout_t *out, const char *buf, size_t len) {
+     unsigned char *z = out->zbuf;
+     static const unsigned char hdr[BGZF_HDR_LEN] = {
+          31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0};
+
+     while (len) {
+          size_t in = len < BGZF_BLOCK_INPUT ? len : BGZF_BLOCK_INPUT;
+          size_t zlen;
+          unsigned int crc;
+
+          if (Z_OK != deflateReset(&out->zs)) {
+               return 1;
+          }
+          out->zs.next_in = (Bytef *)buf;
+          out->zs.avail_in = in;
+          out->zs.next_out = z + BGZF_HDR_LEN;
+          out->zs.avail_out = BGZF_BLOCK_MAX - BGZF_HDR_LEN - 8;
+          if (Z_STREAM_END != deflate(&out->zs, Z_FINISH)) {
+               return 1;
+          }
+          zlen = BGZF_BLOCK_MAX - 8 - out->zs.avail_out; /* whole block without footer */
+          memcpy(z, hdr, BGZF_HDR_LEN);
+          put_le16((char *)z + 16, zlen + 8 - 1); /* BSIZE */
+          crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)buf, in);
+          put_le32((char *)z + zlen, crc);
+          put_le32((char *)z + zlen + 4, in);
+          if (gzwrite(out->fp, z, zlen + 8) != (int)(zlen + 8)) {
+               return 1;
+          }
+          buf += in;
+          len -= in;
+     }
+     return 0;
+}
+
+
+/* BGZF end-of-file marker: an empty block */
+static const unsigned char bgzf_eof[28] = {
+     31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+     27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+
+int bgzf_write_eof(gzout_t *out) {
+     return gzwrite(out->fp, bgzf_eof, sizeof(bgzf_eof)) != (int)sizeof(bgzf_eof);
+}
+
+
+/* removes the end-of-file marker from BGZF file fname before
+ * appending to it, since readers stop at empty blocks. returns
+ * non-zero on error, including a missing marker
+ */
+int bgzf_strip_eof(const char *fname) {
+     unsigned char buf[sizeof(bgzf_eof)];
+     FILE *fp = fopen(fname, "r+b");
+     long size;
+     int rc = 1;
+
+     if (NULL == fp) {
+          return 1;
+     }
+     if (0 == fseek(fp, 0, SEEK_END) && (size = ftell(fp)) >= (long)sizeof(buf)
+         && 0 == fseek(fp, size - sizeof(buf), SEEK_SET)
+         && fread(buf, 1, sizeof(buf), fp) == sizeof(buf)
+         && 0 == memcmp(buf, bgzf_eof, sizeof(buf))) {
+          rc = ftruncate(fileno(fp), size - sizeof(buf)) ? 1 : 0;
+     }
+     fclose(fp);
+     return rc;
+}
+
+
+/* appends column col to block blk as raw length, compressed length
+ * (uint32 each) and zlib-compressed data. returns non-zero on error
+ */
+int fbin_put_col(kstring_t *blk, const kstring_t *col)
+{
+     uLongf zlen = compressBound(col->l);
+     if (ks_reserve(blk, blk->l + 8 + zlen)) {
+          return 1;
+     }
+     if (Z_OK != compress2((Bytef *)blk->s + blk->l + 8, &zlen,
+                           (const Bytef *)col->s, col->l, Z_DEFAULT_COMPRESSION)) {
+          return 1;
+     }
+     put_le32(blk->s + blk->l, col->l);
+     put_le32(blk->s + blk->l + 4, zlen);
+     blk->l += 8 + zlen;
+     return 0;
+}
+
+
+/* Turns len bytes of rows (see fbin_fmt()) in buf into one fbin block
+ * and writes it to out->fp. An fbin file is FBIN_MAGIC, followed by
+ * blocks, an index and a trailer (see fbin_write_index()). A block is
+ * "FBLK", the number of rows (uint32) and FBIN_NCOLS columns (see
+ * fbin_put_col()), each compressed on its own:
+ *
+ * - mate: uint8 per row
+ * - len: uint32 per row
+ * - name: 0-terminated name and comment per row
+ * - bases: 2-bit codes (nt4_table), four per byte, low bits first,
+ *   padded to full bytes per row
+ * - exceptions: anything but ACGT as runs of uint32 offset (in the
+ *   bases of the block), uint32 length and the char itself
+ * - qual: runs of char and uint8 count (1-255), across rows
+ *
+ * Blocks don't depend on each other, so they can be decoded in
+ * parallel. Returns non-zero on error.
+ */
+int fbin_write_block(gzout_t *out, const char *buf, size_t len) {
+     const char *p = buf;
+     const char *end = buf + len;
+     kstring_t *col = out->col;
+     uint32_t n = 0;
+     uint32_t off = 0; /* of current row in bases of block */
+     /* offsets of last exception and quality run. columns might move */
+     size_t exc = SIZE_MAX;
+     size_t run = SIZE_MAX;
+     char idx[16];
+     int i;
+
+     if (! len) {
+          return 0;
+     }
+     for (i=0; i<FBIN_NCOLS; i++) {
+          col[i].l = 0;
+     }
+     while (p < end) {
+          uint32_t slen = get_le32((const unsigned char *)p+1);
+          uint32_t nlen = get_le32((const unsigned char *)p+5);
+          uint32_t clen = get_le32((const unsigned char *)p+9);
+          const char *name = p + FBIN_ROW_HDR_LEN;
+          const char *seq = name + nlen + clen;
+          const char *qual = seq + slen;
+          unsigned char *bases;
+          uint32_t j;
+
+          if (ks_append(&col[FBIN_COL_MATE], p, 1)
+              || ks_append(&col[FBIN_COL_LEN], p+1, 4)
+              || ks_append(&col[FBIN_COL_NAME], name, nlen)
+              || ks_append(&col[FBIN_COL_NAME], "", 1)
+              || ks_append(&col[FBIN_COL_NAME], name + nlen, clen)
+              || ks_append(&col[FBIN_COL_NAME], "", 1)
+              || ks_reserve(&col[FBIN_COL_BASES], col[FBIN_COL_BASES].l + (slen+3)/4)
+              || ks_reserve(&col[FBIN_COL_QUAL], col[FBIN_COL_QUAL].l + 2*slen)) {
+               return 1;
+          }
+          bases = (unsigned char *)col[FBIN_COL_BASES].s + col[FBIN_COL_BASES].l;
+          memset(bases, 0, (slen+3)/4);
+          for (j=0; j<slen; j++) {
+               unsigned char c = seq[j];
+               unsigned char code = nt4_table[c];
+               if (code > 3 || c >= 'a') {
+                    /* extend last run or start a new one */
+                    char *e = SIZE_MAX != exc ? col[FBIN_COL_EXC].s + exc : NULL;
+                    if (e && get_le32((unsigned char *)e) + get_le32((unsigned char *)e+4) == off + j
+                        && e[8] == (char)c) {
+                         put_le32(e+4, get_le32((unsigned char *)e+4) + 1);
+                    } else {
+                         char new[FBIN_EXC_LEN];
+                         put_le32(new, off + j);
+                         put_le32(new+4, 1);
+                         new[8] = c;
+                         if (ks_append(&col[FBIN_COL_EXC], new, FBIN_EXC_LEN)) {
+                              return 1;
+                         }
+                         exc = col[FBIN_COL_EXC].l - FBIN_EXC_LEN;
+                    }
+                    code = 0;
+               }
+               bases[j/4] |= code << (2*(j%4));
+          }
+          col[FBIN_COL_BASES].l += (slen+3)/4;
+
+          for (j=0; j<slen; j++) {
+               char *q = SIZE_MAX != run ? col[FBIN_COL_QUAL].s + run : NULL;
+               if (q && q[0] == qual[j] && (unsigned char)q[1] < 255) {
+                    q[1]++;
+               } else {
+                    run = col[FBIN_COL_QUAL].l;
+                    q = col[FBIN_COL_QUAL].s + run;
+                    q[0] = qual[j];
+                    q[1] = 1;
+                    col[FBIN_COL_QUAL].l += 2;
+               }
+          }
+
+          off += slen;
+          n++;
+          p = qual + slen;
+     }
+
+     out->blk.l = 0;
+     if (ks_reserve(&out->blk, 8)) {
+          return 1;
+     }
+     memcpy(out->blk.s, "FBLK", 4);
+     put_le32(out->blk.s+4, n);
+     out->blk.l = 8;
+     for (i=0; i<FBIN_NCOLS; i++) {
+          if (fbin_put_col(&out->blk, &col[i])) {
+               return 1;
+          }
+     }
+     if (gzwrite(out->fp, out->blk.s, out->blk.l) != (int)out->blk.l) {
+          return 1;
+     }
+     put_le64(idx, out->offset);
+     put_le64(idx+8, out->n_rows);
+     if (ks_append(&out->index, idx, 16)) {
+          return 1;
+     }
+     out->offset += out->blk.l;
+     out->n_rows += n;
+     return 0;
+}
+
+
+/* writes "FIDX", number of blocks (uint32) and for each block its
+ * file offset and number of its first row (uint64 each), followed by
+ * the offset of the index (uint64) and "FEND". returns non-zero on
+ * error
+ */
+int fbin_write_index(gzout_t *out) {
+     char buf[12];
+
+     memcpy(buf, "FIDX", 4);
+     put_le32(buf+4, out->index.l/16);
+     if (gzwrite(out->fp, buf, 8) != 8
+         || (out->index.l && gzwrite(out->fp, out->index.s, out->index.l) != (int)out->index.l)) {
+          return 1;
+     }
+     put_le64(buf, out->offset);
+     memcpy(buf+8, "FEND", 4);
+     return gzwrite(out->fp, buf, 12) != 12;
+}
+
+
+/* writes len bytes of buf to out->fp, compressing as configured.
+ * returns non-zero on error
+ */
+int gzout_write(gzout_t *out, const char *buf, size_t len) {
+     if (GZOUT_BGZF == out->container) {
+          return bgzf_write(out, buf, len);
+     } else if (GZOUT_FBIN == out->container) {
+          return fbin_write_block(out, buf, len);
+     }
+     return len && gzwrite(out->fp, buf, len) != (int)len;
+}
+
+
+void *gzout_worker(void *arg) {
+     gzout_t *out = (gzout_t *)arg;
+
+     pthread_mutex_lock(&out->lock);
+     while (1) {
+          while (! out->pending && ! out->finish) {
+               pthread_cond_wait(&out->cond, &out->lock);
+          }
+          if (! out->pending) {
+               break;
+          }
+          pthread_mutex_unlock(&out->lock);
+          /* wbuf belongs to us while pending is set */
+          if (gzout_write(out, out->wbuf, out->wlen)) {
+               out->err = 1;
+          }
+          pthread_mutex_lock(&out->lock);
+          out->pending = 0;
+          pthread_cond_broadcast(&out->cond);
+     }
+     pthread_mutex_unlock(&out->lock);
+     return NULL;
+}
+
+
+/* frees out and everything in it, without flushing or closing */
+void gzout_free(gzout_t *out) {
+     int i;
+     if (GZOUT_BGZF == out->container && out->zbuf) {
+          deflateEnd(&out->zs);
+     }
+     free(out->zbuf);
+     for (i=0; i<FBIN_NCOLS; i++) {
+          free(out->col[i].s);
+     }
+     free(out->blk.s);
+     free(out->index.s);
+     free(out->fname);
+     free(out->buf);
+     free(out->wbuf);
+     free(out);
+}
+
+
+/* fname might be '-' for stdout. bufsize is the size of the output
+ * buffer (twice that if threaded). mode is 'w' or 'a' (not for
+ * GZOUT_FBIN). container is one of GZOUT_*. returns NULL on error */
+gzout_t *gzout_open(const char *fname, const char *mode, int threaded, size_t bufsize, int container) {
+     gzout_t *out = calloc(1, sizeof(gzout_t));
+     /* T: written as is, since we compress ourselves */
+     char zmode[3] = { mode[0], GZOUT_GZIP == container ? '\0' : 'T', '\0' };
+     if (NULL == out) {
+          return NULL;
+     }
+     if (GZOUT_FBIN == container && 'a' == mode[0]) {
+          LOG_ERROR("Can't append to %s (fbin)\n", fname);
+          free(out);
+          return NULL;
+     }
+     out->container = container;
+     out->fname = strdup(fname);
+     out->size = bufsize;
+     out->buf = malloc(out->size);
+     if (NULL == out->fname || NULL == out->buf) {
+          gzout_free(out);
+          return NULL;
+     }
+     if (GZOUT_BGZF == container) {
+          out->zbuf = malloc(BGZF_BLOCK_MAX);
+          if (NULL == out->zbuf) {
+               gzout_free(out);
+               return NULL;
+          }
+          if (Z_OK != deflateInit2(&out->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                   -15, 8, Z_DEFAULT_STRATEGY)) {
+               free(out->zbuf);
+               out->zbuf = NULL;
+               gzout_free(out);
+               return NULL;
+          }
+     }
+     if (0 == strcmp(fname, "-")) {
+          out->fp = gzdopen(fileno(stdout), zmode);
+     } else {
+          out->fp = gzopen(fname, zmode);
+     }
+     if (NULL == out->fp) {
+          gzout_free(out);
+          return NULL;
+     }
+     if (GZOUT_FBIN == container) {
+          if (gzwrite(out->fp, FBIN_MAGIC, 8) != 8) {
+               gzclose(out->fp);
+               gzout_free(out);
+               return NULL;
+          }
+          out->offset = 8;
+     }
+
+     if (threaded) {
+          out->wsize = bufsize;
+          out->wbuf = malloc(out->wsize);
+          if (NULL == out->wbuf) {
+               gzclose(out->fp);
+               gzout_free(out);
+               return NULL;
+          }
+          pthread_mutex_init(&out->lock, NULL);
+          pthread_cond_init(&out->cond, NULL);
+          if (pthread_create(&out->thread, NULL, gzout_worker, out)) {
+               LOG_ERROR("Couldn't create compression thread for %s\n", fname);
+               pthread_mutex_destroy(&out->lock);
+               pthread_cond_destroy(&out->cond);
+               gzclose(out->fp);
+               gzout_free(out);
+               return NULL;
+          }
+          out->threaded = 1;
+     }
+     return out;
+}
+
+
+/* hands buffer content over to compression. returns non-zero on error */
+int gzout_flush(gzout_t *out) {
+     char *tmp;
+     size_t tmpsize;
+
+     if (! out->threaded) {
+          if (gzout_write(out, out->buf, out->len)) {
+               return 1;
+          }
+          out->len = 0;
+          return 0;
+     }
+
+     pthread_mutex_lock(&out->lock);
+     while (out->pending) {
+          pthread_cond_wait(&out->cond, &out->lock);
+     }
+     if (out->err) {
+          pthread_mutex_unlock(&out->lock);
+          return 1;
+     }
+     tmp = out->wbuf; out->wbuf = out->buf; out->buf = tmp;
+     tmpsize = out->wsize; out->wsize = out->size; out->size = tmpsize;
+     out->wlen = out->len;
+     out->len = 0;
+     out->pending = 1;
+     pthread_cond_broadcast(&out->cond);
+     pthread_mutex_unlock(&out->lock);
+     return 0;
+}
+
+
+/* returns pointer to at least len free bytes in output buffer or NULL
+ * on error. use gzout_commit() to mark them as used.
+ */
+char *gzout_reserve(gzout_t *out, size_t len) {
+     if (out->len + len > out->size) {
+          if (gzout_flush(out)) {
+               return NULL;
+          }
+          if (len > out->size) {
+               char *tmp = realloc(out->buf, len);
+               if (NULL == tmp) {
+                    return NULL;
+               }
+               out->buf = tmp;
+               out->size = len;
+          }
+     }
+     return & out->buf[out->len];
+}
+
+
+void gzout_commit(gzout_t *out, size_t len) {
+     out->len += len;
+}
+
+
+/* flushes, closes and frees out. returns non-zero on error */
+int gzout_close(gzout_t *out) {
+     int rc = 0;
+
+     if (NULL == out) {
+          return 0;
+     }
+     if (gzout_flush(out)) {
+          rc = 1;
+     }
+     if (out->threaded) {
+          pthread_mutex_lock(&out->lock);
+          out->finish = 1;
+          pthread_cond_broadcast(&out->cond);
+          pthread_mutex_unlock(&out->lock);
+          pthread_join(out->thread, NULL);
+          if (out->err) {
+               rc = 1;
+          }
+          pthread_mutex_destroy(&out->lock);
+          pthread_cond_destroy(&out->cond);
+     }
+     if (GZOUT_BGZF == out->container) {
+          /* empty block as end-of-file marker */
+          if (bgzf_write_eof(out)) {
+               rc = 1;
+          }
+     } else if (GZOUT_FBIN == out->container) {
+          if (fbin_write_index(out)) {
+               rc = 1;
+          }
+     }
+     if (Z_OK != gzclose(out->fp)) {
+          rc = 1;
+     }
+     gzout_free(out);
+     return rc;
+}
+
+
+/* same as sprintf_fastq but written to (gzipped) output. writes a
+ * BAM record or fbin row instead if requested in fmt. returns number
+ * of bytes written or negative number on error.
+ */
+int gzout_fastq(gzout_t *out, const kseq_t *seq, const trim_pos_t *trim_pos,
+                const fmt_args_t *fmt) {
+     char *dst;
+     int ret;
+     int format = fmt ? fmt->out_format : OUT_FORMAT_FASTQ;
+     int maxlen;
+
+     if (OUT_FORMAT_BAM == format) {
+          maxlen = bam_fmt_maxlen(seq, fmt);
+     } else if (OUT_FORMAT_FBIN == format) {
+          maxlen = fbin_fmt_maxlen(seq);
+     } else {
+          maxlen = fastq_fmt_maxlen(seq);
+     }
+     dst = gzout_reserve(out, maxlen);
+     if (NULL == dst) {
+          LOG_ERROR("Couldn't write to %s\n", out->fname);
+          return -1;
+     }
+     if (OUT_FORMAT_BAM == format) {
+          ret = bam_fmt(dst, seq, trim_pos, fmt);
+     } else if (OUT_FORMAT_FBIN == format) {
+          ret = fbin_fmt(dst, seq, trim_pos, fmt);
+     } else {
+          ret = fastq_fmt(dst, seq, trim_pos, fmt);
+     }
+     if (ret<0) {
+          LOG_ERROR("%s\n", "Couldn't format seq...");
+          return ret;
+     }
+     gzout_commit(out, ret);
+     return ret;
+}
+
+
+/* Input reader. FastQ is parsed by kseq. Unaligned BAM records are
+ * decoded into kseq_t buffers as well, so that everything downstream
+ * stays the same (BGZF is valid multi-member gzip, i.e. gzread
+ * decompresses it as is). So are rows of fbin blocks (see
+ * fbin_write_block()). BAM, fbin or interleaved FastQ hold both mates
+ * of a pair, which are then read from the same reader into seq[0] and
+ * seq[1].
+ */
+typedef struct {
+     int format; /* one of IN_FORMAT_* */
+     gzFile fp;
+     kseq_t *seq[2]; /* record buffers. seq[0] is the fastq parser */
+     int flag[2]; /* bam flags of records in seq */
+     int phredoffset;
+     int paired; /* both mates come from here. bam: first record is paired */
+     int last_char; /* interleaved fastq: parser state handed between seq[0] and seq[1] */
+     kstring_t rec; /* bam: raw record. fbin: compressed column */
+     int pending; /* bam: rec was peeked at but not returned yet */
+     /* fbin: decoded columns of current block and position in them */
+     kstring_t col[FBIN_NCOLS];
+     uint32_t blk_n; /* rows in block */
+     uint32_t blk_i; /* next row */
+     size_t name_pos, bases_pos, exc_pos, qual_pos;
+     uint32_t off; /* of next row in bases of block */
+     int qual_left; /* of current quality run */
+} reader_t;
+
+
+/* reads and discards BAM header. returns non-zero on error */
+int bam_read_header(gzFile fp)
+{
+     unsigned char buf[4];
+     int n_ref, i;
+
+     if (gzread(fp, buf, 4) != 4 || memcmp(buf, "BAM\1", 4)) {
+          LOG_ERROR("%s\n", "Not a BAM file");
+          return 1;
+     }
+     if (gzread(fp, buf, 4) != 4 || gzseek(fp, get_le32(buf), SEEK_CUR) < 0) {
+          return 1;
+     }
+     if (gzread(fp, buf, 4) != 4) {
+          return 1;
+     }
+     n_ref = get_le32(buf);
+     for (i=0; i<n_ref; i++) {
+          /* l_name, name, l_ref */
+          if (gzread(fp, buf, 4) != 4 || gzseek(fp, get_le32(buf) + 4, SEEK_CUR) < 0) {
+               return 1;
+          }
+     }
+     return 0;
+}
+
+
+/* reads next raw BAM record (without block_size) into rec. returns 0
+ * on success, -1 on end-of-file and -2 on error
+ */
+int bam_read_raw(gzFile fp, kstring_t *rec)
+{
+     unsigned char buf[4];
+     int n = gzread(fp, buf, 4);
+     unsigned int size;
+
+     if (0 == n) {
+          return -1;
+     } else if (n != 4) {
+          return -2;
+     }
+     size = get_le32(buf);
+     if (size < 32) {
+          return -2;
+     }
+     if (size > rec->m) {
+          char *tmp = realloc(rec->s, size);
+          if (NULL == tmp) {
+               return -2;
+          }
+          rec->s = tmp;
+          rec->m = size;
+     }
+     if (gzread(fp, rec->s, size) != (int)size) {
+          return -2;
+     }
+     rec->l = size;
+     return 0;
+}
+
+
+static int bam_raw_flag(const kstring_t *rec)
+{
+     return (unsigned char)rec->s[14] | ((unsigned char)rec->s[15] << 8);
+}
+
+
+/* decodes raw BAM record rec into seq (name, seq and qualities, no
+ * comment) and flag. returns length of seq or -2 on error
+ */
+int bam_decode(kseq_t *seq, int *flag, const kstring_t *rec, int phredoffset)
+{
+     const unsigned char *r = (const unsigned char *)rec->s;
+     static const char nt16[] = "=ACMGRSVTWYHKDBN";
+     size_t l_name, n_cigar, left;
+     unsigned int l_seq;
+     const unsigned char *p;
+     unsigned int i;
+
+     if (rec->l < 32) {
+          LOG_ERROR("%s\n", "Invalid BAM record (truncated)");
+          return -2;
+     }
+     l_name = r[8];
+     n_cigar = r[12] | (r[13] << 8);
+     l_seq = get_le32(r + 16);
+     left = rec->l - 32;
+     /* check each field against what's left of the record, so that
+      * nothing can overflow */
+     if (l_name < 1 || l_name > left || '\0' != r[32 + l_name - 1]) {
+          LOG_ERROR("%s\n", "Invalid BAM record (read name)");
+          return -2;
+     }
+     left -= l_name;
+     if (4*n_cigar > left) {
+          LOG_ERROR("%s\n", "Invalid BAM record (cigar)");
+          return -2;
+     }
+     left -= 4*n_cigar;
+     if (l_seq > INT_MAX || l_seq/2 + l_seq%2 > left || l_seq > left - (l_seq/2 + l_seq%2)) {
+          LOG_ERROR("%s\n", "Invalid BAM record (sequence length)");
+          return -2;
+     }
+     p = r + 32 + l_name + 4*n_cigar;
+
+     *flag = bam_raw_flag(rec);
+     if (ks_reserve(&seq->name, l_name) || ks_reserve(&seq->seq, l_seq+1)
+         || ks_reserve(&seq->qual, l_seq+1) || ks_reserve(&seq->comment, 1)) {
+          LOG_FATAL("%s\n", "memory allocation error");
+          return -2;
+     }
+     memcpy(seq->name.s, r + 32, l_name); /* incl. trailing 0 */
+     seq->name.l = l_name - 1;
+     seq->comment.s[0] = '\0';
+     seq->comment.l = 0;
+
+     for (i=0; i<l_seq; i++) {
+          seq->seq.s[i] = nt16[(p[i/2] >> ((~i & 1) << 2)) & 0xf];
+     }
+     seq->seq.s[l_seq] = '\0';
+     seq->seq.l = l_seq;
+     p += l_seq/2 + l_seq%2;
+     if (l_seq && 0xff == p[0]) {
+          LOG_ERROR("BAM record %s has no qualities\n", seq->name.s);
+          return -2;
+     }
+     for (i=0; i<l_seq; i++) {
+          seq->qual.s[i] = p[i] + phredoffset;
+     }
+     seq->qual.s[l_seq] = '\0';
+     seq->qual.l = l_seq;
+     return (int)l_seq;
+}
+
+
+/* reads next primary BAM record into rec. returns as bam_read_raw() */
+int bam_read_primary(reader_t *r)
+{
+     int ret;
+     if (r->pending) {
+          r->pending = 0;
+          return 0;
+     }
+     do {
+          if ((ret = bam_read_raw(r->fp, &r->rec))) {
+               return ret;
+          }
+     } while (bam_raw_flag(&r->rec) & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+     return 0;
+}
+
+
+/* reads and decodes next fbin block. returns 0 on success, -1 if
+ * there are no more blocks and -2 on error
+ */
+int fbin_read_block(reader_t *r)
+{
+     unsigned char buf[8];
+     int i;
+
+     if (gzread(r->fp, buf, 4) != 4 || 0 == memcmp(buf, "FIDX", 4)) {
+          return -1;
+     }
+     if (memcmp(buf, "FBLK", 4) || gzread(r->fp, buf, 4) != 4) {
+          LOG_ERROR("%s\n", "Invalid fbin block");
+          return -2;
+     }
+     r->blk_n = get_le32(buf);
+     for (i=0; i<FBIN_NCOLS; i++) {
+          uLongf len;
+          unsigned int zlen;
+          if (gzread(r->fp, buf, 8) != 8) {
+               return -2;
+          }
+          len = get_le32(buf);
+          zlen = get_le32(buf+4);
+          if (ks_reserve(&r->rec, zlen) || ks_reserve(&r->col[i], len+1)
+              || gzread(r->fp, r->rec.s, zlen) != (int)zlen) {
+               return -2;
+          }
+          if (Z_OK != uncompress((Bytef *)r->col[i].s, &len, (Bytef *)r->rec.s, zlen)
+              || len != get_le32(buf)) {
+               LOG_ERROR("%s\n", "Couldn't decompress fbin block");
+               return -2;
+          }
+          r->col[i].s[len] = '\0';
+          r->col[i].l = len;
+     }
+     if (r->col[FBIN_COL_MATE].l != r->blk_n || r->col[FBIN_COL_LEN].l != 4*(size_t)r->blk_n) {
+          LOG_ERROR("%s\n", "Invalid fbin block");
+          return -2;
+     }
+     r->blk_i = 0;
+     r->name_pos = r->bases_pos = r->exc_pos = r->qual_pos = 0;
+     r->off = 0;
+     r->qual_left = 0;
+     return 0;
+}
+
+
+/* decodes next fbin row into seq and flag (BAM flags, for
+ * pairing). returns length of seq, -1 on end-of-file or -2 on error
+ */
+int fbin_decode(reader_t *r, kseq_t *seq, int *flag)
+{
+     static const char acgt[] = "ACGT";
+     const kstring_t *col = r->col;
+     const unsigned char *bases;
+     uint32_t len, j;
+     const char *name, *end;
+     int mate;
+     int ret;
+
+     while (r->blk_i == r->blk_n) {
+          if ((ret = fbin_read_block(r))) {
+               return ret;
+          }
+     }
+     mate = col[FBIN_COL_MATE].s[r->blk_i];
+     *flag = mate ? (BAM_FPAIRED | (1 == mate ? BAM_FREAD1 : BAM_FREAD2)) : 0;
+     len = get_le32((const unsigned char *)col[FBIN_COL_LEN].s + 4*r->blk_i);
+     if (r->bases_pos + (len+3)/4 > col[FBIN_COL_BASES].l
+         || r->name_pos >= col[FBIN_COL_NAME].l) {
+          LOG_ERROR("%s\n", "Invalid fbin block");
+          return -2;
+     }
+
+     /* name and comment are each 0-terminated. don't trust that and
+      * look for the terminator only within the column */
+     name = col[FBIN_COL_NAME].s + r->name_pos;
+     end = memchr(name, '\0', col[FBIN_COL_NAME].l - r->name_pos);
+     if (NULL == end) {
+          LOG_ERROR("%s\n", "Invalid fbin block (unterminated read name)");
+          return -2;
+     }
+     if (ks_reserve(&seq->name, end - name + 1)) {
+          return -2;
+     }
+     memcpy(seq->name.s, name, end - name + 1);
+     seq->name.l = end - name;
+     r->name_pos += end - name + 1;
+
+     name = col[FBIN_COL_NAME].s + r->name_pos;
+     end = memchr(name, '\0', col[FBIN_COL_NAME].l - r->name_pos);
+     if (NULL == end) {
+          LOG_ERROR("%s\n", "Invalid fbin block (unterminated comment)");
+          return -2;
+     }
+     if (ks_reserve(&seq->comment, end - name + 1)) {
+          return -2;
+     }
+     memcpy(seq->comment.s, name, end - name + 1);
+     seq->comment.l = end - name;
+     r->name_pos += end - name + 1;
+
+     if (ks_reserve(&seq->seq, len+1) || ks_reserve(&seq->qual, len+1)) {
+          return -2;
+     }
+     bases = (const unsigned char *)col[FBIN_COL_BASES].s + r->bases_pos;
+     for (j=0; j<len; j++) {
+          seq->seq.s[j] = acgt[(bases[j/4] >> (2*(j%4))) & 3];
+     }
+     while (r->exc_pos + FBIN_EXC_LEN <= col[FBIN_COL_EXC].l) {
+          const unsigned char *e = (const unsigned char *)col[FBIN_COL_EXC].s + r->exc_pos;
+          uint32_t start = get_le32(e);
+          uint32_t stop = start + get_le32(e+4);
+          if (start >= r->off + len) {
+               break;
+          }
+          for (j = start > r->off ? start : r->off; j < stop && j < r->off + len; j++) {
+               seq->seq.s[j - r->off] = e[8];
+          }
+          if (stop > r->off + len) {
+               break; /* continues in next row */
+          }
+          r->exc_pos += FBIN_EXC_LEN;
+     }
+     seq->seq.s[len] = '\0';
+     seq->seq.l = len;
+
+     for (j=0; j<len; j++) {
+          if (! r->qual_left) {
+               if (r->qual_pos + 2 > col[FBIN_COL_QUAL].l) {
+                    LOG_ERROR("%s\n", "Invalid fbin block");
+                    return -2;
+               }
+               r->qual_left = (unsigned char)col[FBIN_COL_QUAL].s[r->qual_pos+1];
+               r->qual_pos += 2;
+          }
+          seq->qual.s[j] = col[FBIN_COL_QUAL].s[r->qual_pos-2];
+          r->qual_left--;
+     }
+     seq->qual.s[len] = '\0';
+     seq->qual.l = len;
+
+     r->bases_pos += (len+3)/4;
+     r->off += len;
+     r->blk_i++;
+     return len;
+}
+
+
+/* opens fname ('-' for stdin) for reading. interleaved only applies
+ * to fastq. returns non-zero on error */
+int reader_open(reader_t *r, const char *fname, int format, int interleaved, int phredoffset)
+{
+     memset(r, 0, sizeof(reader_t));
+     r->format = format;
+     r->phredoffset = phredoffset;
+     r->fp = (0 == strcmp(fname, "-")) ? gzdopen(fileno(stdin), "r") : gzopen(fname, "r");
+     if (NULL == r->fp) {
+          LOG_ERROR("Couldn't open %s\n", fname);
+          return 1;
+     }
+     if (IN_FORMAT_FASTQ == format) {
+          r->seq[0] = kseq_init(r->fp);
+          NULLCHECK(r->seq[0]);
+          if (interleaved) {
+               /* second parser on the same stream */
+               r->seq[1] = calloc(1, sizeof(kseq_t));
+               NULLCHECK(r->seq[1]);
+               r->seq[1]->f = r->seq[0]->f;
+               r->paired = 1;
+          }
+          return 0;
+     }
+
+     r->seq[0] = calloc(1, sizeof(kseq_t));
+     r->seq[1] = calloc(1, sizeof(kseq_t));
+     NULLCHECK(r->seq[0]);
+     NULLCHECK(r->seq[1]);
+     if (IN_FORMAT_FBIN == format) {
+          char magic[8];
+          if (gzread(r->fp, magic, 8) != 8 || memcmp(magic, FBIN_MAGIC, 8)) {
+               LOG_ERROR("%s is not an fbin file\n", fname);
+               return 1;
+          }
+          /* first row of first block decides whether input is paired */
+          while (r->blk_i == r->blk_n) {
+               int ret = fbin_read_block(r);
+               if (-1 == ret) {
+                    return 0;
+               } else if (ret) {
+                    return 1;
+               }
+          }
+          r->paired = r->col[FBIN_COL_MATE].s[0] ? 1 : 0;
+          return 0;
+     }
+     if (bam_read_header(r->fp)) {
+          LOG_ERROR("Couldn't read BAM header from %s\n", fname);
+          return 1;
+     }
+     /* peek at first record to find out whether input is paired */
+     if (0 == bam_read_primary(r)) {
+          r->pending = 1;
+          r->paired = (bam_raw_flag(&r->rec) & BAM_FPAIRED) ? 1 : 0;
+     }
+     return 0;
+}
+
+
+/* reads next record into r->seq[mate]. reading mate 1 (from paired
+ * BAM only) makes sure seq[0] holds the first and seq[1] the second
+ * read of the pair. returns length of seq, -1 on end-of-file or <-1
+ * on error
+ */
+int reader_read(reader_t *r, int mate)
+{
+     int ret;
+
+     if (IN_FORMAT_FASTQ == r->format) {
+          r->seq[mate]->last_char = r->last_char;
+          ret = kseq_read(r->seq[mate]);
+          r->last_char = r->seq[mate]->last_char;
+          return ret;
+     }
+     if (IN_FORMAT_FBIN == r->format) {
+          ret = fbin_decode(r, r->seq[mate], &r->flag[mate]);
+     } else {
+          if ((ret = bam_read_primary(r))) {
+               return ret;
+          }
+          ret = bam_decode(r->seq[mate], &r->flag[mate], &r->rec, r->phredoffset);
+     }
+     if (ret < 0 || 0 == mate) {
+          return ret;
+     }
+
+     /* re-pair by flag */
+     if ((r->flag[0] & BAM_FREAD2) && (r->flag[1] & BAM_FREAD1)) {
+          kseq_t tmp = *r->seq[0];
+          int f = r->flag[0];
+          *r->seq[0] = *r->seq[1]; r->flag[0] = r->flag[1];
+          *r->seq[1] = tmp; r->flag[1] = f;
+     }
+     if (! ((r->flag[0] & BAM_FREAD1) && (r->flag[1] & BAM_FREAD2))) {
+          LOG_ERROR("Couldn't pair %s and %s by flags (mates need to be grouped by name)\n",
+                    r->seq[0]->name.s, r->seq[1]->name.s);
+          return -2;
+     }
+     return r->seq[1]->seq.l;
+}
+
+
+void reader_close(reader_t *r)
+{
+     if (IN_FORMAT_FASTQ == r->format) {
+          if (r->seq[1]) {
+               r->seq[1]->f = NULL; /* shared with seq[0] */
+               kseq_destroy(r->seq[1]);
+          }
+          kseq_destroy(r->seq[0]);
+     } else {
+          int i;
+          for (i=0; i<2; i++) {
+               if (r->seq[i]) {
+                    free(r->seq[i]->name.s); free(r->seq[i]->comment.s);
+                    free(r->seq[i]->seq.s); free(r->seq[i]->qual.s);
+                    free(r->seq[i]);
+               }
+          }
+          free(r->rec.s);
+          for (i=0; i<FBIN_NCOLS; i++) {
+               free(r->col[i].s);
+          }
+     }
+     if (r->fp) {
+          gzclose(r->fp);
+     }
+     memset(r, 0, sizeof(reader_t));
+}
+
+
+/* returns 0 if not paired, 1 if reads are paired
+ */
+int reads_are_paired(const kseq_t *seq1, const kseq_t *seq2) {
+     /* Either read names end in '/[12]$' (older illumina/casava) or
+      * they contain ' [12]:[NY]:' at the right end. In the latter
+      * case seq puts the last bit into seq.comment. Simulated reads
+      * might end in '\.[12]'. Either way, compare only the first bit
+      *
+      * Examples: 
+      *
+      * @HWUSI-EAS100R:6:73:941:1973#0/1
+      * @HWUSI-EAS100R:6:73:941:1973#0/2
+      *
+      * @B2GA005:3:1:3597:949#ACAGTG/1
+      * @B2GA005:3:1:3597:949#ACAGTG/2
+      *
+      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 1:N:0:ATCACG
+      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 2:N:0:ATCACG
+      *
+      */
+     if (seq1->name.l != seq2->name.l) {
+          return 0;
+     }
+     /* if we have a comment we assume seq put the last bit into
+      * comment. otherwise we assume old illumina/casava with name
+      * which endswith '/[12]$' */
+     if (seq1->comment.l && seq2->comment.l) {
+          return ! strcmp(seq1->name.s, seq2->name.s);
+
+     } else {
+          if (seq1->name.l < 3) {
+               return 0;
+          }
+          /* ignore the '/[12]$' bit for comparison */
+          return ! strncmp(seq1->name.s, seq2->name.s, seq1->name.l-2);
+     }
+
+#if 0     
+     /* if name contained everything */
+     int cmp_len = 0;
+     int i;
+     for (i=seq1->name.l-2; i>=0; i--) {
+          char seq1_c = seq1->name.s[i];
+          char seq2_c = seq2->name.s[i];
+          if (seq1_c==' ' || seq1_c=='/' || seq1_c=='.') {
+               if (seq1_c != seq2_c) {
+                    return -1;
+               }
+               cmp_len = i+1;
+               break;
+          }
+     }
+     if (0 == cmp_len) {
+          return -1;
+     }
+     if (0 == strncmp(seq1->name.s, seq2->name.s, cmp_len)) {
+          return 1;
+     } else {
+          return 0;
+     }
+#endif
+}
+
+
+/* Derives the output key for split_by (one of SPLIT_BY_*) from
+ * the colon separated fields of an Illumina read name, either
+ * Casava 1.8+ (instrument:run:flowcell:lane:tile:x:y) or older
+ * (instrument:lane:tile:x:y), in which case the instrument stands in
+ * for the flowcell. See reads_are_paired() for examples. Writes the
+ * 0-terminated key, e.g. C0JMGACXX-1 for SPLIT_BY_LANE, to key, which
+ * has to hold SPLIT_KEY_MAXLEN bytes. Returns length of key or -1 if
+ * the name couldn't be parsed.
+ */
+int split_key_from_name(char *key, const kseq_t *seq, const int split_by)
+{
+     const char *field[7];
+     int field_len[7];
+     int nfields = 0;
+     const char *p = seq->name.s;
+     const char *end = seq->name.s + seq->name.l;
+     int flowcell_idx, keylen, i;
+
+     /* fixed-field tokenizer: no need to look beyond the 7th field */
+     while (nfields < 7) {
+          const char *colon = memchr(p, ':', end-p);
+          field[nfields] = p;
+          if (NULL == colon) {
+               field_len[nfields++] = end-p;
+               break;
+          }
+          field_len[nfields++] = colon-p;
+          p = colon+1;
+     }
+     if (7 == nfields) {
+          flowcell_idx = 2;
+     } else if (5 == nfields) {
+          flowcell_idx = 0;
+     } else {
+          return -1;
+     }
+
+     /* flowcell, lane and tile are consecutive fields. use as many
+      * as requested, separated by '-' */
+     keylen = 0;
+     for (i=0; i<split_by; i++) {
+          int idx = flowcell_idx + i;
+          if (0 == field_len[idx] || keylen + field_len[idx] + 2 > SPLIT_KEY_MAXLEN) {
+               return -1;
+          }
+          if (i) {
+               key[keylen++] = '-';
+          }
+          memcpy(&key[keylen], field[idx], field_len[idx]);
+          keylen += field_len[idx];
+     }
+     key[keylen] = '\0';
+
+     /* keep it a valid filename */
+     for (i=0; i<keylen; i++) {
+          if ('/' == key[i]) {
+               key[i] = '_';
+          }
+     }
+     return keylen;
+}
+
+
+/* Points bc to the index read (barcode) in a Casava 1.8+ comment,
+ * e.g. ATCACG in 1:N:0:ATCACG. Returns its length or -1 if there is
+ * none.
+ */
+int barcode_from_comment(const char **bc, const kseq_t *seq)
+{
+     const char *p = seq->comment.s;
+     const char *end = seq->comment.s + seq->comment.l;
+     int i;
+
+     if (! seq->comment.l) {
+          return -1;
+     }
+     for (i=0; i<3; i++) {
+          p = memchr(p, ':', end-p);
+          if (NULL == p) {
+               return -1;
+          }
+          p++;
+     }
+     (*bc) = p;
+     return end-p;
+}
+
+
+int test()
+{
+     int phredoffset = 33;
+     char *buf;
+     const int ks_bufsize = 1024;
+     trim_pos_t trim_pos;
+     kseq_t *ks;
+     int orig_read_len;
+     int i;
+     trim_args_t trim_args;
+     kstring_t trim_buf = { 0 }; /* trim_args.scratch */
+     char split_key[SPLIT_KEY_MAXLEN];
+     adapters_t adapters;
+     read_stats_t stats;
+     packed_seq_t packed;
+
+     memset(&packed, 0, sizeof(packed_seq_t));
+     ks = (kseq_t*)calloc(1, sizeof(kseq_t));
+     NULLCHECK(ks);
+
+     LOG_TEST("%s\n", "Starting interal tests");
+     init_tables();
+
+     /* setup dummy kseq with enough space for some experiments.
+      * WARNING: not sure if I used kseq_t correctly here
+      */
+     ks->name.l = ks->comment.l = ks->seq.l = ks->qual.l = 0;
+     ks->name.m =  ks->comment.m = ks->seq.m = ks->qual.m = ks_bufsize;
+     ks->name.s = (char*)realloc(ks->name.s, ks->name.m);
+     ks->comment.s = (char*)realloc(ks->comment.s, ks->comment.m);
+     ks->seq.s = (char*)realloc(ks->seq.s, ks->seq.m);
+     ks->qual.s = (char*)realloc(ks->qual.s, ks->qual.m);
+     /* now l has to be set after filling s */
+
+     strcpy(ks->name.s, "@HWI-ST740:1:C0JMGACXX:1:1101:2161:2062 2:N:0:ATCACG");
+     ks->name.l = strlen(ks->name.s);
+     strcpy(ks->seq.s,  "AAACCCGGGTTTACGTAAACCCGGGTTTACGTAAACCCGGGTTTACGTAAAC");
+     ks->seq.l = strlen(ks->seq.s);
+     strcpy(ks->qual.s, "?@AAABBBCCCDDDEEEFFFGGGH????HGGGFFFEEEDDDCCCBBBAAA@?");
+     ks->qual.l = strlen(ks->qual.s);
+     orig_read_len = strlen(ks->seq.s);
+
+     /* LOG_FIXME("ks->name.l=%d ks->seq.l=%d ks->qual.l=%d\n", ks->name.l, ks->seq.l, ks->qual.l); */
+     trim_args.algo = TRIM_ALGO_THRESHOLD;
+     trim_args.window_size = DEFAULT_WINDOW_SIZE;
+     trim_args.scratch = NULL;
+     trim_args.poly = 0;
+     trim_args.poly_min_len = DEFAULT_POLY_MIN_LEN;
+     trim_args.trim_n = 0;
+     trim_args.headcrop = trim_args.tailcrop = 0;
+     trim_args.min5pqual = 39;
+     trim_args.min3pqual = 39;
+     trim_args.minreadlen = 6;
+
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     sprintf_fastq(&buf, ks, NULL);
+     free(buf);
+     if (ks->seq.l != orig_read_len || strlen(ks->seq.s) != orig_read_len) {
+          LOG_ERROR("%s\n", "Read trimming changed read seq");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     if (ks->qual.l != ks->seq.l || strlen(ks->qual.s) != orig_read_len) {
+          LOG_ERROR("%s\n", "Read trimming changed read qual");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.minreadlen = 7;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     
+     trim_args.min5pqual = 40;
+     trim_args.min3pqual = 0;
+     trim_args.minreadlen = 1;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 40;
+     trim_args.minreadlen = 1;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 0;
+     trim_args.minreadlen = 100;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 0;
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     strcpy(ks->qual.s, "???????????????????????????????????????????????????A");
+     trim_args.min5pqual = 31;
+     trim_args.min3pqual = 2;
+     trim_args.minreadlen = 2;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     strcpy(ks->qual.s, "A????????????????????????????????????????????????????");
+     trim_args.min5pqual = 2;
+     trim_args.min3pqual = 31;
+     trim_args.minreadlen = 2;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     strcpy(ks->seq.s,  "AAAAA");
+     ks->seq.l = strlen(ks->seq.s);
+     strcpy(ks->qual.s, "+++++");
+
+
+     strcpy(ks->qual.s, "+++++"); ks->qual.l = strlen(ks->qual.s);
+     if (read_below_minbq50p(ks, 9,  phredoffset)) {
+          LOG_ERROR("%s\n", "Q10 Read should not have been below minbq50p 9");
+          kseq_destroy(ks);
+          return 1;
+     }
+     
+     strcpy(ks->qual.s, "##+++"); ks->qual.l = strlen(ks->qual.s);
      if (read_below_minbq50p(ks, 3,  phredoffset)) {
           LOG_ERROR("%s\n", "Mostly Q10 read should not have been below minbq50p 3");
           kseq_destroy(ks);
           return 1;
      }
-     
-     strcpy(ks->qual.s, "##++"); ks->qual.l = strlen(ks->qual.s);
-     if (read_below_minbq50p(ks, 3,  phredoffset)) {
-          LOG_ERROR("%s\n", "Exactly 50% Q10 read should not have been below minbq50p 3");
-          kseq_destroy(ks);
-          return 1;
+     
+     strcpy(ks->qual.s, "##++"); ks->qual.l = strlen(ks->qual.s);
+     if (read_below_minbq50p(ks, 3,  phredoffset)) {
+          LOG_ERROR("%s\n", "Exactly 50% Q10 read should not have been below minbq50p 3");
+          kseq_destroy(ks);
+          return 1;
+     }
+     
+     strcpy(ks->qual.s, "###++"); ks->qual.l = strlen(ks->qual.s);
+     if (! read_below_minbq50p(ks, 3,  phredoffset)) {
+          LOG_ERROR("%s\n", ">50% Q2 read should not have been below minbq50p 2");
+          kseq_destroy(ks);
+          return 1;
+     }
+     
+     /* read stats (across vectorized and scalar part) and N trimming */
+     strcpy(ks->seq.s,  "NNACGTACGTACGTACGTACnACGTN");
+     strcpy(ks->qual.s, "IIIIIIIIIIIIIIIIIIII#IIIII");
+     ks->seq.l = ks->qual.l = strlen(ks->seq.s);
+     read_stats(&stats, ks, NULL, 2, phredoffset);
+     if (26 != stats.len || 1 != stats.num_lowq || 4 != stats.num_n || 11 != stats.num_gc
+         || 2 != stats.minq || 40 != stats.maxq) {
+          LOG_ERROR("Got wrong read stats: len=%d lowq=%d n=%d gc=%d minq=%d maxq=%d\n",
+                    stats.len, stats.num_lowq, stats.num_n, stats.num_gc, stats.minq, stats.maxq);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.min5pqual = trim_args.min3pqual = 0;
+     trim_args.minreadlen = 1;
+     trim_args.trim_n = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos5p != 2 || trim_pos.pos3p != 24) {
+          LOG_ERROR("Got wrong N trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     strcpy(ks->seq.s,  "NNNN");
+     ks->seq.l = ks->qual.l = strlen(ks->seq.s);
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "All N read should have been discarded");
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.trim_n = 0;
+
+     strcpy(ks->seq.s,  "ACGT");
+     ks->seq.l = strlen(ks->seq.s);
+     strcpy(ks->qual.s, "5678"); /* Q = 20 21 22 23 */
+     ks->qual.l = strlen(ks->qual.s);
+     /*orig_read_len = strlen(ks->seq.s);*/
+     trim_args.min5pqual = 24;
+     trim_args.min3pqual = 0;
+     trim_args.minreadlen = -1;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 24;
+     trim_args.minreadlen = -1;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.min5pqual = 23;
+     trim_args.min3pqual = 23;
+     trim_args.minreadlen = -1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+     if (trim_pos.pos5p!=3 || trim_pos.pos3p!=3) {
+          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.min5pqual = 23;
+     trim_args.min3pqual = 0;
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+     if (trim_pos.pos5p!=3 || trim_pos.pos3p!=3) {
+          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 23;
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
+          kseq_destroy(ks);
+          return 1;
+     }
+     if (trim_pos.pos5p!=0 || trim_pos.pos3p!=3) {
+          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     /* single Q40 base in Q2 tail: stops threshold but not window trimming */
+     strcpy(ks->seq.s,  "ACGTACGTACGTACGTA");
+     strcpy(ks->qual.s, "IIIIIIIIII##I####");
+     ks->seq.l = ks->qual.l = strlen(ks->seq.s);
+     trim_args.min5pqual = 0;
+     trim_args.min3pqual = 20;
+     trim_args.minreadlen = 1;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 12) {
+          LOG_ERROR("Got wrong threshold trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.algo = TRIM_ALGO_WINDOW;
+     trim_args.window_size = 4;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 9) {
+          LOG_ERROR("Got wrong window trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.minreadlen = 11;
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     /* alternating tail: threshold trims nothing, mott cuts the tail */
+     strcpy(ks->seq.s,  "ACGTACGTACGTACGTAC");
+     strcpy(ks->qual.s, "IIIIIIIIII#5#5#5#5");
+     ks->seq.l = ks->qual.l = strlen(ks->seq.s);
+     trim_args.minreadlen = 1;
+     trim_args.algo = TRIM_ALGO_THRESHOLD;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 17) {
+          LOG_ERROR("Got wrong threshold trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.algo = TRIM_ALGO_MOTT;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 9) {
+          LOG_ERROR("Got wrong mott trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     /* all good: nothing to trim */
+     strcpy(ks->qual.s, "IIIIIIIIIIIIIIIIII");
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 17) {
+          LOG_ERROR("Got wrong mott trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     /* all bad: nothing left */
+     strcpy(ks->qual.s, "##################");
+     if (! calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     trim_args.algo = TRIM_ALGO_THRESHOLD;
+
+     /* poly-G tail with one mismatch; poly-A tail only trimmed as poly-X */
+     strcpy(ks->seq.s,  "ACTCACTCACTCACTCACTCGGGGGGGGGGGGGGGGGGGAGGGGGGGGGG");
+     memset(ks->qual.s, 'I', 50);
+     ks->seq.l = ks->qual.l = 50;
+     trim_args.poly = 'G';
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 19) {
+          LOG_ERROR("Got wrong poly-G trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     strcpy(ks->seq.s,  "ACTCACTCACTCACTCACTCAAAAAAAAAAAA");
+     ks->seq.l = ks->qual.l = 32;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 31) {
+          LOG_ERROR("Got wrong poly-G trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.poly = 'X';
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 19) {
+          LOG_ERROR("Got wrong poly-X trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     /* too short */
+     ks->seq.l = ks->qual.l = 28;
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args) || trim_pos.pos3p != 27) {
+          LOG_ERROR("Got wrong poly-X trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          kseq_destroy(ks);
+          return 1;
+     }
+     trim_args.poly = 0;
+
+     /* quality binning: vectorized and table lookup have to agree */
+     {
+          fmt_args_t fmt;
+          char qual[100];
+          int ok = 1;
+          memset(&fmt, 0, sizeof(fmt_args_t));
+          if (fmt_args_init_qual_bins(&fmt, "illumina8", phredoffset)
+              || ! fmt_args_init_qual_bins(&fmt, "10:15,5:3", phredoffset)
+              || ! fmt_args_init_qual_bins(&fmt, "10:15x", phredoffset)
+              || fmt_args_init_qual_bins(&fmt, "illumina8", phredoffset)) {
+               LOG_ERROR("%s\n", "Quality bin parsing failed");
+               kseq_destroy(ks);
+               return 1;
+          }
+          for (i=0; i<94; i++) {
+               qual[i] = phredoffset + i;
+          }
+          qual_bin(qual, 94, &fmt);
+          for (i=0; i<94; i++) {
+               if (qual[i] != fmt.qual_table[phredoffset + i]) {
+                    ok = 0;
+               }
+          }
+          if (! ok || qual[0] != phredoffset || qual[2] != phredoffset+6
+              || qual[19] != phredoffset+15 || qual[41] != phredoffset+40) {
+               LOG_ERROR("%s\n", "Got wrong quality binning");
+               kseq_destroy(ks);
+               return 1;
+          }
+          /* phred64 with bounds and values above 127 */
+          if (fmt_args_init_qual_bins(&fmt, "0:2,70:80", 64)) {
+               LOG_ERROR("%s\n", "Quality bin parsing failed");
+               kseq_destroy(ks);
+               return 1;
+          }
+          for (i=0; i<94; i++) {
+               qual[i] = (char)(64 + (i*37)%94);
+          }
+          qual_bin(qual, 94, &fmt);
+          for (i=0; i<94; i++) {
+               if ((unsigned char)qual[i] != fmt.qual_table[64 + (i*37)%94]) {
+                    ok = 0;
+               }
+          }
+          if (! ok || qual[0] != 64+2 || (unsigned char)qual[2] != 64+80) {
+               LOG_ERROR("%s\n", "Got wrong phred64 quality binning");
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* masking in output only, across vectorized and scalar part */
+     {
+          fmt_args_t fmt;
+          char *buf = malloc(fastq_fmt_maxlen(ks));
+          int ret;
+          memset(&fmt, 0, sizeof(fmt_args_t));
+          fmt.mask_below = phredoffset + 20;
+          strcpy(ks->name.s, "r");
+          ks->name.l = 1;
+          ks->comment.l = 0;
+          strcpy(ks->seq.s,  "ACGTACGTACGTACGTACGT");
+          strcpy(ks->qual.s, "5#55555555555555555+");
+          ks->seq.l = ks->qual.l = 20;
+          NULLCHECK(buf);
+          ret = fastq_fmt(buf, ks, NULL, &fmt);
+          if (ret < 0 || strncmp(buf, "@r\nANGTACGTACGTACGTACGN\n", 24)
+              || strcmp(ks->seq.s, "ACGTACGTACGTACGTACGT")) {
+               LOG_ERROR("%s\n", "Got wrong masking");
+               free(buf);
+               kseq_destroy(ks);
+               return 1;
+          }
+          free(buf);
+     }
+     /* masking threshold above 127 (phred64), vectorized and scalar */
+     {
+          char seq[21] = "ACGTACGTACGTACGTACGT";
+          char qual[21] = "hhhhhhhhhhhhhhhhhhhh"; /* Q40 */
+          mask_low_qual(seq, qual, 20, 64 + 70);
+          if (strcmp(seq, "NNNNNNNNNNNNNNNNNNNN")) {
+               LOG_ERROR("Got wrong masking with high threshold: %s\n", seq);
+               kseq_destroy(ks);
+               return 1;
+          }
+          memset(qual, 64 + 80, 20);
+          strcpy(seq, "ACGTACGTACGTACGTACGT");
+          mask_low_qual(seq, qual, 20, 64 + 70);
+          if (strcmp(seq, "ACGTACGTACGTACGTACGT")) {
+               LOG_ERROR("Got wrong masking with high qualities: %s\n", seq);
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* read name compaction */
+     {
+          fmt_args_t fmt;
+          char *buf;
+          int ret;
+          memset(&fmt, 0, sizeof(fmt_args_t));
+          strcpy(ks->name.s, "M00123:42:000000000-A1B2C:1:1101:15589:1331");
+          ks->name.l = strlen(ks->name.s);
+          strcpy(ks->comment.s, "1:N:0:1");
+          ks->comment.l = strlen(ks->comment.s);
+          strcpy(ks->seq.s,  "ACGT");
+          strcpy(ks->qual.s, "5555");
+          ks->seq.l = ks->qual.l = 4;
+          buf = malloc(fastq_fmt_maxlen(ks));
+          NULLCHECK(buf);
+          fmt.rename = RENAME_STRIP_PREFIX;
+          ret = fastq_fmt(buf, ks, NULL, &fmt);
+          if (ret < 0 || strncmp(buf, "@000000000-A1B2C:1:1101:15589:1331 1:N:0:1\n", 42)) {
+               LOG_ERROR("%s\n", "Got wrong name prefix stripping");
+               free(buf);
+               kseq_destroy(ks);
+               return 1;
+          }
+          fmt.out_format = OUT_FORMAT_FASTA;
+          fmt.mask_below = phredoffset + 10;
+          ks->qual.s[1] = '#';
+          ret = fastq_fmt(buf, ks, NULL, &fmt);
+          if (ret != 48 || strncmp(buf, ">000000000-A1B2C:1:1101:15589:1331 1:N:0:1\nANGT\n", 48)) {
+               LOG_ERROR("%s\n", "Got wrong FastA output");
+               free(buf);
+               kseq_destroy(ks);
+               return 1;
+          }
+          fmt.out_format = OUT_FORMAT_FASTQ;
+          fmt.mask_below = 0;
+          fmt.rename = RENAME_NUMBER;
+          fmt.drop_comment = 1;
+          fmt.read_no = 18446744073709551615UL;
+          ret = fastq_fmt(buf, ks, NULL, &fmt);
+          if (ret < 0 || strncmp(buf, "@18446744073709551615\nACGT\n", 26)
+              || name_prefix_len("HWUSI-EAS100R:6:73:941:1973", 27) != 14
+              || name_prefix_len("SRR001666.1", 11) != 0) {
+               LOG_ERROR("%s\n", "Got wrong read renaming");
+               free(buf);
+               kseq_destroy(ks);
+               return 1;
+          }
+          free(buf);
+     }
+
+     /* unaligned bam record */
+     {
+          fmt_args_t fmt;
+          char *buf;
+          int ret;
+          const char exp[] = {
+               47, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1, 2, 0, 0x48, 0x12,
+               0, 0, 77, 0, 5, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, -1,
+               0, 0, 0, 0, 'r', 0, 0x12, 0x48, (char)0xf0, 40, 40, 40, 40, 2,
+               'R', 'G', 'Z', 'A', 0};
+          memset(&fmt, 0, sizeof(fmt_args_t));
+          fmt.out_format = OUT_FORMAT_BAM;
+          fmt.phredoffset = 33;
+          fmt.rg_id = "A";
+          fmt.bam_flag = BAM_FLAG_READ1;
+          strcpy(ks->name.s, "r/1");
+          ks->name.l = 3;
+          strcpy(ks->comment.s, "1:N:0:1");
+          ks->comment.l = 7;
+          strcpy(ks->seq.s,  "ACGTN");
+          strcpy(ks->qual.s, "IIII#");
+          ks->seq.l = ks->qual.l = 5;
+          buf = malloc(bam_fmt_maxlen(ks, &fmt));
+          NULLCHECK(buf);
+          ret = bam_fmt(buf, ks, NULL, &fmt);
+          if (ret != sizeof(exp) || memcmp(buf, exp, sizeof(exp))) {
+               LOG_ERROR("%s\n", "Got wrong BAM record");
+               free(buf);
+               kseq_destroy(ks);
+               return 1;
+          }
+          free(buf);
+
+          /* decoding it back (without block_size), then with corrupt
+           * read name and sequence length */
+          {
+               char rec_buf[sizeof(exp)];
+               kstring_t rec = { sizeof(exp) - 4, sizeof(exp), rec_buf };
+               int flag;
+               memcpy(rec_buf, exp + 4, sizeof(exp) - 4);
+               if (bam_decode(ks, &flag, &rec, 33) != 5 || strcmp(ks->name.s, "r")
+                   || strcmp(ks->seq.s, "ACGTN") || strcmp(ks->qual.s, "IIII#")
+                   || BAM_FLAG_READ1 != flag) {
+                    LOG_ERROR("%s\n", "Couldn't decode BAM record");
+                    kseq_destroy(ks);
+                    return 1;
+               }
+               rec_buf[33] = 'x'; /* no trailing 0 */
+               if (-2 != bam_decode(ks, &flag, &rec, 33)) {
+                    LOG_ERROR("%s\n", "Decoded BAM record with unterminated name");
+                    kseq_destroy(ks);
+                    return 1;
+               }
+               rec_buf[33] = 0;
+               put_le32(rec_buf + 16, 0xffffffff);
+               if (-2 != bam_decode(ks, &flag, &rec, 33)) {
+                    LOG_ERROR("%s\n", "Decoded BAM record with overlong sequence");
+                    kseq_destroy(ks);
+                    return 1;
+               }
+          }
+     }
+
+     /* packed bases (across vectorized and scalar part) agree with nt4_table */
+     strcpy(ks->seq.s, "ACGTacgtNRYnACGTTGCA.-GGCCAATTagctAGCTN");
+     ks->seq.l = strlen(ks->seq.s);
+     if (pack_seq(&packed, ks->seq.s, ks->seq.l) || packed.len != (int)ks->seq.l) {
+          LOG_ERROR("%s\n", "Couldn't pack bases");
+          packed_seq_free(&packed);
+          kseq_destroy(ks);
+          return 1;
+     }
+     for (i=0; i<(int)ks->seq.l; i++) {
+          unsigned char c = nt4_table[(unsigned char)ks->seq.s[i]];
+          if ((int)packed_is_n(&packed, i) != (c > 3)
+              || (c <= 3 && packed_base(&packed, i) != c)) {
+               LOG_ERROR("Packed base %d doesn't match %c\n", i, ks->seq.s[i]);
+               packed_seq_free(&packed);
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* empty reads have a valid quality range, reads without qualities not */
+     ks->seq.l = ks->qual.l = 0;
+     read_stats(&stats, ks, NULL, 0, phredoffset);
+     if (! qual_range_is_valid(&stats, ks)) {
+          LOG_ERROR("%s\n", "Empty read has invalid quality range");
+          kseq_destroy(ks);
+          return 1;
+     }
+     ks->seq.l = 4;
+     if (qual_range_is_valid(&stats, ks)) {
+          LOG_ERROR("%s\n", "Read without qualities has valid quality range");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     /* reverse complement (across vectorized and scalar part, in and
+      * out of place) agrees with comp_table */
+     for (i=0; i<=70; i++) {
+          const char *alphabet = "ACGTacgtNnRY.";
+          char fwd[71], rc[71], rc2[71], qual[71];
+          int j;
+          for (j=0; j<i; j++) {
+               fwd[j] = alphabet[rand()%13];
+               qual[j] = 33 + j;
+          }
+          revcomp(rc, fwd, i);
+          memcpy(rc2, fwd, i);
+          revcomp_inplace(rc2, qual, i);
+          for (j=0; j<i; j++) {
+               if (rc[j] != comp_table[(unsigned char)fwd[i-1-j]] || rc2[j] != rc[j]
+                   || qual[j] != 33 + i-1-j) {
+                    LOG_ERROR("Wrong reverse complement of length %d at %d\n", i, j);
+                    kseq_destroy(ks);
+                    return 1;
+               }
+          }
+     }
+
+     /* duplicate set: no false negatives as set and as Bloom filter.
+      * mates are hashed with their boundary */
+     {
+          dedup_t dedup;
+          uint64_t h[2], h2[2];
+          int limit, seen, n;
+          for (limit=0; limit<2; limit++) {
+               memset(&dedup, 0, sizeof(dedup_t));
+               /* set grows twice, or starts as Bloom filter (of 2^19
+                * bits, i.e. well below full) */
+               dedup.max_bytes = limit ? 65536 : 0;
+               n = limit ? DEDUP_INIT_SLOTS/4 : 4*DEDUP_INIT_SLOTS;
+               seen = 0;
+               for (i=0; i<n; i++) {
+                    h[0] = h[1] = 0;
+                    dedup_hash(h, (const char *)&i, sizeof(int));
+                    seen += dedup_seen(&dedup, h);
+               }
+               /* Bloom filter is allowed false positives */
+               if (seen > (limit ? n*DEDUP_BLOOM_FPR : 0)) {
+                    LOG_ERROR("Duplicate set (limit %zu) reports %d unseen fingerprints\n",
+                              dedup.max_bytes, seen);
+                    dedup_free(&dedup);
+                    kseq_destroy(ks);
+                    return 1;
+               }
+               for (i=0; i<n; i+=97) {
+                    h[0] = h[1] = 0;
+                    dedup_hash(h, (const char *)&i, sizeof(int));
+                    if (1 != dedup_seen(&dedup, h)) {
+                         LOG_ERROR("Duplicate set (limit %zu) misses fingerprint %d\n", dedup.max_bytes, i);
+                         dedup_free(&dedup);
+                         kseq_destroy(ks);
+                         return 1;
+                    }
+               }
+               if (! limit) {
+                    dedup_free(&dedup);
+               }
+          }
+          /* overfilled Bloom filter stops reporting duplicates */
+          for (i=DEDUP_INIT_SLOTS/4; i<4*DEDUP_INIT_SLOTS && ! dedup.full; i++) {
+               h[0] = h[1] = 0;
+               dedup_hash(h, (const char *)&i, sizeof(int));
+               dedup_seen(&dedup, h);
+          }
+          h[0] = h[1] = 0;
+          i = 0;
+          dedup_hash(h, (const char *)&i, sizeof(int));
+          if (! dedup.full || 0 != dedup_seen(&dedup, h)) {
+               LOG_ERROR("%s\n", "Overfilled Bloom filter still reports duplicates");
+               dedup_free(&dedup);
+               kseq_destroy(ks);
+               return 1;
+          }
+          dedup_free(&dedup);
+          /* set takes at most half the limit (so that old and new fit
+           * while growing) and the Bloom filter what's left next to it */
+          memset(&dedup, 0, sizeof(dedup_t));
+          dedup.max_bytes = 5*DEDUP_INIT_SLOTS*2*sizeof(uint64_t);
+          for (i=0, n=0; NULL == dedup.bloom; i++) {
+               n = (int)dedup.n_slots;
+               h[0] = h[1] = 0;
+               dedup_hash(h, (const char *)&i, sizeof(int));
+               dedup_seen(&dedup, h);
+          }
+          if (n != 2*DEDUP_INIT_SLOTS
+              || n*2*sizeof(uint64_t) + (dedup.bloom_mask+1)/8 > dedup.max_bytes) {
+               LOG_ERROR("Duplicate set exceeds memory limit (%d slots, %zu bytes Bloom filter)\n",
+                         n, (size_t)(dedup.bloom_mask+1)/8);
+               dedup_free(&dedup);
+               kseq_destroy(ks);
+               return 1;
+          }
+          dedup_free(&dedup);
+          h[0] = h[1] = h2[0] = h2[1] = 0;
+          dedup_hash(h, "ACGTACGTAC", 10); dedup_hash(h, "GT", 2);
+          dedup_hash(h2, "ACGTACGTA", 9); dedup_hash(h2, "CGT", 3);
+          if (h[0] == h2[0] && h[1] == h2[1]) {
+               LOG_ERROR("%s\n", "Pair fingerprints ignore mate boundary");
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* DUST: homopolymer scores half its length, random sequence low */
+     memset(ks->seq.s, 'A', 50);
+     if (pack_seq(&packed, ks->seq.s, 50) || fabs(dust_score(&packed) - 24.0) > 1e-9
+         || pack_seq(&packed, "ACGTTGCAAGCTTCGACATGGTACCAGTTAGCAT", 34) || dust_score(&packed) > 1.0
+         || pack_seq(&packed, "AANAANAA", 8) || dust_score(&packed) != 0.0) {
+          LOG_ERROR("%s\n", "Got wrong DUST score");
+          packed_seq_free(&packed);
+          kseq_destroy(ks);
+          return 1;
+     }
+     packed_seq_free(&packed);
+
+     /* expected errors */
+     memset(ks->qual.s, '+', 30); /* Q10 */
+     ks->qual.s[30] = '\0';
+     if (fabs(expected_errors(ks->qual.s, 30, phredoffset, -1.0) - 3.0) > 1e-9
+         || expected_errors(ks->qual.s, 30, phredoffset, 1.0) > 2.0
+         || 5 != trunc_ee_len(ks->qual.s, 30, phredoffset, 0.55)
+         || 30 != trunc_ee_len(ks->qual.s, 30, phredoffset, 3.5)) {
+          LOG_ERROR("%s\n", "Got wrong expected errors");
+          kseq_destroy(ks);
+          return 1;
+     }
+
+     /* skipping quality trimming based on read stats mustn't change
+      * the result */
+     srand(42);
+     for (i=0; i<1000; i++) {
+          trim_pos_t trim_pos_nostats;
+          int len = rand()%100+1;
+          int discard;
+          int j;
+          for (j=0; j<len; j++) {
+               ks->seq.s[j] = "ACGT"[rand()%4];
+               ks->qual.s[j] = phredoffset + (rand()%5 ? 20+rand()%21 : rand()%25);
+          }
+          ks->seq.l = ks->qual.l = len;
+          trim_args.algo = i%3; /* TRIM_ALGO_* */
+          trim_args.min5pqual = rand()%25;
+          trim_args.min3pqual = rand()%25;
+          trim_args.minreadlen = 1;
+          read_stats(&stats, ks, NULL, 0, phredoffset);
+          discard = calc_trim_pos(&trim_pos_nostats, ks, NULL, phredoffset, &trim_args);
+          if (discard != calc_trim_pos(&trim_pos, ks, &stats, phredoffset, &trim_args)
+              || (! discard && (trim_pos.pos5p != trim_pos_nostats.pos5p
+                                || trim_pos.pos3p != trim_pos_nostats.pos3p))) {
+               LOG_ERROR("Trimming with and without read stats differs for algo %d\n", trim_args.algo);
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+     trim_args.algo = TRIM_ALGO_THRESHOLD;
+     trim_args.min5pqual = trim_args.min3pqual = 0;
+
+     /* vectorized and scalar window trimming have to agree */
+     srand(42);
+     trim_args.scratch = &trim_buf;
+     for (i=0; i<1000; i++) {
+          int len = rand()%200+1;
+          int w = rand()%10+1;
+          int j;
+          for (j=0; j<len; j++) {
+               ks->qual.s[j] = phredoffset + (rand()%5 ? 30+rand()%11 : rand()%15);
+          }
+          if (window_trim_start(ks->qual.s, len, phredoffset, w, 20, &trim_buf)
+              != window_trim_start_scalar(ks->qual.s, len, phredoffset, w, 20)) {
+               LOG_ERROR("Vectorized and scalar window trimming differ for len=%d w=%d\n", len, w);
+               free(trim_buf.s);
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* adapters: full, with mismatch, partial at 3'-end and none */
+     if (adapters_init(&adapters, "truseq", 0.1, 3)) {
+          LOG_ERROR("%s\n", "Couldn't initialize adapters");
+          kseq_destroy(ks);
+          return 1;
+     }
+     {
+          const char *adapter_tests[][2] = {
+               /* read, expected adapter start */
+               {"ACGTTTGACCAGTAGATCGGAAGAGCACACGTCTGAACTCCAGTCAATCTCG", "13"},
+               {"ACGTTTGACCAGTAGATCGGAAGAGCACACGTCTGTACTCCAGTCAATCTCG", "13"},
+               {"ACGTTTGACCAGTAGATCGGAAGAGCG", "13"},
+               {"ACGTTTGACCAGTAGATCGGAAGAGCGTCGTG", "13"},
+               {"ACGTTTGACCAGTACCCACGTTAGATCG", "22"},
+               {"ACGTTTGACCAGTACCCACGTTAGTTAGA", "26"},
+               {"ACGTTTGACCAGTACCCACGTTAGTTTAG", "-1"}, /* too short */
+               {"ACGTTTGACCAGTACCCACGTTAGTTTAA", "-1"},
+               {NULL, NULL}
+          };
+          for (i=0; adapter_tests[i][0]; i++) {
+               int expected = atoi(adapter_tests[i][1]);
+               strcpy(ks->seq.s, adapter_tests[i][0]);
+               ks->seq.l = strlen(ks->seq.s);
+               if (-1 == expected) {
+                    expected = ks->seq.l;
+               }
+               if (adapter_start(&adapters, ks) != expected) {
+                    LOG_ERROR("Expected adapter at %d but got %d in %s\n",
+                              expected, adapter_start(&adapters, ks), ks->seq.s);
+                    adapters_free(&adapters);
+                    kseq_destroy(ks);
+                    return 1;
+               }
+          }
+     }
+     adapters_free(&adapters);
+
+     /* overlap: 40bp insert, both mates reading 10bp into adapters */
+     {
+          const char *insert = "GATTACAGGCTTACCGATCGTTAGCCATGCAAGTCCTGAA";
+          const char *r1 = "GATTACAGGCTTACCGATCGTTAGCCATGCAAGTCCTGAAAGATCGGAAG";
+          char r2[51], rc2[51];
+          int shift = 0;
+          revcomp(r2, insert, 40);
+          strcpy(&r2[40], "AGATCGGAAG");
+          revcomp(rc2, r2, 50);
+          rc2[50] = '\0';
+          if (! find_overlap(&shift, r1, 50, rc2, 50, 30-50, 0, 30) || shift != -10) {
+               LOG_ERROR("Expected overlap shift -10 but got %d\n", shift);
+               kseq_destroy(ks);
+               return 1;
+          }
+          /* mismatch in insert is tolerated */
+          rc2[15] = comp_table[(unsigned char)rc2[15]];
+          if (! find_overlap(&shift, r1, 50, rc2, 50, 30-50, 0, 30) || shift != -10) {
+               LOG_ERROR("Expected overlap shift -10 with mismatch but got %d\n", shift);
+               kseq_destroy(ks);
+               return 1;
+          }
+          if (find_overlap(&shift, r1, 50, r2, 50, 30-50, 0, 30)) {
+               LOG_ERROR("Found unexpected overlap with shift %d\n", shift);
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     /* merging: 70bp insert from 50bp mates. seq1 has an error in
+      * the overlap, which seq2 calls with higher quality */
+     {
+          char frag[] = "GATTACAGGCTTACCGATCGTTAGCCATGCAAGTCCTGAATTGCACCGTAGGCATCAGGTACCATGACTT";
+          char s1[51], s2[51], q1[51], q2[51];
+          kseq_t m1, m2, merged;
+          trim_pos_t tp1 = {0, 49}, tp2 = {0, 49};
+          kstring_t rc_buf = { 0 };
+          int ok;
+
+          memset(&m1, 0, sizeof(kseq_t));
+          memset(&m2, 0, sizeof(kseq_t));
+          memset(&merged, 0, sizeof(kseq_t));
+          memcpy(s1, frag, 50); s1[50] = '\0';
+          s1[45] = 'G' == s1[45] ? 'C' : 'G';
+          revcomp(s2, &frag[20], 50); s2[50] = '\0';
+          memset(q1, 'I', 50); q1[50] = '\0';
+          memset(q2, 'I', 50); q2[50] = '\0';
+          q1[45] = '#';
+          m1.seq.s = s1; m1.qual.s = q1; m1.seq.l = m1.qual.l = 50;
+          m2.seq.s = s2; m2.qual.s = q2; m2.seq.l = m2.qual.l = 50;
+          m1.name = ks->name;
+
+          ok = merge_pair(&merged, &m1, &tp1, &m2, &tp2, &rc_buf, 20)
+               && 70 == merged.seq.l && 0 == strcmp(merged.seq.s, frag)
+               && 'I' == merged.qual.s[45];
+          tp2.pos3p = 9; /* overlap too short */
+          ok = ok && ! merge_pair(&merged, &m1, &tp1, &m2, &tp2, &rc_buf, 20);
+          free(merged.seq.s);
+          free(merged.qual.s);
+          free(rc_buf.s);
+          if (! ok) {
+               LOG_ERROR("%s\n", "Merging of overlapping pair failed");
+               kseq_destroy(ks);
+               return 1;
+          }
+     }
+
+     strcpy(ks->name.s, "HWI-ST740:1:C0JMGACXX:1:1101:1452:2203");
+     ks->name.l = strlen(ks->name.s);
+     if (split_key_from_name(split_key, ks, SPLIT_BY_TILE) < 0 || strcmp(split_key, "C0JMGACXX-1-1101")) {
+          LOG_ERROR("%s\n", "Got wrong split key for tile");
+          kseq_destroy(ks);
+          return 1;
+     }
+     strcpy(ks->name.s, "HWUSI-EAS100R:6:73:941:1973#0/1");
+     ks->name.l = strlen(ks->name.s);
+     if (split_key_from_name(split_key, ks, SPLIT_BY_LANE) < 0 || strcmp(split_key, "HWUSI-EAS100R-6")) {
+          LOG_ERROR("%s\n", "Got wrong split key for lane");
+          kseq_destroy(ks);
+          return 1;
+     }
+     strcpy(ks->name.s, "SRR499813.1");
+     ks->name.l = strlen(ks->name.s);
+     if (split_key_from_name(split_key, ks, SPLIT_BY_FLOWCELL) >= 0) {
+          LOG_ERROR("%s\n", "Got split key for non-Illumina read name");
+          kseq_destroy(ks);
+          return 1;
+     }
+ 
+
+#if 0
+      *
+      * @HWUSI-EAS100R:6:73:941:1973#0/1
+      *
+      * @B2GA005:3:1:3597:949#ACAGTG/1
+      * @B2GA005:3:1:3597:949#ACAGTG/2
+      *
+      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 1:N:0:ATCACG
+      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 2:N:0:ATCACG
+      *
+#endif
+#if 0
+     sprintf_fastq(&buf, ks, &trim_pos);
+     LOG_FIXME("%s\n", buf);
+     free(buf);
+#endif
+
+#if 0 
+     sprintf_fastq(&buf, ks, NULL);
+     fprintf(stderr, "--- seq before trimming:\n%s", buf);
+     free(buf);
+
+     for (i=0; i<ks->qual.l; i++) {
+          int q = ks->qual.s[i] - phredoffset;
+          fprintf(stderr, "%02d:%c:%d ", i, ks->seq.s[i], q);
+          if ((i+1)%9==0) {
+               fprintf(stderr, "\n");
+          }
+     }
+     fprintf(stderr, "\n");
+
+     LOG_WARN("Getting trim pos for read (len=%d) with min5pqual=%d min3pqual=%d minreadlen=%d\n",
+              ks->seq.l, trim_args.min5pqual, trim_args.min3pqual, trim_args.minreadlen);
+     if (calc_trim_pos(&trim_pos, ks, NULL, phredoffset, &trim_args)) {
+          LOG_WARN("%s\n", "Read is to be discarded");
+     } else {
+          fprintf(stderr, "Got trim pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
+          sprintf_fastq(&buf, ks, &trim_pos);
+          fprintf(stderr, "--- trimmed seq:\n%s", buf);          
+          free(buf);
+     }
+
+     sprintf_fastq(&buf, ks, NULL);
+     fprintf(stderr, "--- seq restored after trimming:\n%s", buf);
+     free(buf);
+#endif
+
+     free(trim_buf.s);
+     kseq_destroy(ks);
+     LOG_TEST("%s\n", "Successfully completed");
+     return EXIT_SUCCESS;
+}
+
+
+/* computes all per-read statistics in a single pass over seq and
+ * qual, 16 bases at a time. lowq is the BQ threshold for num_lowq.
+ */
+void read_stats(read_stats_t *stats, const kseq_t *seq, const packed_seq_t *packed,
+                const int lowq, const int phredoffset)
+{
+     int len = seq->seq.l < seq->qual.l ? seq->seq.l : seq->qual.l;
+     int thr = phredoffset + lowq > 126 ? 126 : phredoffset + lowq;
+     unsigned char minc = 255, maxc = 0;
+     int i = 0;
+
+     stats->len = len;
+     stats->num_lowq = stats->num_n = stats->num_gc = 0;
+     stats->packed = packed;
+#ifdef __SSE2__
+     {
+          const __m128i vthr = _mm_set1_epi8((char)thr);
+          const __m128i vN = _mm_set1_epi8('N'), vn = _mm_set1_epi8('n');
+          const __m128i vG = _mm_set1_epi8('G'), vg = _mm_set1_epi8('g');
+          const __m128i vC = _mm_set1_epi8('C'), vc = _mm_set1_epi8('c');
+          __m128i vmin = _mm_set1_epi8((char)255), vmax = _mm_setzero_si128();
+          unsigned char tmp[16];
+          int k;
+          for (; i+16 <= len; i+=16) {
+               __m128i q = _mm_loadu_si128((const __m128i *)&seq->qual.s[i]);
+               __m128i b = _mm_loadu_si128((const __m128i *)&seq->seq.s[i]);
+               /* q > thr is good. chars above 127 compare negative, i.e. low */
+               unsigned int good = _mm_movemask_epi8(_mm_cmpgt_epi8(q, vthr));
+               unsigned int n = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, vN),
+                                                               _mm_cmpeq_epi8(b, vn)));
+               unsigned int gc = _mm_movemask_epi8(
+                    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, vG), _mm_cmpeq_epi8(b, vg)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(b, vC), _mm_cmpeq_epi8(b, vc))));
+               stats->num_lowq += 16 - __builtin_popcount(good);
+               stats->num_n += __builtin_popcount(n);
+               stats->num_gc += __builtin_popcount(gc);
+               vmin = _mm_min_epu8(vmin, q);
+               vmax = _mm_max_epu8(vmax, q);
+          }
+          _mm_storeu_si128((__m128i *)tmp, vmin);
+          for (k=0; k<16; k++) {
+               minc = tmp[k] < minc ? tmp[k] : minc;
+          }
+          _mm_storeu_si128((__m128i *)tmp, vmax);
+          for (k=0; k<16; k++) {
+               maxc = tmp[k] > maxc ? tmp[k] : maxc;
+          }
+     }
+#endif
+     for (; i<len; i++) {
+          unsigned char c = seq->qual.s[i];
+          char b = seq->seq.s[i];
+          stats->num_lowq += (signed char)c <= thr;
+          stats->num_n += is_n(b);
+          stats->num_gc += ('G' == b || 'g' == b || 'C' == b || 'c' == b);
+          minc = c < minc ? c : minc;
+          maxc = c > maxc ? c : maxc;
+     }
+     if (len) {
+          stats->minq = (int)minc - phredoffset;
+          stats->maxq = (int)maxc - phredoffset;
+     } else {
+          stats->minq = stats->maxq = 0;
+     }
+}
+
+
+/* DUST low-complexity score of packed bases: sum of c_t*(c_t-1)/2
+ * over the counts c_t of all 64 trinucleotides, divided by the number
+ * of trinucleotides minus one. trinucleotides are kept in a rolling
+ * 6-bit code. N's break trinucleotides.
+ */
+double dust_score(const packed_seq_t *packed)
+{
+     unsigned int counts[64];
+     unsigned int code = 0;
+     int valid = 0; /* bases since last N */
+     int num_tri = 0;
+     long sum = 0;
+     int i;
+
+     memset(counts, 0, sizeof(counts));
+     for (i=0; i<packed->len; i++) {
+          if (packed_is_n(packed, i)) {
+               valid = 0;
+               continue;
+          }
+          code = ((code << 2) | packed_base(packed, i)) & 63;
+          if (++valid >= 3) {
+               /* adding one to c_t adds c_t pairs */
+               sum += counts[code]++;
+               num_tri++;
+          }
+     }
+     return num_tri > 1 ? (double)sum / (num_tri - 1) : 0.0;
+}
+
+
+/* return 1 if >50% bases <=minbq50p
+ */
+int read_below_minbq50p(const kseq_t *seq, const int minbq50p, const int phredoffset)
+{
+     read_stats_t stats;
+     read_stats(&stats, seq, NULL, minbq50p, phredoffset);
+     return stats.num_lowq > seq->qual.l/2;
+}
+
+
+/* read filters applied before trimming. they only look at the
+ * read's statistics and return 1 if the read is to be discarded. new
+ * filters go into read_filters below.
+ */
+typedef int (*read_filter_fn_t)(const read_stats_t *stats, const kseq_t *seq, const args_t *args);
+
+int filter_minbq50p(const read_stats_t *stats, const kseq_t *seq, const args_t *args)
+{
+     return stats->num_lowq > seq->qual.l/2;
+}
+
+int filter_max_n(const read_stats_t *stats, const kseq_t *seq, const args_t *args)
+{
+     return args->max_n >= 0 && stats->num_n > args->max_n;
+}
+
+int filter_max_n_frac(const read_stats_t *stats, const kseq_t *seq, const args_t *args)
+{
+     return stats->num_n > args->max_n_frac * seq->seq.l;
+}
+
+int filter_dust(const read_stats_t *stats, const kseq_t *seq, const args_t *args)
+{
+     if (args->max_dust < 0.0) {
+          return 0;
+     }
+     assert(stats->packed); /* main() packs reads if max_dust is set */
+     return dust_score(stats->packed) > args->max_dust;
+}
+
+const struct {
+     const char *name;
+     read_filter_fn_t fn;
+} read_filters[] = {
+     {"minbq50p", filter_minbq50p},
+     {"max-n", filter_max_n},
+     {"max-n-frac", filter_max_n_frac},
+     {"max-dust", filter_dust},
+     {NULL, NULL}
+};
+
+
+/* applies all read_filters. returns 1 if read is to be discarded.
+ */
+int read_filtered(const read_stats_t *stats, const kseq_t *seq, const args_t *args)
+{
+     int i;
+     for (i=0; read_filters[i].fn; i++) {
+          if (read_filters[i].fn(stats, seq, args)) {
+               if (trace) {LOG_DEBUG("%s discarded by %s filter\n", seq->name.s, read_filters[i].name);}
+               return 1;
+          }
+     }
+     return 0;
+}
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+     return (x << r) | (x >> (64 - r));
+}
+
+
+/* MurmurHash3 finalizer */
+static inline uint64_t fmix64(uint64_t h)
+{
+     h ^= h >> 33;
+     h *= 0xff51afd7ed558ccdULL;
+     h ^= h >> 33;
+     h *= 0xc4ceb9fe1a85ec53ULL;
+     h ^= h >> 33;
+     return h;
+}
+
+
+/* folds len bytes of s into 128-bit fingerprint h. start with h all
+ * zero and call once per mate to fingerprint pairs */
+void dedup_hash(uint64_t h[2], const char *s, const int len)
+{
+     uint64_t a = h[0] ^ ((uint64_t)len * 0x9e3779b97f4a7c15ULL);
+     uint64_t b = h[1] ^ (uint64_t)len;
+     uint64_t w;
+     int i = 0;
+
+     for (; i+8 <= len; i+=8) {
+          memcpy(&w, &s[i], 8);
+          a = rotl64((a ^ w) * 0x87c37b91114253d5ULL, 31);
+          b = rotl64((b ^ w) * 0x4cf5ad432745937fULL, 33);
+     }
+     if (i < len) {
+          w = 0;
+          memcpy(&w, &s[i], len-i);
+          a = rotl64((a ^ w) * 0x87c37b91114253d5ULL, 31);
+          b = rotl64((b ^ w) * 0x4cf5ad432745937fULL, 33);
+     }
+     h[0] = fmix64(a + b);
+     h[1] = fmix64(b ^ h[0]);
+}
+
+
+/* sets fingerprint's bits in Bloom filter. returns 1 if all were set
+ * already */
+static int dedup_bloom_add(dedup_t *d, uint64_t h1, uint64_t h2)
+{
+     int seen = 1;
+     int i;
+     for (i=0; i<d->bloom_k; i++) {
+          uint64_t bit = (h1 + i*h2) & d->bloom_mask;
+          uint64_t m = (uint64_t)1 << (bit & 63);
+          if (! (d->bloom[bit >> 6] & m)) {
+               seen = 0;
+               d->bloom[bit >> 6] |= m;
+               d->bloom_set++;
+          }
+     }
+     return seen;
+}
+
+
+/* inserts fingerprint into fp with n_slots slots unless present.
+ * returns 1 if present */
+static int dedup_slot_add(uint64_t *fp, size_t n_slots, uint64_t h1, uint64_t h2)
+{
+     size_t i = h1 & (n_slots-1);
+     while (fp[2*i] || fp[2*i+1]) {
+          if (fp[2*i] == h1 && fp[2*i+1] == h2) {
+               return 1;
+          }
+          i = (i+1) & (n_slots-1);
      }
-     
-     strcpy(ks->qual.s, "###++"); ks->qual.l = strlen(ks->qual.s);
-     if (! read_below_minbq50p(ks, 3,  phredoffset)) {
-          LOG_ERROR("%s\n", ">50% Q2 read should not have been below minbq50p 2");
-          kseq_destroy(ks);
-          return 1;
+     fp[2*i] = h1;
+     fp[2*i+1] = h2;
+     return 0;
+}
+
+
+/* moves all fingerprints into a Bloom filter, using what's left of
+ * max_bytes next to the fingerprint array, since both are allocated
+ * while moving. the number of bits set per fingerprint is optimal for
+ * DEDUP_BLOOM_FPR. with k bits per fingerprint and a fraction f of
+ * all bits set, the false duplicate rate is f^k. returns non-zero on
+ * error */
+static int dedup_to_bloom(dedup_t *d)
+{
+     uint64_t avail = d->max_bytes - d->n_slots*2*sizeof(uint64_t);
+     uint64_t nbits = 64;
+     size_t i;
+
+     while (nbits*2 <= avail*8) {
+          nbits *= 2;
      }
-     
-     strcpy(ks->seq.s,  "ACGT");
-     ks->seq.l = strlen(ks->seq.s);
-     strcpy(ks->qual.s, "5678"); /* Q = 20 21 22 23 */
-     ks->qual.l = strlen(ks->qual.s);
-     /*orig_read_len = strlen(ks->seq.s);*/
-     trim_args.min5pqual = 24;
-     trim_args.min3pqual = 0;
-     trim_args.minreadlen = -1;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
+     d->bloom = calloc(nbits/64, sizeof(uint64_t));
+     if (NULL == d->bloom) {
           return 1;
      }
-     trim_args.min5pqual = 0;
-     trim_args.min3pqual = 24;
-     trim_args.minreadlen = -1;
-     if (! calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("Read should have been discarded but is not. Got trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
+     d->bloom_mask = nbits-1;
+     d->bloom_k = (int)ceil(-log2(DEDUP_BLOOM_FPR));
+     d->bloom_set = 0;
+     d->bloom_max_set = (uint64_t)(nbits * pow(DEDUP_BLOOM_MAX_FPR, 1.0/d->bloom_k));
+     for (i=0; i<d->n_slots; i++) {
+          if (d->fp[2*i] || d->fp[2*i+1]) {
+               dedup_bloom_add(d, d->fp[2*i], d->fp[2*i+1]);
+          }
      }
-     trim_args.min5pqual = 23;
-     trim_args.min3pqual = 23;
-     trim_args.minreadlen = -1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
-          return 1;
+     free(d->fp);
+     d->fp = NULL;
+     d->n_slots = 0;
+     return 0;
+}
+
+
+/* returns 1 if fingerprint h was seen before, otherwise remembers it
+ * and returns 0. returns -1 on error */
+int dedup_seen(dedup_t *d, const uint64_t h[2])
+{
+     uint64_t h1 = h[0];
+     uint64_t h2 = (h[0] || h[1]) ? h[1] : 1; /* 0/0 marks empty slots */
+     int seen;
+
+     if (d->full) {
+          return 0;
      }
-     if (trim_pos.pos5p!=3 || trim_pos.pos3p!=3) {
-          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
-          return 1;
+     if (NULL == d->bloom && (d->n+1)*2 > d->n_slots) {
+          size_t n_slots = d->n_slots ? 2*d->n_slots : DEDUP_INIT_SLOTS;
+          uint64_t *fp;
+          size_t i;
+
+          if (d->max_bytes && n_slots*2*sizeof(uint64_t) > d->max_bytes/2) {
+               if (d->n_slots) {
+                    LOG_WARN("Duplicate set reached memory limit after %zu reads."
+                             " Switching to Bloom filter\n", d->n);
+               }
+               if (dedup_to_bloom(d)) {
+                    return -1;
+               }
+          } else {
+               fp = calloc(n_slots, 2*sizeof(uint64_t));
+               if (NULL == fp) {
+                    return -1;
+               }
+               for (i=0; i<d->n_slots; i++) {
+                    if (d->fp[2*i] || d->fp[2*i+1]) {
+                         dedup_slot_add(fp, n_slots, d->fp[2*i], d->fp[2*i+1]);
+                    }
+               }
+               free(d->fp);
+               d->fp = fp;
+               d->n_slots = n_slots;
+          }
      }
-     trim_args.min5pqual = 23;
-     trim_args.min3pqual = 0;
-     trim_args.minreadlen = 1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
+     if (d->bloom) {
+          seen = dedup_bloom_add(d, h1, h2);
+          if (d->bloom_set > d->bloom_max_set) {
+               LOG_WARN("Bloom filter for duplicate removal is full after %zu reads"
+                        " (estimated false duplicate rate above %g)."
+                        " Not removing any more duplicates\n", d->n+1, DEDUP_BLOOM_MAX_FPR);
+               d->full = 1;
+               free(d->bloom);
+               d->bloom = NULL;
+          }
+     } else {
+          seen = dedup_slot_add(d->fp, d->n_slots, h1, h2);
+     }
+     if (! seen) {
+          d->n++;
+     }
+     return seen;
+}
+
+
+void dedup_free(dedup_t *d)
+{
+     free(d->fp);
+     free(d->bloom);
+     memset(d, 0, sizeof(dedup_t));
+}
+
+
+/* returns 1 if valid and 0 if invalid. using lenient definition.
+ * empty reads are valid (and left to the length filter)
+ */
+int qual_range_is_valid(const read_stats_t *stats, const kseq_t *seq)
+{
+     /* no qualities at all? */
+     if (0 == stats->len) {
+          return 0 == seq->seq.l;
+     }
+     return stats->minq >= 0 && stats->maxq <= 93;
+}
+
+
+/* caller has to free out */
+int replace_template_mark_with_str(const char *in, char **out, const char *repl_str) {
+     const char *template_mark = strstr(in, TEMPLATE_MARK);
+     int pos;
+
+     if (! template_mark) {
+          LOG_ERROR("%s\n", "template mark not found\n");
           return 1;
      }
-     if (trim_pos.pos5p!=3 || trim_pos.pos3p!=3) {
-          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
+     pos = template_mark-in;
+     (*out) = malloc(strlen(in) - strlen(TEMPLATE_MARK) + strlen(repl_str) + 1);
+     NULLCHECK((*out));
+     memcpy((*out), in, pos);
+     strcpy(&(*out)[pos], repl_str);
+     strcat((*out), &in[pos+strlen(TEMPLATE_MARK)]);
+
+     return 0;
+}
+
+
+/* caller has to free out */
+int replace_template_mark_with_no(char *in, char **out, int split_no) {
+     char repl_str[1024];
+
+     if (split_no >= pow(10, strlen(TEMPLATE_MARK))) {
+          LOG_ERROR("%s\n", "split number too large\n");
           return 1;
      }
-     trim_args.min5pqual = 0;
-     trim_args.min3pqual = 23;
-     trim_args.minreadlen = 1;
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_ERROR("%s\n", "Read was discarded even though it's okay");
-          kseq_destroy(ks);
+     sprintf(repl_str, TEMPLATE_FMT, split_no);
+     return replace_template_mark_with_str(in, out, repl_str);
+}
+
+
+/* what output files look like: container and header to start them
+ * with (unless appending) */
+typedef struct {
+     int container; /* one of GZOUT_* */
+     kstring_t hdr;
+} out_spec_t;
+
+
+/* opens fname for output, refusing to overwrite an existing file
+ * unless overwrite or append is set. if spec is NULL, output is plain
+ * gzip. spec's header is written unless appending to a non-empty
+ * file */
+int open_output_fname(gzout_t **fp_outfq, const char *fname,
+                      int append, int overwrite, int threaded, size_t bufsize,
+                      const out_spec_t *spec) {
+     struct stat st;
+     /* appending to a missing or empty file still needs a header */
+     int is_new = ! append || 0 != stat(fname, &st) || 0 == st.st_size;
+
+     if (0 != strcmp(fname, "-") && file_exists(fname) && (! overwrite && ! append)) {
+          LOG_ERROR("Cowardly refusing to overwrite existing file %s\n", fname);
           return 1;
      }
-     if (trim_pos.pos5p!=0 || trim_pos.pos3p!=3) {
-          LOG_ERROR("Got wrong trim_pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          kseq_destroy(ks);
+     if (spec && GZOUT_BGZF == spec->container && ! is_new && bgzf_strip_eof(fname)) {
+          LOG_ERROR("Can't append to %s, which doesn't end like a BGZF file\n", fname);
           return 1;
      }
 
- 
+     (*fp_outfq) = gzout_open(fname, append ? "a" : "w", threaded, bufsize,
+                              spec ? spec->container : GZOUT_GZIP);
+     if (NULL == (*fp_outfq)) {
+          LOG_ERROR("Couldn't open %s\n", fname);
+          return 1;
+     }
+     if (spec && spec->hdr.l && is_new) {
+          char *dst = gzout_reserve(*fp_outfq, spec->hdr.l);
+          if (NULL == dst) {
+               LOG_ERROR("Couldn't write to %s\n", fname);
+               return 1;
+          }
+          memcpy(dst, spec->hdr.s, spec->hdr.l);
+          gzout_commit(*fp_outfq, spec->hdr.l);
+     }
+     return 0;
+}
 
-#if 0
-      *
-      * @HWUSI-EAS100R:6:73:941:1973#0/1
-      *
-      * @B2GA005:3:1:3597:949#ACAGTG/1
-      * @B2GA005:3:1:3597:949#ACAGTG/2
-      *
-      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 1:N:0:ATCACG
-      * @HWI-ST740:1:C0JMGACXX:1:1101:1452:2203 2:N:0:ATCACG
-      *
-#endif
-#if 0
-     sprintf_fastq(&buf, ks, &trim_pos);
-     LOG_FIXME("%s\n", buf);
-     free(buf);
-#endif
 
-#if 0 
-     sprintf_fastq(&buf, ks, NULL);
-     fprintf(stderr, "--- seq before trimming:\n%s", buf);
-     free(buf);
+int open_output_one(gzout_t **fp_outfq, char *outfq, 
+                    int append, int overwrite, int split_no, int threaded,
+                    const out_spec_t *spec) {
+     char *fname = NULL;
+     int rc;
 
-     for (i=0; i<ks->qual.l; i++) {
-          int q = ks->qual.s[i] - phredoffset;
-          fprintf(stderr, "%02d:%c:%d ", i, ks->seq.s[i], q);
-          if ((i+1)%9==0) {
-               fprintf(stderr, "\n");
+     if (0 == strcmp(outfq, "-")) {
+          if (split_no > 0) {
+               LOG_FATAL("%s\n", "Split with stdout as output not possible");
+               return 1;
           }
+          return open_output_fname(fp_outfq, outfq, 0, 1, threaded, OUTBUF_SIZE, spec);
      }
-     fprintf(stderr, "\n");
 
-     LOG_WARN("Getting trim pos for read (len=%d) with min5pqual=%d min3pqual=%d minreadlen=%d\n",
-              ks->seq.l, trim_args.min5pqual, trim_args.min3pqual, trim_args.minreadlen);
-     if (calc_trim_pos(&trim_pos, ks, phredoffset, &trim_args)) {
-          LOG_WARN("%s\n", "Read is to be discarded");
+     if (split_no > 0) {
+          if (replace_template_mark_with_no(outfq, &fname, split_no)) {
+               return 1;
+          }
      } else {
-          fprintf(stderr, "Got trim pos %d %d\n", trim_pos.pos5p, trim_pos.pos3p);
-          sprintf_fastq(&buf, ks, &trim_pos);
-          fprintf(stderr, "--- trimmed seq:\n%s", buf);          
-          free(buf);
+          fname = outfq;
      }
+     LOG_DEBUG("opening fname=%s for split_no=%d\n", fname, split_no);
+     rc = open_output_fname(fp_outfq, fname, append, overwrite, threaded, OUTBUF_SIZE, spec);
+     if (fname != outfq) {
+          free(fname);
+     }
+     return rc;
+}
 
-     sprintf_fastq(&buf, ks, NULL);
-     fprintf(stderr, "--- seq restored after trimming:\n%s", buf);
-     free(buf);
-#endif
 
-     kseq_destroy(ks);
-     LOG_TEST("%s\n", "Successfully completed");
-     return EXIT_SUCCESS;
+/* fq1 one might be stdout. fq2 might be NULL. split_no used if >0.
+ * spec as in open_output_fname() */
+int open_output(gzout_t **fp_outfq1, gzout_t **fp_outfq2, 
+                char *outfq1, char *outfq2, 
+                int append, int overwrite, int split_no, int threaded,
+                const out_spec_t *spec)
+{
+     int rc;
+
+     if (trace) {LOG_DEBUG("open_output(): fp_outfq1=%p fp_outfq2=%p outfq1=%s outfq2=%s append=%d overwrite=%d split_no=%d\n", 
+                           fp_outfq1, fp_outfq2, outfq1, outfq2, append, overwrite, split_no);}
+
+    rc = open_output_one(fp_outfq1, outfq1, append, overwrite, split_no, threaded, spec);
+    if (rc) {
+         return rc;
+    }
+    
+    if (outfq2) {
+         rc = open_output_one(fp_outfq2, outfq2, append, overwrite, split_no, threaded, spec);
+         if (rc) {
+              return rc;
+         }
+    }
+    return 0;
+}
+
+
+/* closes all n output files. returns non-zero if any of them failed */
+int close_outputs(gzout_t **fp_outfqs, int n)
+{
+     int i;
+     int rc = 0;
+     if (NULL == fp_outfqs) {
+          return 0;
+     }
+     for (i=0; i<n; i++) {
+          if (gzout_close(fp_outfqs[i])) {
+               rc = 1;
+          }
+          fp_outfqs[i] = NULL;
+     }
+     return rc;
+}
+
+/* Outputs keyed by read name fields (see split_key_from_name()). At
+ * most max_open of them are open at any time. If another one is
+ * needed, the least recently used one gets closed and will be
+ * reopened in append mode once needed again. This keeps file
+ * descriptors and buffer memory bounded no matter how many keys
+ * there are.
+ */
+typedef struct {
+     char *key;
+     gzout_t *out1;
+     gzout_t *out2;
+     int opened; /* was opened before, i.e. reopening has to append */
+     unsigned long last_use;
+} keyed_out_t;
+
+
+typedef struct {
+     keyed_out_t *outs;
+     int n;
+     int m;
+     int *hash; /* open addressing. index into outs or -1 */
+     int hash_size;
+     int last; /* most recently used. -1 if none */
+     int n_open;
+     int max_open;
+     unsigned long clock;
+
+     char *outfq1;
+     char *outfq2; /* might be NULL */
+     int append;
+     int overwrite;
+     const out_spec_t *spec;
+} out_cache_t;
+
+
+/* FNV-1a */
+unsigned int str_hash(const char *str, int len)
+{
+     unsigned int h = 2166136261u;
+     int i;
+     for (i=0; i<len; i++) {
+          h ^= (unsigned char)str[i];
+          h *= 16777619u;
+     }
+     return h;
+}
+
+
+/* returns hash slot of key, which is either empty (-1) or holds key */
+int out_cache_slot(const out_cache_t *cache, const char *key, int keylen)
+{
+     int slot = str_hash(key, keylen) & (cache->hash_size-1);
+     while (cache->hash[slot] != -1 && 0 != strcmp(cache->outs[cache->hash[slot]].key, key)) {
+          slot = (slot+1) & (cache->hash_size-1);
+     }
+     return slot;
+}
+
+
+int out_cache_init(out_cache_t *cache, char *outfq1, char *outfq2,
+                   int max_open, int append, int overwrite, const out_spec_t *spec)
+{
+     memset(cache, 0, sizeof(out_cache_t));
+     cache->hash_size = 64;
+     cache->hash = malloc(cache->hash_size * sizeof(int));
+     NULLCHECK(cache->hash);
+     memset(cache->hash, -1, cache->hash_size * sizeof(int));
+     cache->last = -1;
+     cache->max_open = max_open;
+     cache->outfq1 = outfq1;
+     cache->outfq2 = outfq2;
+     cache->append = append;
+     cache->overwrite = overwrite;
+     cache->spec = spec;
+     return 0;
+}
+
+
+int out_cache_close_one(out_cache_t *cache, keyed_out_t *ko)
+{
+     int rc = 0;
+     if (gzout_close(ko->out1)) {
+          rc = 1;
+     }
+     if (gzout_close(ko->out2)) {
+          rc = 1;
+     }
+     ko->out1 = ko->out2 = NULL;
+     cache->n_open -= 1;
+     return rc;
+}
+
+
+int out_cache_open_one(out_cache_t *cache, keyed_out_t *ko)
+{
+     char *fname;
+     /* append if reopened, otherwise use what user requested */
+     int append = ko->opened ? 1 : cache->append;
+     int rc;
+
+     if (replace_template_mark_with_str(cache->outfq1, &fname, ko->key)) {
+          return 1;
+     }
+     LOG_DEBUG("opening fname=%s for key=%s\n", fname, ko->key);
+     rc = open_output_fname(&ko->out1, fname, append, cache->overwrite, 0, OUTBUF_SIZE, cache->spec);
+     free(fname);
+     if (rc) {
+          return rc;
+     }
+     if (cache->outfq2) {
+          if (replace_template_mark_with_str(cache->outfq2, &fname, ko->key)) {
+               return 1;
+          }
+          rc = open_output_fname(&ko->out2, fname, append, cache->overwrite, 0, OUTBUF_SIZE, cache->spec);
+          free(fname);
+          if (rc) {
+               return rc;
+          }
+     }
+     ko->opened = 1;
+     cache->n_open += 1;
+     return 0;
 }
 
 
-/* return 1 if >50% bases <=minbq50p
+/* sets out1 and out2 (NULL if not paired) to the outputs for key,
+ * opening them if necessary. returns non-zero on error.
  */
-int read_below_minbq50p(const kseq_t *seq, const int minbq50p, const int phredoffset)
+int out_cache_get(out_cache_t *cache, const char *key, int keylen,
+                  gzout_t **out1, gzout_t **out2)
 {
+     keyed_out_t *ko;
+     int slot;
      int i;
-     int num_below = 0;
-     for (i=0; i<seq->qual.l; i++) {
-          int q = seq->qual.s[i]-phredoffset;
-          if (q<=minbq50p) {
-               if (++num_below > seq->qual.l/2) {
+
+     /* input is usually sorted, so try most recently used first */
+     if (cache->last >= 0 && 0 == strcmp(cache->outs[cache->last].key, key)) {
+          ko = & cache->outs[cache->last];
+
+     } else {
+          slot = out_cache_slot(cache, key, keylen);
+          if (-1 == cache->hash[slot]) {
+               if (cache->n == cache->m) {
+                    keyed_out_t *tmp;
+                    cache->m = cache->m ? cache->m*2 : 16;
+                    tmp = realloc(cache->outs, cache->m * sizeof(keyed_out_t));
+                    NULLCHECK(tmp);
+                    cache->outs = tmp;
+               }
+               ko = & cache->outs[cache->n];
+               memset(ko, 0, sizeof(keyed_out_t));
+               ko->key = strdup(key);
+               NULLCHECK(ko->key);
+               cache->hash[slot] = cache->n;
+               cache->n += 1;
+
+               /* keep load factor below 0.5 */
+               if (cache->n * 2 > cache->hash_size) {
+                    int *tmp = cache->hash;
+                    cache->hash_size *= 2;
+                    cache->hash = malloc(cache->hash_size * sizeof(int));
+                    NULLCHECK(cache->hash);
+                    memset(cache->hash, -1, cache->hash_size * sizeof(int));
+                    free(tmp);
+                    for (i=0; i<cache->n; i++) {
+                         const char *k = cache->outs[i].key;
+                         cache->hash[out_cache_slot(cache, k, strlen(k))] = i;
+                    }
+               }
+          }
+          ko = & cache->outs[cache->hash[out_cache_slot(cache, key, keylen)]];
+          cache->last = ko - cache->outs;
+     }
+
+     if (NULL == ko->out1) {
+          if (cache->n_open >= cache->max_open) {
+               keyed_out_t *lru = NULL;
+               for (i=0; i<cache->n; i++) {
+                    if (cache->outs[i].out1 && (NULL == lru || cache->outs[i].last_use < lru->last_use)) {
+                         lru = & cache->outs[i];
+                    }
+               }
+               LOG_DEBUG("closing least recently used output for key=%s\n", lru->key);
+               if (out_cache_close_one(cache, lru)) {
                     return 1;
                }
           }
+          if (out_cache_open_one(cache, ko)) {
+               return 1;
+          }
      }
+
+     ko->last_use = ++cache->clock;
+     (*out1) = ko->out1;
+     (*out2) = ko->out2;
      return 0;
 }
 
 
-/* returns 1 if valid and 0 if invalid. using lenient definition.
- */
-int qual_range_is_valid(const kseq_t *seq, const int phredoffset)
+/* closes all outputs and frees cache. returns non-zero on error */
+int out_cache_free(out_cache_t *cache)
 {
-     /* FIXME faster to just check extreme values */
+     int rc = 0;
      int i;
-     for (i=0; i<seq->qual.l; i++) {
-          int q = seq->qual.s[i]-phredoffset;
-          if (q<0 || q>93) {
-               return 0;
+     for (i=0; i<cache->n; i++) {
+          if (cache->outs[i].out1 && out_cache_close_one(cache, & cache->outs[i])) {
+               rc = 1;
           }
+          free(cache->outs[i].key);
      }
-     /* no qualities at all? */
-     if (0 == i) {
-          return 0;
+     free(cache->outs);
+     free(cache->hash);
+     memset(cache, 0, sizeof(out_cache_t));
+     return rc;
+}
+
+
+/* Demultiplexing by barcode. All barcodes within the allowed number
+ * of mismatches of a sample barcode are precomputed and stored in a
+ * hash table, so that looking up a read's barcode is O(1). Each
+ * sample gets its own output (pair), all of which stay open and are
+ * compressed by their own thread. The last sample is the
+ * undetermined bucket.
+ */
+typedef struct {
+     char **names;
+     char **barcodes;
+     int n; /* number of samples, excluding undetermined */
+     int bclen;
+
+     char *keys; /* bclen chars per slot */
+     int *vals; /* sample index per slot or -1 if empty */
+     int size; /* number of slots (power of 2) */
+     int n_keys;
+
+     gzout_t **out1;
+     gzout_t **out2; /* NULL entries if single-end */
+     unsigned long *counts;
+} demux_t;
+
+
+/* returns slot for barcode, which is either empty or holds bc */
+int demux_slot(const demux_t *dm, const char *bc)
+{
+     int slot = str_hash(bc, dm->bclen) & (dm->size-1);
+     while (-1 != dm->vals[slot] && 0 != memcmp(&dm->keys[slot*dm->bclen], bc, dm->bclen)) {
+          slot = (slot+1) & (dm->size-1);
      }
-     return 1;
+     return slot;
 }
 
 
-/* caller has to free out */
-int replace_template_mark_with_no(char *in, char **out, int split_no) {
-     char *template_mark = strstr(in, TEMPLATE_MARK);
-     char repl_str[1024];
-     int i;
-     int pos;
+/* returns sample index for barcode of length len. undetermined if unknown */
+int demux_lookup(const demux_t *dm, const char *bc, int len)
+{
+     int slot;
+     if (len != dm->bclen) {
+          return dm->n;
+     }
+     slot = demux_slot(dm, bc);
+     return -1 == dm->vals[slot] ? dm->n : dm->vals[slot];
+}
 
-     if (! template_mark) {
-          LOG_ERROR("%s\n", "template mark not found\n");
+
+/* adds bc and all barcodes with up to mm_left more mismatches at
+ * positions >= pos. returns non-zero if they clash with another
+ * sample.
+ */
+int demux_add_variants(demux_t *dm, int sample, char *bc, int pos, int mm_left)
+{
+     const char *alphabet = "ACGTN";
+     int slot = demux_slot(dm, bc);
+     int i, j;
+
+     if (-1 == dm->vals[slot]) {
+          memcpy(&dm->keys[slot*dm->bclen], bc, dm->bclen);
+          dm->vals[slot] = sample;
+          dm->n_keys++;
+     } else if (dm->vals[slot] != sample) {
+          LOG_ERROR("Barcodes of samples %s and %s are too similar for the allowed number of mismatches (clash at %.*s)\n",
+                    dm->names[dm->vals[slot]], dm->names[sample], dm->bclen, bc);
           return 1;
      }
-     if (split_no >= pow(10, strlen(TEMPLATE_MARK))) {
-          LOG_ERROR("%s\n", "split number too large\n");
-          return 1;
+     if (0 == mm_left) {
+          return 0;
      }
-     (*out) = strdup(in);
-     sprintf(repl_str, TEMPLATE_FMT, split_no);
-     
-     pos = template_mark-in;
-     for (i=0; i<strlen(TEMPLATE_MARK); i++) {
-          (*out)[pos+i] = repl_str[i];
+     for (i=pos; i<dm->bclen; i++) {
+          char orig = bc[i];
+          if ('+' == orig) {
+               continue; /* dual index separator */
+          }
+          for (j=0; alphabet[j]; j++) {
+               if (alphabet[j] == orig) {
+                    continue;
+               }
+               bc[i] = alphabet[j];
+               if (demux_add_variants(dm, sample, bc, i+1, mm_left-1)) {
+                    bc[i] = orig;
+                    return 1;
+               }
+          }
+          bc[i] = orig;
      }
-
      return 0;
 }
 
 
-int open_output_one(gzFile **fp_outfq, char *outfq, 
-                    int append, int overwrite, int split_no) {
-     char *fname = NULL;
-     char outmode[2];/* output mode for both fq files */
-     strcpy(outmode, "w");
-     if (append) {
-          strcpy(outmode, "a");
-     }    
+/* parses sample sheet with one whitespace separated sample name and
+ * barcode per line. empty lines and lines starting with '#' are
+ * ignored. returns non-zero on error.
+ */
+int demux_read_samplesheet(demux_t *dm, const char *fname)
+{
+     FILE *fh;
+     char line[1024];
+     char name[512], bc[512];
+     int m = 0;
+     int lineno = 0;
+     int i;
 
-     if (0 == strcmp(outfq, "-")) {
-          if (split_no > 0) {
-               LOG_FATAL("%s\n", "Split with stdout as output not possible");
-               return 1;
+     if (NULL == (fh = fopen(fname, "r"))) {
+          LOG_ERROR("Couldn't open sample sheet %s\n", fname);
+          return 1;
+     }
+     while (fgets(line, sizeof(line), fh)) {
+          lineno++;
+          if ('#' == line[0] || 2 != sscanf(line, "%511s %511s", name, bc)) {
+               if ('#' != line[0] && 1 == sscanf(line, "%511s", name)) {
+                    LOG_ERROR("Missing barcode in line %d of %s\n", lineno, fname);
+                    fclose(fh);
+                    return 1;
+               }
+               continue;
           }
-          (*fp_outfq) = gzdopen(fileno(stdout), "w");
-     } else {
-          if (append) {
-               strcpy(outmode, "a");
+          if (strchr(name, '/') || 0 == strcmp(name, DEMUX_UNDETERMINED)) {
+               LOG_ERROR("Invalid sample name '%s' in line %d of %s\n", name, lineno, fname);
+               fclose(fh);
+               return 1;
           }
-          if (split_no > 0) {
-               if (replace_template_mark_with_no(outfq, &fname, split_no)) {
+          for (i=0; bc[i]; i++) {
+               bc[i] = toupper(bc[i]);
+               if (NULL == strchr("ACGTN+", bc[i])) {
+                    LOG_ERROR("Invalid barcode '%s' in line %d of %s\n", bc, lineno, fname);
+                    fclose(fh);
                     return 1;
                }
-          } else {
-               fname = outfq;
           }
-          
-          if (file_exists(fname) && (! overwrite && ! append)) {
-               LOG_ERROR("Cowardly refusing to overwrite existing file %s\n", fname);
+          if (0 == dm->n) {
+               dm->bclen = strlen(bc);
+          } else if (strlen(bc) != dm->bclen) {
+               LOG_ERROR("Barcode '%s' in line %d of %s differs in length from previous ones\n",
+                         bc, lineno, fname);
+               fclose(fh);
                return 1;
-               if (fname != outfq) {
-                    free(fname);
+          }
+          for (i=0; i<dm->n; i++) {
+               if (0 == strcmp(dm->names[i], name)) {
+                    LOG_ERROR("Duplicate sample name '%s' in %s\n", name, fname);
+                    fclose(fh);
+                    return 1;
                }
           }
-          
-          (*fp_outfq) = gzopen(fname, outmode);                    
-          LOG_DEBUG("opening fname=%s for split_no=%d\n", fname, split_no);
+          if (dm->n+1 >= m) {
+               char **tmp;
+               m = m ? m*2 : 64;
+               tmp = realloc(dm->names, m * sizeof(char *));
+               NULLCHECK(tmp);
+               dm->names = tmp;
+               tmp = realloc(dm->barcodes, m * sizeof(char *));
+               NULLCHECK(tmp);
+               dm->barcodes = tmp;
+               for (i=dm->n; i<m; i++) {
+                    dm->names[i] = dm->barcodes[i] = NULL;
+               }
+          }
+          dm->names[dm->n] = strdup(name);
+          dm->barcodes[dm->n] = strdup(bc);
+          dm->n++;
      }
+     fclose(fh);
 
-     if (NULL == (*fp_outfq)) {
-          LOG_ERROR("Couldn't open %s\n", fname);
+     if (0 == dm->n) {
+          LOG_ERROR("No samples found in %s\n", fname);
           return 1;
      }
-     if (fname != outfq) {
-          free(fname);
+     dm->names[dm->n] = strdup(DEMUX_UNDETERMINED);
+     dm->barcodes[dm->n] = NULL;
+     return 0;
+}
+
+
+int demux_init(demux_t *dm, const char *samplesheet, int mismatches,
+               char *outfq1, char *outfq2, int append, int overwrite,
+               const out_spec_t *spec)
+{
+     int variants_per_bc = 1;
+     int i, k;
+     char *fname;
+
+     memset(dm, 0, sizeof(demux_t));
+     if (demux_read_samplesheet(dm, samplesheet)) {
+          return 1;
      }
 
+     /* upper bound of barcodes within mismatches: sum_k C(L,k)*4^k */
+     for (k=1, i=1; k<=mismatches; k++) {
+          i = i * (dm->bclen-k+1) / k;
+          variants_per_bc += i * (1<<(2*k));
+     }
+     dm->size = 64;
+     while (dm->size < 2 * variants_per_bc * dm->n) {
+          dm->size *= 2;
+     }
+     dm->keys = malloc((size_t)dm->size * dm->bclen);
+     dm->vals = malloc(dm->size * sizeof(int));
+     NULLCHECK(dm->keys);
+     NULLCHECK(dm->vals);
+     memset(dm->vals, -1, dm->size * sizeof(int));
+     for (i=0; i<dm->n; i++) {
+          /* exact barcodes first, so that clashes name the right samples */
+          if (demux_add_variants(dm, i, dm->barcodes[i], 0, 0)) {
+               return 1;
+          }
+     }
+     for (i=0; i<dm->n; i++) {
+          if (demux_add_variants(dm, i, dm->barcodes[i], 0, mismatches)) {
+               return 1;
+          }
+     }
+     LOG_DEBUG("%d barcode variants for %d samples in table of size %d\n",
+               dm->n_keys, dm->n, dm->size);
+
+     dm->out1 = calloc(dm->n+1, sizeof(gzout_t *));
+     dm->out2 = calloc(dm->n+1, sizeof(gzout_t *));
+     dm->counts = calloc(dm->n+1, sizeof(unsigned long));
+     NULLCHECK(dm->out1);
+     NULLCHECK(dm->out2);
+     NULLCHECK(dm->counts);
+     for (i=0; i<=dm->n; i++) {
+          if (replace_template_mark_with_str(outfq1, &fname, dm->names[i])) {
+               return 1;
+          }
+          k = open_output_fname(&dm->out1[i], fname, append, overwrite, 1, DEMUX_OUTBUF_SIZE, spec);
+          free(fname);
+          if (k) {
+               return 1;
+          }
+          if (outfq2) {
+               if (replace_template_mark_with_str(outfq2, &fname, dm->names[i])) {
+                    return 1;
+               }
+               k = open_output_fname(&dm->out2[i], fname, append, overwrite, 1, DEMUX_OUTBUF_SIZE, spec);
+               free(fname);
+               if (k) {
+                    return 1;
+               }
+          }
+     }
      return 0;
 }
 
 
-/* fq1 one might be stdout. fq2 might be NULL. split_no used if >0 */
-int open_output(gzFile **fp_outfq1, gzFile **fp_outfq2, 
-                char *outfq1, char *outfq2, 
-                int append, int overwrite, int split_no)
+/* closes all outputs, reports counts and frees dm. returns non-zero
+ * on error */
+int demux_free(demux_t *dm)
 {
-     int rc;
-
-     if (trace) {LOG_DEBUG("open_output(): fp_outfq1=%p fp_outfq2=%p outfq1=%s outfq2=%s append=%d overwrite=%d split_no=%d\n", 
-                           fp_outfq1, fp_outfq2, outfq1, outfq2, append, overwrite, split_no);}
+     int rc = 0;
+     int i;
 
-    rc = open_output_one(fp_outfq1, outfq1, append, overwrite, split_no);
-    if (rc) {
-         return rc;
-    }
-    
-    if (outfq2) {
-         rc = open_output_one(fp_outfq2, outfq2, append, overwrite, split_no);
-         if (rc) {
-              return rc;
-         }
-    }
-    return 0;
+     if (NULL == dm->names) {
+          return 0;
+     }
+     for (i=0; i<=dm->n; i++) {
+          if (dm->counts) {
+               LOG_INFO("Number out for %s\t= %lu\n", dm->names[i], dm->counts[i]);
+          }
+          if (dm->out1 && gzout_close(dm->out1[i])) {
+               rc = 1;
+          }
+          if (dm->out2 && gzout_close(dm->out2[i])) {
+               rc = 1;
+          }
+          free(dm->names[i]);
+          free(dm->barcodes[i]);
+     }
+     free(dm->names);
+     free(dm->barcodes);
+     free(dm->keys);
+     free(dm->vals);
+     free(dm->out1);
+     free(dm->out2);
+     free(dm->counts);
+     memset(dm, 0, sizeof(demux_t));
+     return rc;
 }
 
+
 int main(int argc, char *argv[])
 {
     args_t args = { 0 };
-    gzFile *fp_infq1 = NULL, *fp_infq2 = NULL;
-    gzFile *fp_outfq1 = NULL, *fp_outfq2 = NULL;
+    reader_t in1, in2; /* in2 only used for separate second input */
+    gzout_t **fp_outfq1 = NULL, **fp_outfq2 = NULL;
+    int n_outs = 1; /* number of simultaneously open outputs per mate */
+    int out_idx = 0; /* output used for current read (pair) */
+    gzout_t *out1 = NULL, *out2 = NULL; /* outputs for current read (pair) */
+    out_cache_t out_cache = { 0 }; /* only used for split_by */
+    char split_key[SPLIT_KEY_MAXLEN];
+    demux_t demux = { 0 }; /* only used with samplesheet */
+    adapters_t adapters = { 0 }; /* only used if args.adapters */
+    kstring_t rc_buf = { 0 }; /* scratch space for reverse complements */
+    kstring_t trim_buf = { 0 }; /* scratch space for window trimming */
+    gzout_t *merge_out = NULL; /* only used if args.merge */
+    kseq_t merged; /* only used if args.merge */
+    fmt_args_t fmt_args;
+    out_spec_t out_spec;
+    int n_merged = 0;
+    dedup_t dedup;
+    unsigned long n_dups = 0;
     kseq_t *seq1 = NULL, *seq2 = NULL;
     int len1 = -1, len2 = -1;
     int pe_mode = 0; /* bool paired end mode */
@@ -1168,10 +5971,19 @@ int main(int argc, char *argv[])
     trim_pos_t *trim_pos_1 = NULL;
     trim_pos_t *trim_pos_2 = NULL;
     float cma_bases = 0.0; /* cumulative moving average */
+    read_stats_t stats1, stats2;
+    packed_seq_t packed1, packed2; /* packed bases of seq1 and seq2 */
+    int need_packed; /* any filter working on packed bases enabled? */
+    long n_bases_in = 0, n_gc_in = 0; /* R1 only, as cma_bases */
 #ifdef TEST
     return test();
 #endif
     srand(time(NULL));
+    init_tables();
+    memset(&merged, 0, sizeof(kseq_t));
+    memset(&dedup, 0, sizeof(dedup_t));
+    memset(&packed1, 0, sizeof(packed_seq_t));
+    memset(&packed2, 0, sizeof(packed_seq_t));
 
    
     if (parse_args(&args, argc, argv)) {
@@ -1181,55 +5993,184 @@ int main(int argc, char *argv[])
     if (debug) {
          dump_args(& args);
     }
+    need_packed = args.max_dust >= 0.0;
     trim_args.min5pqual = args.min5pqual;
     trim_args.min3pqual = args.min3pqual;
     trim_args.minreadlen = args.minreadlen;
-    if (args.infq2) {
-         pe_mode = 1;
+    trim_args.algo = args.trim_algo;
+    trim_args.window_size = args.window_size;
+    trim_args.scratch = &trim_buf;
+    trim_args.poly = args.trim_poly;
+    trim_args.trim_n = args.trim_n;
+    trim_args.headcrop = args.headcrop;
+    trim_args.tailcrop = args.tailcrop;
+    trim_args.poly_min_len = args.poly_min_len;
+    if (args.adapters) {
+         if (adapters_init(&adapters, args.adapters,
+                           args.adapter_mismatch_rate, args.adapter_min_overlap)) {
+              adapters_free(&adapters);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    }
+    memset(&fmt_args, 0, sizeof(fmt_args_t));
+    if (args.qual_bin) {
+         if (fmt_args_init_qual_bins(&fmt_args, args.qual_bin, args.phredoffset)) {
+              adapters_free(&adapters);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    }
+    if (args.mask_below) {
+         fmt_args.mask_below = args.mask_below + args.phredoffset;
     }
+    fmt_args.drop_comment = args.drop_comment;
+    fmt_args.out_format = args.out_format;
+    fmt_args.rename = args.rename;
+    fmt_args.phredoffset = args.phredoffset;
+    fmt_args.rg_id = args.rg_id;
+    dedup.max_bytes = (size_t)args.dedup_mem * 1048576;
+    memset(&out_spec, 0, sizeof(out_spec_t));
+    if (OUT_FORMAT_BAM == args.out_format) {
+         if (bam_header_init(&out_spec.hdr, args.rg_id, args.rg_sample)) {
+              adapters_free(&adapters);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+         out_spec.container = GZOUT_BGZF;
+    } else if (OUT_FORMAT_FBIN == args.out_format) {
+         out_spec.container = GZOUT_FBIN;
+    }
+    memset(&in2, 0, sizeof(reader_t));
 
     /* open input fqs
      */
-    fp_infq1 = (0 == strcmp(args.infq1, "-")) ? 
-         gzdopen(fileno(stdin), "r") : gzopen(args.infq1, "r");
-    if (NULL == fp_infq1) {
-         LOG_ERROR("%s\n", "Couldn't open %s. Exiting...", args.infq1);
+    if (reader_open(&in1, args.infq1, args.in_format, args.interleaved_in, args.phredoffset)) {
+         LOG_ERROR("Couldn't open %s. Exiting...\n", args.infq1);
+         reader_close(&in1);
+         free_args(& args);
+         return EXIT_FAILURE;
+    }
+    if (args.infq2) {
+         pe_mode = 1;
+         if (reader_open(&in2, args.infq2, args.in_format, 0, args.phredoffset)) {
+              LOG_ERROR("Couldn't open %s. Exiting...\n", args.infq2);
+              reader_close(&in1);
+              reader_close(&in2);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    } else if (in1.paired) {
+         pe_mode = 1;
+    }
+    if (args.revcomp_r2 && ! pe_mode) {
+         LOG_ERROR("%s\n", "--revcomp-r2 only works for paired-end input");
+         reader_close(&in1);
          free_args(& args);
          return EXIT_FAILURE;
     }
-	if (pe_mode) {
-         fp_infq2 = gzopen(args.infq2, "r");
-         if (NULL == fp_infq2) {
-              LOG_ERROR("%s\n", "Couldn't open %s. Exiting...", args.infq2);
+    if (IN_FORMAT_FASTQ != args.in_format) {
+         const char *err = NULL;
+         if (pe_mode && ! args.outfq2 && OUT_FORMAT_BAM != args.out_format
+             && OUT_FORMAT_FBIN != args.out_format && ! args.interleaved_out) {
+              err = "Need two output files for paired-end input";
+         } else if (! pe_mode && args.outfq2) {
+              err = "Got second output file, but input is not paired";
+         } else if (! pe_mode && (args.trim_overlap || args.merge)) {
+              err = "Overlap trimming and merging only work for paired-end input";
+         }
+         if (err) {
+              LOG_ERROR("%s\n", err);
+              reader_close(&in1);
               free_args(& args);
               return EXIT_FAILURE;
          }
     }
 
 
-    if (open_output(&fp_outfq1, &fp_outfq2,
-                    args.outfq1, args.outfq2,
-                    args.append_to_output, args.overwrite_output, args.split_every>0? 1:0)) {
-         LOG_ERROR("%s\n", "Couldn't open output files. Exiting...");
+    if (args.shards>0) {
+         n_outs = args.shards;
+    } else if (args.split_by != SPLIT_BY_NONE) {
+         /* opened on demand */
+         n_outs = 0;
+         if (out_cache_init(&out_cache, args.outfq1, args.outfq2, args.max_open,
+                            args.append_to_output, args.overwrite_output, &out_spec)) {
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    } else if (args.samplesheet) {
+         n_outs = 0;
+         if (demux_init(&demux, args.samplesheet, args.barcode_mismatches,
+                        args.outfq1, args.outfq2,
+                        args.append_to_output, args.overwrite_output, &out_spec)) {
+              LOG_ERROR("%s\n", "Couldn't set up demultiplexing. Exiting...");
+              demux_free(&demux);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    }
+    fp_outfq1 = calloc(n_outs+1, sizeof(gzout_t *));
+    fp_outfq2 = calloc(n_outs+1, sizeof(gzout_t *));
+    if (NULL == fp_outfq1 || NULL == fp_outfq2) {
+         LOG_FATAL("%s\n", "memory allocation error");
          free_args(& args);
-         kseq_destroy(seq1);
          return EXIT_FAILURE;
-    }         
+    }
+    for (out_idx=0; out_idx<n_outs; out_idx++) {
+         int split_no = 0;
+         if (args.split_every>0) {
+              split_no = 1;
+         } else if (args.shards>0) {
+              split_no = out_idx+1;
+         }
+         if (open_output(&fp_outfq1[out_idx], &fp_outfq2[out_idx],
+                         args.outfq1, args.outfq2,
+                         args.append_to_output, args.overwrite_output,
+                         split_no, args.shards>0, &out_spec)) {
+              LOG_ERROR("%s\n", "Couldn't open output files. Exiting...");
+              close_outputs(fp_outfq1, n_outs);
+              close_outputs(fp_outfq2, n_outs);
+              free(fp_outfq1);
+              free(fp_outfq2);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    }
+    out_idx = 0;
+    if (args.merge) {
+         if (open_output_fname(&merge_out, args.merge, args.append_to_output,
+                               args.overwrite_output, 1, OUTBUF_SIZE, &out_spec)) {
+              LOG_ERROR("%s\n", "Couldn't open output files. Exiting...");
+              close_outputs(fp_outfq1, n_outs);
+              close_outputs(fp_outfq2, n_outs);
+              free(fp_outfq1);
+              free(fp_outfq2);
+              free_args(& args);
+              return EXIT_FAILURE;
+         }
+    }
 
-	seq1 = kseq_init(fp_infq1);
-	if (pe_mode) {
-         seq2 = kseq_init(fp_infq2);
+    seq1 = in1.seq[0];
+    if (pe_mode) {
+         seq2 = args.infq2 ? in2.seq[0] : in1.seq[1];
     }
     n_reads_in = n_reads_out = 0;
     trim_pos_1 = malloc(sizeof(trim_pos_t));
     trim_pos_2 = malloc(sizeof(trim_pos_t));
-	while ((len1 = kseq_read(seq1)) >= 0) {
+	while ((len1 = reader_read(&in1, 0)) >= 0) {
          if (trace) {LOG_DEBUG("Inspecting seq1: %s\n", seq1->name.s);}
 
          if (pe_mode) {
               /* read read2 directly to keep both in sync. a continue
                * before reading read2 makes order invalid */
-              if ((len2 = kseq_read(seq2)) < 0) {
+              if (! args.infq2) {
+                   if ((len2 = reader_read(&in1, 1)) < 0) {
+                        LOG_ERROR("Couldn't read mate of %s from %s. %s\n",
+                                  seq1->name.s, args.infq1, EARLY_EXIT_MESSAGE);
+                        rc = EXIT_FAILURE;
+                        goto free_and_exit;
+                   }
+              } else if ((len2 = reader_read(&in2, 0)) < 0) {
                    LOG_ERROR("Reached premature end in second file (%s)."
                              " Still received reads from first file (%s from %s). %s\n",
                              args.infq2, seq1->name.s, args.infq1, EARLY_EXIT_MESSAGE);
@@ -1244,14 +6185,45 @@ int main(int argc, char *argv[])
               LOG_DEBUG("Still alive and happily massaging read %d\n", n_reads_in);
          }
 
-         /* at this point we get seq1 and if in PE mode also seq2 
-          * minbq50p filtering goes first
+         /* at this point we get seq1 and if in PE mode also seq2.
+          * one pass over each computes all statistics needed for
+          * quality check, filtering and trimming.
+          */
+         if (need_packed
+             && (pack_seq(&packed1, seq1->seq.s, seq1->seq.l)
+                 || (pe_mode && pack_seq(&packed2, seq2->seq.s, seq2->seq.l)))) {
+              LOG_ERROR("%s\n", "Couldn't allocate memory for packed bases");
+              rc = EXIT_FAILURE;
+              goto free_and_exit;
+         }
+         read_stats(&stats1, seq1, need_packed ? &packed1 : NULL, args.minbq50p, args.phredoffset);
+         if (pe_mode) {
+              read_stats(&stats2, seq2, need_packed ? &packed2 : NULL, args.minbq50p, args.phredoffset);
+         }
+         n_bases_in += stats1.len;
+         n_gc_in += stats1.num_gc;
+
+         /* quality check: done before filtering and trimming to see
+          * more reads
           */
-         if (read_below_minbq50p(seq1, args.minbq50p, args.phredoffset)) {
+         if (! qual_range_is_valid(&stats1, seq1)) {
+              LOG_ERROR("Read %s has qualities outside valid range (%s). %s\n",
+                        seq1->name.s, seq1->qual.s, EARLY_EXIT_MESSAGE);
+              rc = EXIT_FAILURE;
+              goto free_and_exit;
+         }
+         if (pe_mode && ! qual_range_is_valid(&stats2, seq2)) {
+              LOG_ERROR("Read %s has qualities outside valid range (%s). %s\n",
+                        seq2->name.s, seq2->qual.s, EARLY_EXIT_MESSAGE);
+              rc = EXIT_FAILURE;
+              goto free_and_exit;
+         }
+
+         if (read_filtered(&stats1, seq1, &args)) {
               continue;/* drop */
          }
          if (pe_mode) {
-              if (read_below_minbq50p(seq2, args.minbq50p, args.phredoffset)) {
+              if (read_filtered(&stats2, seq2, &args)) {
                    continue;/* drop */
               }
          }
@@ -1259,37 +6231,38 @@ int main(int argc, char *argv[])
          trim_pos_1->pos5p = trim_pos_1->pos3p = 1<<20; /* make invalid */
          trim_pos_2->pos5p = trim_pos_2->pos3p = 1<<20; /* make invalid */
 
-         /* quality check: done before trimming to see more reads
-          */
-         if (1 == (n_reads_in%QUAL_CHECK_SAMPLERATE)) {
-              if (! qual_range_is_valid(seq1, args.phredoffset)) {
-                   LOG_ERROR("Read %s has qualities outside valid range (%s). %s\n",
-                             seq1->name.s, seq1->qual.s, EARLY_EXIT_MESSAGE);
-                   rc = EXIT_FAILURE;
-                   goto free_and_exit;
-              }
-         }
-
-         if (calc_trim_pos(trim_pos_1, seq1, args.phredoffset, &trim_args)) {
+         if (calc_trim_pos(trim_pos_1, seq1, &stats1, args.phredoffset, &trim_args)) {
               if (trace) {LOG_DEBUG("%s\n", "seq1 to be discarded");}
               continue;
          }
+         if (args.adapters && adapter_trim(trim_pos_1, seq1, &adapters, args.minreadlen)) {
+              if (trace) {LOG_DEBUG("%s\n", "seq1 to be discarded after adapter trimming");}
+              continue;
+         }
+         if (ee_filter(trim_pos_1, seq1, args.phredoffset, &args)) {
+              if (trace) {LOG_DEBUG("%s\n", "seq1 to be discarded after expected errors filtering");}
+              continue;
+         }
 
 
          if (pe_mode) {
-              if (1 == (n_reads_in%QUAL_CHECK_SAMPLERATE)) {
-                   if (! qual_range_is_valid(seq1, args.phredoffset)) {
-                        LOG_ERROR("Read %s has qualities outside valid range (%s). %s\n",
-                                  seq1->name.s, seq1->qual.s, EARLY_EXIT_MESSAGE);
-                        rc = EXIT_FAILURE;
-                        goto free_and_exit;
-                   }
-              }
-
-              if (calc_trim_pos(trim_pos_2, seq2, args.phredoffset, &trim_args)) {
+              if (calc_trim_pos(trim_pos_2, seq2, &stats2, args.phredoffset, &trim_args)) {
                    if (trace) {LOG_DEBUG("%s\n", "seq2 to be discarded");}
                    continue;
               }
+              if (args.adapters && adapter_trim(trim_pos_2, seq2, &adapters, args.minreadlen)) {
+                   if (trace) {LOG_DEBUG("%s\n", "seq2 to be discarded after adapter trimming");}
+                   continue;
+              }
+              if (ee_filter(trim_pos_2, seq2, args.phredoffset, &args)) {
+                   if (trace) {LOG_DEBUG("%s\n", "seq2 to be discarded after expected errors filtering");}
+                   continue;
+              }
+              if (args.trim_overlap && overlap_trim(trim_pos_1, trim_pos_2, seq1, seq2, &rc_buf,
+                                                    args.overlap_min_len, args.minreadlen)) {
+                   if (trace) {LOG_DEBUG("%s\n", "pair to be discarded after overlap trimming");}
+                   continue;
+              }
               
               /* read order check (PE only)
                */
@@ -1323,35 +6296,111 @@ int main(int argc, char *argv[])
               }
          }
 
+         if (args.dedup) {
+              uint64_t h[2] = {0, 0};
+              int seen;
+              dedup_hash(h, seq1->seq.s, seq1->seq.l);
+              if (pe_mode) {
+                   dedup_hash(h, seq2->seq.s, seq2->seq.l);
+              }
+              seen = dedup_seen(&dedup, h);
+              if (seen < 0) {
+                   LOG_ERROR("Couldn't allocate memory for duplicate removal. %s\n", EARLY_EXIT_MESSAGE);
+                   rc = EXIT_FAILURE;
+                   goto free_and_exit;
+              }
+              if (seen) {
+                   n_dups+=1;
+                   continue;
+              }
+         }
+
 
          /* 
           * output 
           *
           */
 
+         if (args.merge && merge_pair(&merged, seq1, trim_pos_1, seq2, trim_pos_2,
+                                      &rc_buf, args.overlap_min_len)) {
+              fmt_args.read_no = n_reads_in;
+              fmt_args.bam_flag = BAM_FLAG_UNPAIRED;
+              fmt_args.revcomp = 0;
+              if (0 >= gzout_fastq(merge_out, &merged, NULL, &fmt_args)) {
+                   LOG_ERROR("Couldn't write to %s (after successfully writing"
+                             " %d merged reads). %s\n",
+                             merge_out->fname, n_merged, EARLY_EXIT_MESSAGE);
+                   rc = EXIT_FAILURE;
+                   goto free_and_exit;
+              }
+              n_merged+=1;
+              continue;
+         }
+
          if (args.split_every>0) {
               /* for split every we reopen files if necessary */
               if ((n_reads_out+1)%args.split_every == 0) {
-                   gzclose(fp_outfq1);
-                   if (pe_mode) {
-                        gzclose(fp_outfq2);
+                   if (close_outputs(fp_outfq1, 1) | close_outputs(fp_outfq2, 1)) {
+                        LOG_ERROR("Couldn't close output files (after successfully writing"
+                                  " %d reads). %s\n", n_reads_out, EARLY_EXIT_MESSAGE);
+                        rc = EXIT_FAILURE;
+                        goto free_and_exit;
                    }
-                   if (open_output(&fp_outfq1, &fp_outfq2,
+                   if (open_output(&fp_outfq1[0], &fp_outfq2[0],
                                    args.outfq1, args.outfq2,
                                    args.append_to_output, args.overwrite_output,
-                                   (n_reads_out+1)/args.split_every+1)) {
+                                   (n_reads_out+1)/args.split_every+1, 0, &out_spec)) {
                         LOG_ERROR("%s\n", "Couldn't open output files. Exiting...");
-                        return EXIT_FAILURE;
+                        rc = EXIT_FAILURE;
+                        goto free_and_exit;
                    }         
               }
               
+         } else if (args.shards>0) {
+              /* round-robin in batches, so that each shard's
+               * compressor gets a decent chunk at a time */
+              out_idx = (n_reads_out/SHARD_BATCHSIZE) % n_outs;
+         }
+         out1 = fp_outfq1[out_idx];
+         out2 = fp_outfq2[out_idx];
+
+         if (args.split_by != SPLIT_BY_NONE) {
+              /* mates follow first read */
+              int keylen = split_key_from_name(split_key, seq1, args.split_by);
+              if (keylen < 0) {
+                   LOG_ERROR("Couldn't parse flowcell/lane/tile from read name %s. %s\n",
+                             seq1->name.s, EARLY_EXIT_MESSAGE);
+                   rc = EXIT_FAILURE;
+                   goto free_and_exit;
+              }
+              if (out_cache_get(&out_cache, split_key, keylen, &out1, &out2)) {
+                   LOG_ERROR("Couldn't open output files for %s. %s\n",
+                             split_key, EARLY_EXIT_MESSAGE);
+                   rc = EXIT_FAILURE;
+                   goto free_and_exit;
+              }
+         } else if (args.samplesheet) {
+              const char *bc = NULL;
+              int bclen = barcode_from_comment(&bc, seq1);
+              int sample = bclen < 0 ? demux.n : demux_lookup(&demux, bc, bclen);
+              out1 = demux.out1[sample];
+              out2 = demux.out2[sample];
+              demux.counts[sample] += 1;
          }
               
 
-         if (0 >= gzprintf_fastq(fp_outfq1, seq1, trim_pos_1)) {
+         if (OUT_FORMAT_BAM == args.out_format || OUT_FORMAT_FBIN == args.out_format
+             || args.interleaved_out) {
+              /* both mates go into first output */
+              out2 = out1;
+         }
+         fmt_args.read_no = n_reads_in; /* same for both mates */
+         fmt_args.bam_flag = pe_mode ? BAM_FLAG_READ1 : BAM_FLAG_UNPAIRED;
+         fmt_args.revcomp = args.revcomp_r1;
+         if (0 >= gzout_fastq(out1, seq1, trim_pos_1, &fmt_args)) {
               LOG_ERROR("Couldn't write to %s (after successfully writing"
                         "  %d reads). Exiting...\n",
-                        args.outfq1, n_reads_out);
+                        out1->fname, n_reads_out);
               rc = EXIT_FAILURE;
               goto free_and_exit;
          }
@@ -1361,10 +6410,12 @@ int main(int argc, char *argv[])
                    trimmed_len(seq1, trim_pos_1), n_reads_out, cma_bases, n_reads_out);
 #endif
          if (pe_mode) {
-              if (0 >= gzprintf_fastq(fp_outfq2, seq2, trim_pos_2)) {
+              fmt_args.bam_flag = BAM_FLAG_READ2;
+              fmt_args.revcomp = args.revcomp_r2;
+              if (0 >= gzout_fastq(out2, seq2, trim_pos_2, &fmt_args)) {
                    LOG_ERROR("Couldn't write to %s (after successfully"
                              " writing %d reads). %s\n",
-                             args.outfq2, n_reads_out,
+                             out2->fname, n_reads_out,
                              EARLY_EXIT_MESSAGE);
                    rc = EXIT_FAILURE;
                    goto free_and_exit;
@@ -1374,9 +6425,14 @@ int main(int argc, char *argv[])
          n_reads_out+=1;
     }
     /* while len1 */
+    if (len1 < -1 && IN_FORMAT_FASTQ != args.in_format) {
+         LOG_ERROR("Couldn't read %s. %s\n", args.infq1, EARLY_EXIT_MESSAGE);
+         rc = EXIT_FAILURE;
+         goto free_and_exit;
+    }
 
-	if (pe_mode) {
-         if ((len2 = kseq_read(seq2)) >= 0) {
+	if (args.infq2) {
+         if ((len2 = reader_read(&in2, 0)) >= 0) {
               LOG_ERROR("Reached premature end in first file (%s)."
                         " Still received reads from second file (%s from %s). %s\n",
                         args.infq1, seq2->name.s, args.infq2, EARLY_EXIT_MESSAGE);
@@ -1393,17 +6449,35 @@ free_and_exit:
 
     LOG_INFO("Number of %s in\t= %d\n", pe_mode?"pairs":"reads", n_reads_in);
     LOG_INFO("Number of %s out\t= %d\n", pe_mode?"pairs":"reads", n_reads_out);
+    if (args.merge) {
+         LOG_INFO("Number of pairs merged\t= %d\n", n_merged);
+    }
+    if (args.dedup) {
+         LOG_INFO("Number of duplicates removed\t= %lu\n", n_dups);
+    }
     LOG_INFO("Average length (R1)\t= %.1f\n", cma_bases);
-
-	kseq_destroy(seq1);
-    gzclose(fp_infq1);
-    gzclose(fp_outfq1);
-
-    if (pe_mode) {
-         kseq_destroy(seq2);
-         gzclose(fp_infq2);
-         gzclose(fp_outfq2);
+    LOG_INFO("GC content in (R1)\t= %.1f%%\n", n_bases_in ? 100.0*n_gc_in/n_bases_in : 0.0);
+
+    reader_close(&in1);
+    if (close_outputs(fp_outfq1, n_outs) | close_outputs(fp_outfq2, n_outs)
+        | out_cache_free(&out_cache) | demux_free(&demux)
+        | close_outputs(&merge_out, 1)) {
+         LOG_ERROR("%s\n", "Couldn't properly close output files");
+         rc = EXIT_FAILURE;
     }
+    free(fp_outfq1);
+    free(fp_outfq2);
+    adapters_free(&adapters);
+    free(rc_buf.s);
+    free(trim_buf.s);
+    free(merged.seq.s);
+    free(merged.qual.s);
+    free(out_spec.hdr.s);
+    dedup_free(&dedup);
+    packed_seq_free(&packed1);
+    packed_seq_free(&packed2);
+
+    reader_close(&in2);
     free_args(& args);
 
     /* fclose(stdout); fclose(stderr); */
@@ -27,6 +27,11 @@
 
 /* Last Modified: 12APR2009 */
 
+/* Modified for famas: line-based reading of sequence and quality
+   (ks_getuntil2() with append and KS_SEP_LINE), so that long reads
+   are copied in blocks instead of per character, and KSEQ_INIT2()
+   for a custom stream buffer size. */
+
 #ifndef AC_KSEQ_H
 #define AC_KSEQ_H
 
@@ -36,7 +41,8 @@
 
 #define KS_SEP_SPACE 0 // isspace(): \t, \n, \v, \f, \r
 #define KS_SEP_TAB   1 // isspace() && !' '
-#define KS_SEP_MAX   1
+#define KS_SEP_LINE  2 // line separator: "\n" (Unix) or "\r\n" (Windows)
+#define KS_SEP_MAX   2
 
 #define __KS_TYPE(type_t)						\
 	typedef struct __kstream_t {				\
@@ -90,10 +96,11 @@ typedef struct __kstring_t {
 #endif
 
 #define __KS_GETUNTIL(__read, __bufsize)								\
-	static int ks_getuntil(kstream_t *ks, int delimiter, kstring_t *str, int *dret) \
+	static int ks_getuntil2(kstream_t *ks, int delimiter, kstring_t *str, int *dret, int append) \
 	{																	\
+		int gotany = 0;													\
 		if (dret) *dret = 0;											\
-		str->l = 0;														\
+		str->l = append? str->l : 0;									\
 		if (ks->begin >= ks->end && ks->is_eof) return -1;				\
 		for (;;) {														\
 			int i;														\
@@ -105,7 +112,10 @@ typedef struct __kstring_t {
 					if (ks->end == 0) break;							\
 				} else break;											\
 			}															\
-			if (delimiter > KS_SEP_MAX) {								\
+			if (delimiter == KS_SEP_LINE) {								\
+				char *sep = (char*)memchr(ks->buf + ks->begin, '\n', ks->end - ks->begin); \
+				i = sep? sep - ks->buf : ks->end;						\
+			} else if (delimiter > KS_SEP_MAX) {						\
 				for (i = ks->begin; i < ks->end; ++i)					\
 					if (ks->buf[i] == delimiter) break;					\
 			} else if (delimiter == KS_SEP_SPACE) {						\
@@ -115,11 +125,12 @@ typedef struct __kstring_t {
 				for (i = ks->begin; i < ks->end; ++i)					\
 					if (isspace(ks->buf[i]) && ks->buf[i] != ' ') break; \
 			} else i = 0; /* never come to here! */						\
-			if (str->m - str->l < i - ks->begin + 1) {					\
+			if (str->m - str->l < (size_t)(i - ks->begin + 1)) {		\
 				str->m = str->l + (i - ks->begin) + 1;					\
 				kroundup32(str->m);										\
 				str->s = (char*)realloc(str->s, str->m);				\
 			}															\
+			gotany = 1;													\
 			memcpy(str->s + str->l, ks->buf + ks->begin, i - ks->begin); \
 			str->l = str->l + (i - ks->begin);							\
 			ks->begin = i + 1;											\
@@ -128,13 +139,16 @@ typedef struct __kstring_t {
 				break;													\
 			}															\
 		}																\
-		if (str->l == 0) {												\
+		if (!gotany && ks_eof(ks)) return -1;							\
+		if (str->s == 0) {												\
 			str->m = 1;													\
 			str->s = (char*)calloc(1, 1);								\
-		}																\
+		} else if (delimiter == KS_SEP_LINE && str->l > 0 && str->s[str->l-1] == '\r') --str->l; \
 		str->s[str->l] = '\0';											\
 		return str->l;													\
-	}
+	}																	\
+	static inline int ks_getuntil(kstream_t *ks, int delimiter, kstring_t *str, int *dret) \
+	{ return ks_getuntil2(ks, delimiter, str, dret, 0); }
 
 #define KSTREAM_INIT(type_t, __read, __bufsize) \
 	__KS_TYPE(type_t)							\
@@ -179,18 +193,22 @@ typedef struct __kstring_t {
 		} /* the first header char has been read */						\
 		seq->comment.l = seq->seq.l = seq->qual.l = 0;					\
 		if (ks_getuntil(ks, 0, &seq->name, &c) < 0) return -1;			\
-		if (c != '\n') ks_getuntil(ks, '\n', &seq->comment, 0);			\
+		if (c != '\n') ks_getuntil(ks, KS_SEP_LINE, &seq->comment, 0);	\
+		if (seq->seq.s == 0) { /* we can do this in the loop below, but that is slower */ \
+			seq->seq.m = 256;											\
+			seq->seq.s = (char*)malloc(seq->seq.m);						\
+		}																\
 		while ((c = ks_getc(ks)) != -1 && c != '>' && c != '+' && c != '@') { \
-			if (isgraph(c)) { /* printable non-space character */		\
-				if (seq->seq.l + 1 >= seq->seq.m) { /* double the memory */ \
-					seq->seq.m = seq->seq.l + 2;						\
-					kroundup32(seq->seq.m); /* rounded to next closest 2^k */ \
-					seq->seq.s = (char*)realloc(seq->seq.s, seq->seq.m); \
-				}														\
-				seq->seq.s[seq->seq.l++] = (char)c;						\
-			}															\
+			if (c == '\n') continue; /* skip empty lines */				\
+			seq->seq.s[seq->seq.l++] = c; /* safe: always space for 1 char */ \
+			ks_getuntil2(ks, KS_SEP_LINE, &seq->seq, 0, 1); /* rest of the line */ \
 		}																\
 		if (c == '>' || c == '@') seq->last_char = c; /* the first header char has been read */	\
+		if (seq->seq.l + 1 >= seq->seq.m) { /* seq->seq.s[seq->seq.l] below may be out of bounds */ \
+			seq->seq.m = seq->seq.l + 2;								\
+			kroundup32(seq->seq.m); /* rounded to next closest 2^k */	\
+			seq->seq.s = (char*)realloc(seq->seq.s, seq->seq.m);		\
+		}																\
 		seq->seq.s[seq->seq.l] = 0;	/* null terminated string */		\
 		if (c != '+') return seq->seq.l; /* FASTA */					\
 		if (seq->qual.m < seq->seq.m) {	/* allocate enough memory */	\
@@ -199,9 +217,7 @@ typedef struct __kstring_t {
 		}																\
 		while ((c = ks_getc(ks)) != -1 && c != '\n'); /* skip the rest of '+' line */ \
 		if (c == -1) return -2; /* we should not stop here */			\
-		while ((c = ks_getc(ks)) != -1 && seq->qual.l < seq->seq.l)		\
-			if (c >= 33 && c <= 127) seq->qual.s[seq->qual.l++] = (unsigned char)c;	\
-		seq->qual.s[seq->qual.l] = 0; /* null terminated string */		\
+		while (ks_getuntil2(ks, KS_SEP_LINE, &seq->qual, 0, 1) >= 0 && seq->qual.l < seq->seq.l); \
 		seq->last_char = 0;	/* we have not come to the next header line */ \
 		if (seq->seq.l != seq->qual.l) return -2; /* qual string is shorter than seq string */ \
 		return seq->seq.l;												\
@@ -214,10 +230,12 @@ typedef struct __kstring_t {
 		kstream_t *f;							\
 	} kseq_t;
 
-#define KSEQ_INIT(type_t, __read)				\
-	KSTREAM_INIT(type_t, __read, 4096)			\
+#define KSEQ_INIT2(type_t, __read, __bufsize)	\
+	KSTREAM_INIT(type_t, __read, __bufsize)		\
 	__KSEQ_TYPE(type_t)							\
 	__KSEQ_BASIC(type_t)						\
 	__KSEQ_READ
 
+#define KSEQ_INIT(type_t, __read) KSEQ_INIT2(type_t, __read, 4096)
+
 #endif
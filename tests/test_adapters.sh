@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# test adapter trimming
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+oext=.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+adapter=GTTCGTCTTCTGCCGTATGCTCTA
+fa=$odir/adapters.fa
+echo -e ">my_adapter\n$adapter" > $fa
+
+# insert adapter after 30 bases, keeping read length
+i=$odir/in$oext
+gzip -dc $f | awk -v a=$adapter '{if (NR%4==2) {s=substr($0, 1, 30) a $0; print substr(s, 1, length($0))} else {print}}' | gzip > $i
+o=$odir/out$oext
+
+
+cmd="$famas -i $i -o $o --adapters $odir/no-such-file.fa --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+cmd="$famas -i $i -o $o --adapters $fa --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_in=$(gzip -dc $i | awk 'END {print NR/4}')
+num_out=$(gzip -dc $o | awk 'END {print NR/4}')
+max_len=$(gzip -dc $o | awk 'NR%4==2 {print length($0)}' | sort -n | tail -n 1)
+if [ $num_in -ne $num_out ] || [ $max_len -ne 30 ]; then
+    echoerror "Expected $num_in reads of max. 30 bp but got $num_out of max. $max_len bp (command was $cmd)"
+    exit 1
+fi
+num_adapter=$(gzip -dc $o | grep -c ${adapter:0:10})
+if [ $num_adapter -ne 0 ]; then
+    echoerror "Found adapter in $o (command was $cmd)"
+    exit 1
+fi
+
+
+# built-in adapters don't match
+cmd="$famas -i $i -o $o --adapters all --quiet --overwrite"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_bases_i=$(gzip -dc $i | awk 'NR%4==2' | wc -c)
+num_bases_o=$(gzip -dc $o | awk 'NR%4==2' | wc -c)
+if [ $num_bases_i -ne $num_bases_o ]; then
+    echoerror "Unexpected trimming with built-in adapters (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
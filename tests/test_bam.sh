@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# test unaligned bam output and input
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+fq1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+fq2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+o=$odir/out.bam
+# BGZF end-of-file marker
+eof_md5=$(printf '\037\213\010\004\000\000\000\000\000\377\006\000BC\002\000\033\000\003\000\000\000\000\000\000\000\000\000' | $md5)
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $o -p $odir/out_2.bam --out-format bam --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $o --out-format bam --rg-id mux079 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+if ! gzip -t $o; then
+    echoerror "Output is not a valid BGZF file (command was $cmd)"
+    exit 1
+fi
+if [ "$(tail -c 28 $o | $md5)" != "$eof_md5" ]; then
+    echoerror "Missing BGZF end-of-file marker (command was $cmd)"
+    exit 1
+fi
+if [ "$(gzip -dc $o | head -c 4 | od -An -c | tr -d ' ')" != 'BAM001' ]; then
+    echoerror "Missing BAM magic (command was $cmd)"
+    exit 1
+fi
+if ! gzip -dc $o | grep -a -q "@RG	ID:mux079	SM:mux079"; then
+    echoerror "Missing read group in header (command was $cmd)"
+    exit 1
+fi
+# both mates in one file, each with read group tag
+num_in=$(gzip -dc $fq1 $fq2 | awk 'END {print NR/4}')
+num_out=$(gzip -dc $o | grep -a -o "RGZmux079" | wc -l)
+if [ $num_in -ne $num_out ]; then
+    echoerror "Expected $num_in records but got $num_out (command was $cmd)"
+    exit 1
+fi
+
+
+# round trip: mates are re-paired into two fastq files
+r1=$odir/rt_1.fastq.gz
+r2=$odir/rt_2.fastq.gz
+cmd="$famas -i $o --in-format bam -o $r1 -l 1 --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $o --in-format bam -o $r1 -p $r2 -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $fq1 -j $fq2 -o $odir/fq_1.fastq.gz -p $odir/fq_2.fastq.gz -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+for i in 1 2; do
+    md5_fq=$(gzip -dc $odir/fq_$i.fastq.gz | awk 'NR%4==2 || NR%4==0' | $md5)
+    md5_rt=$(gzip -dc $odir/rt_$i.fastq.gz | awk 'NR%4==2 || NR%4==0' | $md5)
+    if [ "$md5_fq" != "$md5_rt" ]; then
+        echoerror "Reads of mate $i differ after BAM round trip"
+        exit 1
+    fi
+done
+
+
+# appending: header only when new, single end-of-file marker at end
+a=$odir/append.bam
+eof_hex=$(printf '\037\213\010\004\000\000\000\000\000\377\006\000BC\002\000\033\000\003\000\000\000\000\000\000\000\000\000' | od -An -v -tx1 | tr -d ' \n')
+for n in 1 2; do
+    cmd="$famas -i $fq1 -j $fq2 -o $a --out-format bam -l 1 -a --quiet"
+    if ! eval $cmd; then
+        echoerror "The following command failed: $cmd"
+        exit 1
+    fi
+done
+if [ "$(gzip -dc $a | head -c 4 | od -An -c | tr -d ' ')" != 'BAM001' ]; then
+    echoerror "Missing BAM magic after appending to new file (command was $cmd)"
+    exit 1
+fi
+if [ "$(gzip -dc $a | grep -a -c '@HD')" -ne 1 ]; then
+    echoerror "Expected exactly one header after appending (command was $cmd)"
+    exit 1
+fi
+num_eof=$(od -An -v -tx1 $a | tr -d ' \n' | grep -o $eof_hex | wc -l)
+if [ $num_eof -ne 1 ] || [ "$(tail -c 28 $a | $md5)" != "$eof_md5" ]; then
+    echoerror "Expected one end-of-file marker at the end but got $num_eof (command was $cmd)"
+    exit 1
+fi
+cmd="$famas -i $a --in-format bam -o $odir/app_1.fastq -p $odir/app_2.fastq -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_in=$(gzip -dc $fq1 | awk 'END {print NR/4}')
+num_out=$(awk 'END {print NR/4}' $odir/app_1.fastq)
+if [ $((2 * num_in)) -ne $num_out ]; then
+    echoerror "Expected $((2 * num_in)) pairs after appending twice but got $num_out (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -42,6 +42,14 @@ fi
 #echodebug "step $step done"; let step=step+1
 
 
+stage="quality binning with fasta output"
+cmd="$famas -i $i -o $odir/o.fasta.gz --out-format fasta --qual-bin illumina8 --quiet"
+if eval $cmd 2>log.txt; then
+    echoerror "The following command should have failed ($stage): $cmd"
+    exit 1
+fi
+
+
 # overwrite option should work.
 stage="overwrite enabled"
 cmd="$famas -i $i -o $o --quiet --overwrite"
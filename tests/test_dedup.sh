@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# test exact duplicate removal
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+fq1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+fq2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+
+cmd="$famas -i $fq1 -o $odir/out.fastq.gz --dedup-mem 10 --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# every read (pair) twice
+gzip -dc $fq1 $fq1 | gzip > $odir/dup_1.fastq.gz
+gzip -dc $fq2 $fq2 | gzip > $odir/dup_2.fastq.gz
+cmd="$famas -i $fq1 -j $fq2 -o $odir/fq_1.fastq.gz -p $odir/fq_2.fastq.gz -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $odir/dup_1.fastq.gz -j $odir/dup_2.fastq.gz -o $odir/dd_1.fastq.gz -p $odir/dd_2.fastq.gz -l 1 --dedup --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+for i in 1 2; do
+    if [ "$(gzip -dc $odir/fq_$i.fastq.gz | $md5)" != "$(gzip -dc $odir/dd_$i.fastq.gz | $md5)" ]; then
+        echoerror "Duplicates of mate $i not removed (command was $cmd)"
+        exit 1
+    fi
+done
+
+
+# pairs are only duplicates if both mates are
+gzip -dc $fq2 $fq1 | gzip > $odir/mix_2.fastq.gz
+cmd="$famas -i $odir/dup_1.fastq.gz -j $odir/mix_2.fastq.gz -o $odir/mix_1.out.fastq.gz -p $odir/mix_2.out.fastq.gz -l 1 --dedup --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_uniq=$(paste <(gzip -dc $odir/dup_1.fastq.gz | awk 'NR%4==2') <(gzip -dc $odir/mix_2.fastq.gz | awk 'NR%4==2') \
+               | sort -u | wc -l)
+num_out=$(gzip -dc $odir/mix_1.out.fastq.gz | awk 'END {print NR/4}')
+if [ $num_uniq -ne $num_out ]; then
+    echoerror "Expected $num_uniq pairs but got $num_out (command was $cmd)"
+    exit 1
+fi
+
+
+# unique reads beyond memory limit (Bloom filter)
+awk 'BEGIN {for (i=0; i<40000; i++) {s=""; n=i; for (j=0; j<20; j++) {s=s substr("ACGT", n%4+1, 1); n=int(n/4)}
+     printf "@r%d\n%s\n+\nIIIIIIIIIIIIIIIIIIII\n", i, s}}' | gzip > $odir/uniq.fastq.gz
+cmd="$famas -i $odir/uniq.fastq.gz -o $odir/uniq.out.fastq.gz -l 1 --dedup --dedup-mem 1 --quiet"
+if ! eval $cmd 2>/dev/null; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_out=$(gzip -dc $odir/uniq.out.fastq.gz | awk 'END {print NR/4}')
+if [ $num_out -ne 40000 ]; then
+    echoerror "Expected 40000 reads but got $num_out (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# test demultiplexing by barcode
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+f2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+oext=.fastq.gz
+
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+# assign barcodes: s1 exact, s2 exact, s1 with one mismatch and unknown
+i1=$odir/in_1$oext
+i2=$odir/in_2$oext
+for f in $f1 $f2; do
+    gzip -dc $f | awk 'BEGIN {split("ATCACG CGATGT ATCACT GGGGGG", bc, " ")}
+      NR%4==1 {n++; sub(/:[ACGTN]+$/, ":" bc[n%4+1])} {print}' | gzip > $odir/tmp$oext
+    if [ $f == $f1 ]; then mv $odir/tmp$oext $i1; else mv $odir/tmp$oext $i2; fi
+done
+sheet=$odir/samplesheet.txt
+cat > $sheet <<EOT
+# sample barcode
+s1 ATCACG
+s2 CGATGT
+EOT
+
+o1=$odir/1-XXXXXX$oext
+o2=$odir/2-XXXXXX$oext
+cmd="$famas -i $i1 -j $i2 -o $o1 -p $o2 --samplesheet $sheet --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+for s in s1:50 s2:25 Undetermined:25; do
+    sample=${s%:*}
+    expected=${s#*:}
+    for o in $o1 $o2; do
+        f=$(echo $o | sed -e "s,XXXXXX,$sample,")
+        n=$(gzip -dc $f | awk 'END {print NR/4}')
+        if [ "$n" -ne "$expected" ]; then
+            echoerror "Expected $expected reads but got $n in $f (command was $cmd)"
+            exit 1
+        fi
+    done
+done
+# check content
+i1md5=$(gzip -dc $i1 | sort | $md5 | cut -f 1 -d ' ')
+o1md5=$(gzip -dc $(ls $(echo $o1 | sed -e 's,XXXXXX,*,')) | sort | $md5 | cut -f 1 -d ' ') || exit 1
+if [ $i1md5 != $o1md5 ]; then
+    echoerror "Content changed while demultiplexing"
+    exit 1
+fi
+
+
+cmd="$famas -i $i1 -o $o1 --samplesheet $sheet --barcode-mismatches 0 --quiet --overwrite"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+n=$(gzip -dc $(echo $o1 | sed -e "s,XXXXXX,Undetermined,") | awk 'END {print NR/4}')
+if [ "$n" -ne 50 ]; then
+    echoerror "Expected 50 undetermined reads but got $n (command was $cmd)"
+    exit 1
+fi
+
+
+# barcodes two mismatches apart clash if one mismatch is allowed
+cat > $sheet <<EOT
+s1 ATCACG
+s2 ATCAGT
+EOT
+cmd="$famas -i $i1 -o $o1 --samplesheet $sheet --barcode-mismatches 1 --quiet --overwrite"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -0,0 +1,143 @@
+#!/bin/bash
+#
+# test binary block-columnar (fbin) output and input
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+fq1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+fq2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+o=$odir/out.fbin
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $o -p $odir/out_2.fbin --out-format fbin --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $o --out-format fbin -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+if [ "$(head -c 4 $o)" != 'FBIN' ] || [ "$(tail -c 4 $o)" != 'FEND' ]; then
+    echoerror "Missing fbin magic or trailer (command was $cmd)"
+    exit 1
+fi
+cmd="$famas -i $fq1 -j $fq2 -o $o --out-format fbin -a --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# round trip: identical to fastq output
+r1=$odir/rt_1.fastq.gz
+r2=$odir/rt_2.fastq.gz
+cmd="$famas -i $o --in-format fbin -o $r1 -p $r2 -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $fq1 -j $fq2 -o $odir/fq_1.fastq.gz -p $odir/fq_2.fastq.gz -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+for i in 1 2; do
+    md5_fq=$(gzip -dc $odir/fq_$i.fastq.gz | $md5)
+    md5_rt=$(gzip -dc $odir/rt_$i.fastq.gz | $md5)
+    if [ "$md5_fq" != "$md5_rt" ]; then
+        echoerror "Mate $i differs after fbin round trip"
+        exit 1
+    fi
+done
+
+
+# ambiguous and lower case bases survive the 2-bit packing
+fq=$odir/n.fastq.gz
+printf '@a\nACGTNNNNacgtRYACGTAC\n+\nIIIIIIIIIIIIIIIIIIII\n@b x\nNNACGTACGTACGTACGTNN\n+\n####IIIIIIIIIIIIIIII\n' | gzip > $fq
+cmd="$famas -i $fq -o $odir/n.fbin --out-format fbin -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $odir/n.fbin --in-format fbin -o $odir/n_rt.fastq.gz -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+if [ "$(gzip -dc $fq | $md5)" != "$(gzip -dc $odir/n_rt.fastq.gz | $md5)" ]; then
+    echoerror "Reads differ after fbin round trip (command was $cmd)"
+    exit 1
+fi
+
+
+# block index: trailer points to the index, whose entries point to
+# consecutive blocks (each walked column by column) and count their
+# rows. prints number of blocks and rows
+fbin_index() {
+    local f=$1 size idx n i off row pos c rows=0 end
+    size=$(wc -c < $f)
+    idx=$(od -An -tu8 -j $((size-12)) -N 8 $f | tr -d ' ')
+    if [ "$(tail -c +$((idx+1)) $f | head -c 4)" != 'FIDX' ]; then
+        return 1
+    fi
+    n=$(od -An -tu4 -j $((idx+4)) -N 4 $f | tr -d ' ')
+    end=8
+    for ((i=0; i<n; i++)); do
+        off=$(od -An -tu8 -j $((idx+8+16*i)) -N 8 $f | tr -d ' ')
+        row=$(od -An -tu8 -j $((idx+16+16*i)) -N 8 $f | tr -d ' ')
+        if [ $off -ne $end ] || [ $row -ne $rows ] \
+               || [ "$(tail -c +$((off+1)) $f | head -c 4)" != 'FBLK' ]; then
+            return 1
+        fi
+        rows=$((rows + $(od -An -tu4 -j $((off+4)) -N 4 $f | tr -d ' ')))
+        pos=$((off+8))
+        for c in 1 2 3 4 5 6; do
+            pos=$((pos + 8 + $(od -An -tu4 -j $((pos+4)) -N 4 $f | tr -d ' ')))
+        done
+        end=$pos
+    done
+    if [ $end -ne $idx ]; then
+        return 1
+    fi
+    echo $n $rows
+}
+fq=$odir/many.fastq.gz
+awk 'BEGIN {srand(1); for (i=0; i<20000; i++) {s=""; for (j=0; j<150; j++) {s=s substr("ACGT", int(rand()*4)+1, 1)}
+     q=s; gsub(/[ACGT]/, "I", q); printf "@r%d\n%s\n+\n%s\n", i, s, q}}' | gzip > $fq
+for f in $o $odir/many.fbin; do
+    if [ $f == $o ]; then
+        num_exp=$(gzip -dc $fq1 $fq2 | awk 'END {print NR/4}')
+    else
+        cmd="$famas -i $fq -o $f --out-format fbin -3 0 -l 1 --quiet"
+        if ! eval $cmd; then
+            echoerror "The following command failed: $cmd"
+            exit 1
+        fi
+        num_exp=20000
+    fi
+    if ! index=$(fbin_index $f); then
+        echoerror "Invalid block index in $f"
+        exit 1
+    fi
+    set -- $index
+    if [ $2 -ne $num_exp ] || { [ $f != $o ] && [ $1 -lt 2 ]; }; then
+        echoerror "Block index of $f lists $2 rows in $1 blocks, expected $num_exp rows"
+        exit 1
+    fi
+done
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# test interleaved input and output
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+fq1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+fq2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+oext=.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+o1=$odir/out_1$oext
+o2=$odir/out_2$oext
+d1=$odir/deinterleaved_1$oext
+d2=$odir/deinterleaved_2$oext
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $o1 -p $o2 --interleaved-out --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $fq1 -o $o1 --interleaved-out --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# interleaving to stdout and deinterleaving from stdin has to
+# reproduce plain paired-end output
+cmd="$famas -i $fq1 -j $fq2 -o $o1 -p $o2 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $fq1 -j $fq2 -o - --interleaved-out -l 1 --quiet | $famas -i - --interleaved-in -o $d1 -p $d2 -3 0 -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+for i in 1 2; do
+    eval o=\$o$i
+    eval d=\$d$i
+    if [ "$(gzip -dc $o | $md5)" != "$(gzip -dc $d | $md5)" ]; then
+        echoerror "Mate $i differs after interleaving and deinterleaving (command was $cmd)"
+        exit 1
+    fi
+done
+
+
+# odd number of reads means a mate is missing
+cmd="gzip -dc $fq1 | head -n 12 | $famas -i - --interleaved-in -o $d1 -p $d2 -f --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
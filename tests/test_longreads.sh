@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# test long reads: input/output round trip, mean quality filter and
+# cropping
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+oext=.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+# three 100kb reads. first and last are Q20 (mean quality 20), second
+# one mixes Q10 and Q40 (arithmetic mean 25, but mean error
+# probability gives roughly Q13)
+i=$odir/in$oext
+awk 'BEGIN {srand(42);
+     for (r=1; r<=3; r++) {
+         s=""; q="";
+         for (j=0; j<100000; j++) {
+             s=s substr("ACGT", int(rand()*4)+1, 1);
+             q=q (r==2 ? (j%2 ? "I" : "+") : "5");
+         }
+         printf("@read%d\n%s\n+\n%s\n", r, s, q);
+     }}' | gzip > $i
+o=$odir/out$oext
+
+
+cmd="$famas -i $i -o $o --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+md5_in=$(gzip -dc $i | $md5 | cut -f 1 -d ' ')
+md5_out=$(gzip -dc $o | $md5 | cut -f 1 -d ' ')
+if [ "$md5_in" != "$md5_out" ]; then
+    echoerror "Output differs from input (command was $cmd)"
+    exit 1
+fi
+
+
+cmd="$famas -i $i -o $o --min-mean-qual 19 --quiet --overwrite"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+names=$(gzip -dc $o | awk 'NR%4==1' | tr '\n' ' ')
+if [ "$names" != "@read1 @read3 " ]; then
+    echoerror "Expected read1 and read3 to pass mean quality filter, but got $names (command was $cmd)"
+    exit 1
+fi
+
+
+cmd="$famas -i $i -o $o --headcrop 100 --tailcrop 1000 --quiet --overwrite"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+lens=$(gzip -dc $o | awk 'NR%4==2 {print length($0)}' | sort -u)
+if [ "$lens" != "98900" ]; then
+    echoerror "Expected cropped reads of length 98900, but got $lens (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
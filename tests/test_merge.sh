@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# test merging of overlapping pairs
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+oext=.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+# each read is the insert: mate 1 covers the first 40 bases, mate 2
+# the last 40 bases (reverse complemented)
+i1=$odir/in_1$oext
+i2=$odir/in_2$oext
+gzip -dc $f | awk '{print substr($0, 1, 40)}' | gzip > $i1
+gzip -dc $f | awk \
+    'function rc(s,  r, i, c) {r=""; for (i=length(s); i>0; i--) {c=substr(s, i, 1); r=r (c=="A" ? "T" : c=="C" ? "G" : c=="G" ? "C" : c=="T" ? "A" : "N")}; return r}
+    function rev(s,  r, i) {r=""; for (i=length(s); i>0; i--) {r=r substr(s, i, 1)}; return r}
+    {if (NR%4==2) {print rc(substr($0, length($0)-39))} else if (NR%4==0) {print rev(substr($0, length($0)-39))} else if (NR%4==1) {sub(" 1:", " 2:"); print} else {print}}' | gzip > $i2
+o1=$odir/out_1$oext
+o2=$odir/out_2$oext
+om=$odir/merged$oext
+
+
+cmd="$famas -i $i1 -o $o1 --merge $om --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# no quality trimming, so that merged reads have to equal the input
+cmd="$famas -i $i1 -j $i2 -o $o1 -p $o2 --merge $om --overlap-min-len 20 -3 0 -l 10 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_merged=$(gzip -dc $om | awk 'END {print NR/4}')
+num_unmerged=$(gzip -dc $o1 | awk 'END {print NR/4}')
+if [ $num_merged -ne 100 ] || [ $num_unmerged -ne 0 ]; then
+    echoerror "Expected 100 merged pairs but got $num_merged merged and $num_unmerged unmerged (command was $cmd)"
+    exit 1
+fi
+md5_in=$(gzip -dc $f | awk 'NR%4==2' | $md5)
+md5_out=$(gzip -dc $om | awk 'NR%4==2' | $md5)
+if [ "$md5_in" != "$md5_out" ]; then
+    echoerror "Merged reads differ from original inserts (command was $cmd)"
+    exit 1
+fi
+
+
+# numbered names stay unique across merged and unmerged output
+gzip -dc $i1 ./fastq-sanger/mux079-pdm003_s1.fastq.gz | gzip > $odir/mix_1$oext
+gzip -dc $i2 ./fastq-sanger/mux079-pdm003_s2.fastq.gz | gzip > $odir/mix_2$oext
+cmd="$famas -i $odir/mix_1$oext -j $odir/mix_2$oext -o $o1 -p $o2 --merge $om --overlap-min-len 20 -3 0 -l 10 --rename number -f --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_names=$(gzip -dc $om $o1 | awk 'NR%4==1 {print $1}' | sort | uniq | wc -l)
+num_reads=$(gzip -dc $om $o1 | awk 'END {print NR/4}')
+if [ $num_names -ne $num_reads ] || [ $num_reads -ne 200 ]; then
+    echoerror "Expected 200 uniquely numbered reads but got $num_names names for $num_reads reads (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# test overlap based trimming of pairs with short inserts
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+oext=.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+ins_len=35
+
+# 35bp insert of each read, both mates reading into (different) adapters
+i1=$odir/in_1$oext
+i2=$odir/in_2$oext
+gzip -dc $f | awk -v n=$ins_len -v a=AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC \
+    '{if (NR%4==2) {print substr(substr($0, 1, n) a, 1, length($0))} else {print}}' | gzip > $i1
+gzip -dc $f | awk -v n=$ins_len -v a=AGATCGGAAGAGCGTCGTGTAGGGAAAGAGTGT \
+    'function rc(s,  r, i, c) {r=""; for (i=length(s); i>0; i--) {c=substr(s, i, 1); r=r (c=="A" ? "T" : c=="C" ? "G" : c=="G" ? "C" : c=="T" ? "A" : "N")}; return r}
+    {if (NR%4==2) {print substr(rc(substr($0, 1, n)) a, 1, length($0))} else if (NR%4==1) {sub(" 1:", " 2:"); print} else {print}}' | gzip > $i2
+o1=$odir/out_1$oext
+o2=$odir/out_2$oext
+
+
+cmd="$famas -i $i1 -o $o1 --trim-overlap --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+cmd="$famas -i $i1 -j $i2 -o $o1 -p $o2 --trim-overlap --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_in=$(gzip -dc $i1 | awk 'END {print NR/4}')
+for o in $o1 $o2; do
+    num_out=$(gzip -dc $o | awk 'END {print NR/4}')
+    max_len=$(gzip -dc $o | awk 'NR%4==2 {print length($0)}' | sort -n | tail -n 1)
+    if [ $num_in -ne $num_out ] || [ $max_len -ne $ins_len ]; then
+        echoerror "Expected $num_in reads of max. $ins_len bp in $o but got $num_out of max. $max_len bp (command was $cmd)"
+        exit 1
+    fi
+done
+num_adapter=$(gzip -dc $o1 $o2 | grep -c AGATCGGAAGAGC)
+if [ $num_adapter -ne 0 ]; then
+    echoerror "Found adapter in output (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# test reverse complementing of output reads
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+fq1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+fq2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+
+cmd="$famas -i $fq1 -o $odir/se.fastq.gz --revcomp-r2 --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+cmd="$famas -i $fq1 -j $fq2 -o $odir/fq_1.fastq.gz -p $odir/fq_2.fastq.gz -l 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$famas -i $fq1 -j $fq2 -o $odir/rc_1.fastq.gz -p $odir/rc_2.fastq.gz -l 1 --revcomp-r2 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+if [ "$(gzip -dc $odir/fq_1.fastq.gz | $md5)" != "$(gzip -dc $odir/rc_1.fastq.gz | $md5)" ]; then
+    echoerror "First reads changed although only --revcomp-r2 was given"
+    exit 1
+fi
+md5_fq=$(gzip -dc $odir/fq_2.fastq.gz | awk 'NR%4==2' | rev | tr ACGTacgt TGCAtgca | $md5)
+md5_rc=$(gzip -dc $odir/rc_2.fastq.gz | awk 'NR%4==2' | $md5)
+if [ "$md5_fq" != "$md5_rc" ]; then
+    echoerror "Second reads are not reverse complemented (command was $cmd)"
+    exit 1
+fi
+md5_fq=$(gzip -dc $odir/fq_2.fastq.gz | awk 'NR%4==0' | rev | $md5)
+md5_rc=$(gzip -dc $odir/rc_2.fastq.gz | awk 'NR%4==0' | $md5)
+if [ "$md5_fq" != "$md5_rc" ]; then
+    echoerror "Qualities of second reads are not reversed (command was $cmd)"
+    exit 1
+fi
+
+
+# twice is a no-op
+cmd="$famas -i $odir/rc_1.fastq.gz -j $odir/rc_2.fastq.gz -o $odir/rc2_1.fastq.gz -p $odir/rc2_2.fastq.gz -l 1 --revcomp-r2 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+if [ "$(gzip -dc $odir/fq_2.fastq.gz | $md5)" != "$(gzip -dc $odir/rc2_2.fastq.gz | $md5)" ]; then
+    echoerror "Reverse complementing twice changed reads (command was $cmd)"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
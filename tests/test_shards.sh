@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# test shard functionality
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f1=../data/SRR499813_1.Q2-and-N.fastq.gz
+f2=../data/SRR499813_2.Q2-and-N.fastq.gz
+oext=.fastq.gz
+shards=4
+
+
+# should fail if XXXXXX not part of template
+#
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+o1=$odir/1.$oext
+o2=$odir/2.$oext
+cmd="$famas -i $f1 -j $f2 -o $o1 -p $o2 --shards $shards --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# should fail if combined with splitting
+#
+o1=$odir/1-XXXXXX$oext
+o2=$odir/2-XXXXXX$oext
+cmd="$famas -i $f1 -j $f2 -o $o1 -p $o2 --shards $shards --split-every 1000 --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# test we get exactly the requested number of shards and that input
+# and sharded output has the same content (no-filter)
+#
+cmd="$famas -i $f1 -j $f2 -o $o1 -p $o2 --shards $shards --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+
+num_o1=$(ls $(echo $o1 | sed -e 's,XXXXXX,*,') | wc -l)
+num_o2=$(ls $(echo $o2 | sed -e 's,XXXXXX,*,') | wc -l)
+if [ $num_o1 -ne $shards ] || [ $num_o2 -ne $shards ]; then
+    echoerror "Expected $shards output files per mate"
+    exit 1
+fi
+
+# check content
+f1md5=$(gzip -dc $f1 | sort | $md5 | cut -f 1 -d ' ')
+f2md5=$(gzip -dc $f2 | sort | $md5 | cut -f 1 -d ' ')
+o1md5=$(gzip -dc $(ls $(echo $o1 | sed -e 's,XXXXXX,*,')) | sort | $md5 | cut -f 1 -d ' ') || exit 1
+o2md5=$(gzip -dc $(ls $(echo $o2 | sed -e 's,XXXXXX,*,')) | sort | $md5 | cut -f 1 -d ' ') || exit 1
+if [ $f1md5 != $o1md5 ]; then
+    echoerror "Content changed while sharding first file: compare $f1 and $o1"
+    exit 1
+fi
+if [ $f2md5 != $o2md5 ]; then
+    echoerror "Content changed while sharding second file: compare $f2 and $o2"
+    exit 1
+fi
+
+# mates have to end up in the same shard
+for o in $(ls $(echo $o1 | sed -e 's,XXXXXX,*,')); do
+    p=$(echo $o | sed -e 's,/1-,/2-,')
+    n1=$(gzip -dc $o | awk 'NR%4==1 {sub(/\/1$/, ""); print}' | $md5)
+    n2=$(gzip -dc $p | awk 'NR%4==1 {sub(/\/2$/, ""); print}' | $md5)
+    if [ "$n1" != "$n2" ]; then
+        echoerror "Mates ended up in different shards: $o and $p"
+        exit 1
+    fi
+done
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi
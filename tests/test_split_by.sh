@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# test splitting by flowcell/lane/tile parsed from read names
+#
+
+
+source lib.sh || exit 1
+
+
+DEBUG=0
+f1=./fastq-sanger/mux079-pdm003_s1.fastq.gz
+f2=./fastq-sanger/mux079-pdm003_s2.fastq.gz
+oext=.fastq.gz
+
+odir=$(mktemp -d -t $0..sh.XXX) || exit 1
+
+# spread reads over three lanes and two tiles
+i1=$odir/in_1$oext
+i2=$odir/in_2$oext
+for f in $f1 $f2; do
+    gzip -dc $f | awk -F: 'BEGIN {OFS=":"} NR%4==1 {n++; $4=n%3+1; $5=1101+n%2} {print}' | gzip > $odir/tmp$oext
+    if [ $f == $f1 ]; then mv $odir/tmp$oext $i1; else mv $odir/tmp$oext $i2; fi
+done
+
+
+# unknown field should fail
+o1=$odir/1-XXXXXX$oext
+o2=$odir/2-XXXXXX$oext
+cmd="$famas -i $i1 -j $i2 -o $o1 -p $o2 --split-by foo --quiet"
+if eval $cmd 2>/dev/null; then
+    echoerror "The following command should have failed: $cmd"
+    exit 1
+fi
+
+
+# force reopening of outputs by allowing only one open
+cmd="$famas -i $i1 -j $i2 -o $o1 -p $o2 --split-by lane --max-open 1 --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_o1=$(ls $(echo $o1 | sed -e 's,XXXXXX,*,') | wc -l)
+num_o2=$(ls $(echo $o2 | sed -e 's,XXXXXX,*,') | wc -l)
+if [ $num_o1 -ne 3 ] || [ $num_o2 -ne 3 ]; then
+    echoerror "Expected 3 output files per mate"
+    exit 1
+fi
+for lane in 1 2 3; do
+    o=$(echo $o1 | sed -e "s,XXXXXX,C0JMGACXX-$lane,")
+    test -s $o || exit 1
+    num_other=$(gzip -dc $o | awk -F: 'NR%4==1' | grep -cv ":C0JMGACXX:$lane:")
+    if [ $num_other -ne 0 ]; then
+        echoerror "Found reads from other lanes in $o"
+        exit 1
+    fi
+done
+
+# check content
+i1md5=$(gzip -dc $i1 | sort | $md5 | cut -f 1 -d ' ')
+i2md5=$(gzip -dc $i2 | sort | $md5 | cut -f 1 -d ' ')
+o1md5=$(gzip -dc $(ls $(echo $o1 | sed -e 's,XXXXXX,*,')) | sort | $md5 | cut -f 1 -d ' ') || exit 1
+o2md5=$(gzip -dc $(ls $(echo $o2 | sed -e 's,XXXXXX,*,')) | sort | $md5 | cut -f 1 -d ' ') || exit 1
+if [ $i1md5 != $o1md5 ] || [ $i2md5 != $o2md5 ]; then
+    echoerror "Content changed while splitting by lane"
+    exit 1
+fi
+rm -f $(echo $o1 | sed -e 's,XXXXXX,*,') $(echo $o2 | sed -e 's,XXXXXX,*,')
+
+
+cmd="$famas -i $i1 -o $o1 --split-by tile --quiet"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+num_o1=$(ls $(echo $o1 | sed -e 's,XXXXXX,*,') | wc -l)
+if [ $num_o1 -ne 6 ]; then
+    echoerror "Expected 6 output files for tiles"
+    exit 1
+fi
+
+
+if [ $DEBUG -eq 1 ]; then
+    echodebug "Keeping $odir"
+else
+    test -d $odir && rm -rf $odir
+fi